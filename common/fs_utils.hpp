@@ -8,29 +8,386 @@
 #else
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CPP_UTILS_HAS_IO_URING 1
+#endif
+#endif
+// statx() 由 glibc 2.28 起提供
+#if defined(STATX_BLOCKS) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 28))
+#define CPP_UTILS_HAS_STATX 1
+#endif
+// copy_file_range() 由 glibc 2.27 起提供
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define CPP_UTILS_HAS_COPY_FILE_RANGE 1
+#endif
+#endif
+#endif
+
+#ifndef CPP_UTILS_HAS_IO_URING
+#define CPP_UTILS_HAS_IO_URING 0
+#endif
+
+#ifndef CPP_UTILS_HAS_STATX
+#define CPP_UTILS_HAS_STATX 0
+#endif
+
+#ifndef CPP_UTILS_HAS_COPY_FILE_RANGE
+#define CPP_UTILS_HAS_COPY_FILE_RANGE 0
 #endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <codecvt>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <system_error>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 #include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace {
 
+// ==============================================================================================
+//                                         并发工具
+// ==============================================================================================
+
+/**
+ * @brief A small work-stealing thread pool for recursive workloads.
+ *
+ * Every worker owns a deque. Tasks submitted from inside a worker go to the
+ * back of that worker's deque and are popped LIFO, so a traversal stays
+ * depth-first per thread and its frontier stays small. Idle workers steal
+ * from the front of the other deques, which hands out the oldest (usually
+ * largest) pending subtrees.
+ *
+ * Tasks may submit further tasks. wait() blocks until every submitted task,
+ * including the ones spawned transitively, has finished; it must not be
+ * called from a worker thread. The first exception thrown by a task is
+ * rethrown from wait().
+ */
+class WorkStealingPool {
+ public:
+  using Task = std::function<void()>;
+
+  /**
+   * @brief Start the worker threads.
+   *
+   * @param num_threads Number of workers, 0 means
+   * std::thread::hardware_concurrency().
+   */
+  explicit WorkStealingPool(std::size_t num_threads = 0) {
+    if (num_threads == 0) {
+      num_threads = std::thread::hardware_concurrency();
+    }
+    if (num_threads == 0) {
+      num_threads = 1;
+    }
+    for (std::size_t i = 0; i < num_threads; ++i) {
+      queues_.emplace_back(new Queue);
+    }
+    for (std::size_t i = 0; i < num_threads; ++i) {
+      threads_.emplace_back(&WorkStealingPool::worker_loop, this, i);
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_) {
+      t.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  /// Number of worker threads.
+  std::size_t size() const { return threads_.size(); }
+
+  /// Index of the calling worker in [0, size()), or size() if the caller is
+  /// not a worker of this pool.
+  std::size_t worker_index() const {
+    const WorkerSlot &slot = current_slot();
+    return slot.pool == this ? slot.index : size();
+  }
+
+  /// Queue a task. Safe to call from any thread, including from tasks.
+  void submit(Task task) {
+    ++pending_;
+    std::size_t index = worker_index();
+    if (index == size()) {
+      index = next_queue_++ % size();
+    }
+    // 先计数再入队：否则 worker 可能先取走任务并递减，使 queued_ 回绕
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      ++queued_;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues_[index]->mtx);
+      queues_[index]->tasks.push_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+
+  /// Block until all submitted tasks have finished.
+  void wait() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    done_cv_.wait(lock, [this] { return pending_ == 0; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+ private:
+  struct Queue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  struct WorkerSlot {
+    const WorkStealingPool *pool;
+    std::size_t index;
+  };
+
+  static WorkerSlot &current_slot() {
+    static thread_local WorkerSlot slot = {nullptr, 0};
+    return slot;
+  }
+
+  bool pop_task(std::size_t index, Task &task) {
+    {
+      Queue &own = *queues_[index];
+      std::lock_guard<std::mutex> lock(own.mtx);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        --queued_;
+        return true;
+      }
+    }
+    for (std::size_t k = 1; k < queues_.size(); ++k) {
+      Queue &victim = *queues_[(index + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mtx);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        --queued_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void worker_loop(std::size_t index) {
+    current_slot() = {this, index};
+    for (;;) {
+      Task task;
+      if (pop_task(index, task)) {
+        try {
+          task();
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mtx_);
+          if (!error_) {
+            error_ = std::current_exception();
+          }
+        }
+        if (--pending_ == 0) {
+          std::lock_guard<std::mutex> lock(mtx_);
+          done_cv_.notify_all();
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mtx_);
+      cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::condition_variable done_cv_;
+  std::atomic<std::size_t> pending_{0};
+  std::atomic<std::size_t> queued_{0};
+  std::atomic<std::size_t> next_queue_{0};
+  std::exception_ptr error_;
+  bool stop_ = false;
+};
+
+/**
+ * @brief Sort a range on a WorkStealingPool: equal chunks are sorted
+ * concurrently and then merged pairwise, each round of merges in parallel.
+ *
+ * Falls back to std::sort for fewer than min_parallel elements or a single
+ * thread. Like std::sort the order of equal elements is unspecified.
+ *
+ * @param num_threads Number of threads, 0 means one per hardware thread.
+ * @param min_parallel Smallest range worth sorting in parallel.
+ */
+template <typename RandomIt, typename Compare>
+inline void parallel_sort(RandomIt first, RandomIt last, Compare comp,
+                          std::size_t num_threads = 0,
+                          std::size_t min_parallel = 1 << 16) {
+  std::size_t n = static_cast<std::size_t>(last - first);
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  if (num_threads < 2 || n < std::max<std::size_t>(min_parallel, 2)) {
+    std::sort(first, last, comp);
+    return;
+  }
+  // 分块数取 2 的幂，便于逐轮两两归并
+  std::size_t chunks = 1;
+  while (chunks * 2 <= num_threads && n / (chunks * 2) > 0) {
+    chunks *= 2;
+  }
+  std::vector<std::size_t> bounds(chunks + 1);
+  for (std::size_t i = 0; i <= chunks; ++i) {
+    bounds[i] = n * i / chunks;
+  }
+  WorkStealingPool pool(std::min(num_threads, chunks));
+  for (std::size_t i = 0; i < chunks; ++i) {
+    pool.submit([&, i] {
+      std::sort(first + bounds[i], first + bounds[i + 1], comp);
+    });
+  }
+  pool.wait();
+  for (std::size_t width = 1; width < chunks; width *= 2) {
+    for (std::size_t i = 0; i + width < chunks; i += 2 * width) {
+      pool.submit([&, i, width] {
+        std::inplace_merge(first + bounds[i], first + bounds[i + width],
+                           first + bounds[std::min(i + 2 * width, chunks)],
+                           comp);
+      });
+    }
+    pool.wait();
+  }
+}
+
+/**
+ * @brief A blocking multi-producer multi-consumer FIFO with a fixed capacity.
+ *
+ * push() blocks while the queue is full and pop() blocks while it is empty.
+ * After close() pushes fail, and pops drain the remaining items and then
+ * fail.
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(std::size_t capacity)
+      : capacity_(std::max<std::size_t>(capacity, 1)) {}
+
+  /// Append an item; returns false if the queue was closed.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    not_full_.wait(lock,
+                   [this] { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /// Remove the oldest item; returns false once the queue is closed and
+  /// empty.
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /// Remove the oldest item without waiting; returns false if the queue is
+  /// currently empty.
+  bool try_pop(T &item) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (items_.empty()) {
+      return false;
+    }
+    item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /// Whether the queue is closed and fully drained.
+  bool done() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return closed_ && items_.empty();
+  }
+
+  /// Wake up all waiters and refuse further pushes.
+  void close() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+ private:
+  std::size_t capacity_;
+  std::deque<T> items_;
+  std::mutex mtx_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  bool closed_ = false;
+};
+
 // ==============================================================================================
 //                                         文件路径
 // ==============================================================================================
@@ -41,20 +398,206 @@ constexpr char path_separator = '\\';
 constexpr char path_separator = '/';
 #endif
 
+/**
+ * @brief A non-owning view of a path, the C++11 counterpart of a
+ * std::string_view.
+ *
+ * The path operations return views into the same buffer, so splitting a
+ * path does not allocate. They behave like the std::string functions
+ * path_split(), splitext(), dirname(), basename(), get_file_ext() and
+ * remove_file_ext(), which are implemented on top of them. The viewed
+ * buffer must outlive the view.
+ */
+class PathView {
+ public:
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  constexpr PathView() : data_(""), size_(0) {}
+  constexpr PathView(const char *data, std::size_t size)
+      : data_(data), size_(size) {}
+  PathView(const char *path) : data_(path), size_(std::strlen(path)) {}
+  PathView(const std::string &path) : data_(path.data()), size_(path.size()) {}
+#if __cplusplus >= 201703L
+  constexpr PathView(std::string_view path)
+      : data_(path.data()), size_(path.size()) {}
+  constexpr operator std::string_view() const {
+    return std::string_view(data_, size_);
+  }
+#endif
+
+  constexpr const char *data() const { return data_; }
+  constexpr std::size_t size() const { return size_; }
+  constexpr bool empty() const { return size_ == 0; }
+  constexpr char operator[](std::size_t i) const { return data_[i]; }
+  constexpr const char *begin() const { return data_; }
+  constexpr const char *end() const { return data_ + size_; }
+  char front() const { return data_[0]; }
+  char back() const { return data_[size_ - 1]; }
+
+  /// Copy the viewed characters into a std::string.
+  std::string str() const { return std::string(data_, size_); }
+  explicit operator std::string() const { return str(); }
+
+  /// The view of at most n characters starting at pos.
+  PathView substr(std::size_t pos, std::size_t n = npos) const {
+    pos = std::min(pos, size_);
+    return PathView(data_ + pos, std::min(n, size_ - pos));
+  }
+
+  /// Position of the last occurrence of c, or npos.
+  std::size_t rfind(char c) const {
+    for (std::size_t i = size_; i > 0; --i) {
+      if (data_[i - 1] == c) {
+        return i - 1;
+      }
+    }
+    return npos;
+  }
+
+  bool operator==(PathView other) const {
+    return size_ == other.size_ &&
+           (size_ == 0 || std::memcmp(data_, other.data_, size_) == 0);
+  }
+  bool operator!=(PathView other) const { return !(*this == other); }
+
+  /// The directory and file components, see path_split().
+  std::pair<PathView, PathView> split() const {
+    std::size_t pos = rfind(path_separator);
+    if (pos == npos) {
+      return {PathView(), *this};
+    }
+    return {substr(0, pos), substr(pos + 1)};
+  }
+
+  /// The root and the extension including its dot, see splitext().
+  std::pair<PathView, PathView> splitext() const {
+    std::size_t pos = rfind('.');
+    if (pos == npos || pos == 0) {
+      return {*this, PathView()};
+    }
+    return {substr(0, pos), substr(pos)};
+  }
+
+  /// The extension without its dot, see get_file_ext().
+  PathView ext() const {
+    PathView ext = splitext().second;
+    return ext.empty() ? ext : ext.substr(1);
+  }
+
+  /// The path without its extension, see remove_file_ext().
+  PathView stem() const { return splitext().first; }
+
+  /// The directory component, "." if there is none, see dirname().
+  PathView dirname() const {
+    if (size_ == 1 && data_[0] == path_separator) {
+      return *this;
+    }
+    std::size_t pos = size_ > 1 ? rfind(path_separator) : npos;
+    if (pos == npos) {
+      return PathView(".", 1);
+    }
+    return substr(0, pos == 0 ? 1 : pos);
+  }
+
+  /// The file component, see basename().
+  PathView basename() const {
+    if (size_ <= 1) {
+      return *this;
+    }
+    std::size_t pos = rfind(path_separator);
+    return pos == npos ? *this : substr(pos + 1);
+  }
+
+ private:
+  const char *data_;
+  std::size_t size_;
+};
+
+constexpr std::size_t PathView::npos;
+
+inline bool operator==(const std::string &lhs, PathView rhs) {
+  return PathView(lhs) == rhs;
+}
+inline bool operator==(const char *lhs, PathView rhs) {
+  return PathView(lhs) == rhs;
+}
+
+inline std::ostream &operator<<(std::ostream &os, PathView path) {
+  return os.write(path.data(), static_cast<std::streamsize>(path.size()));
+}
+
+/**
+ * @brief An append-only list of strings stored back to back in one buffer.
+ *
+ * Each string costs its characters, a terminating '\0' and one offset,
+ * instead of a std::string object plus a heap node. Strings are addressed
+ * by their index; the views returned by operator[] stay valid until the
+ * next add() or clear(). Everything is released with the arena.
+ */
+class StringArena {
+ public:
+  StringArena() : offsets_(1, 0) {}
+
+  /// Reserve room for count strings of total_size characters.
+  void reserve(std::size_t count, std::size_t total_size) {
+    offsets_.reserve(count + 1);
+    data_.reserve(total_size + count);
+  }
+
+  /// Copy a string into the arena and return its index.
+  std::size_t add(PathView s) {
+    data_.insert(data_.end(), s.begin(), s.end());
+    data_.push_back('\0');
+    offsets_.push_back(data_.size());
+    return offsets_.size() - 2;
+  }
+
+  /// Number of strings.
+  std::size_t size() const { return offsets_.size() - 1; }
+  bool empty() const { return size() == 0; }
+
+  /// The i-th string; data() is '\0'-terminated.
+  PathView operator[](std::size_t i) const {
+    return PathView(data_.data() + offsets_[i],
+                    offsets_[i + 1] - offsets_[i] - 1);
+  }
+
+  /// Bytes held by the arena, including its offsets.
+  std::size_t memory_usage() const {
+    return data_.capacity() + offsets_.capacity() * sizeof(uint64_t);
+  }
+
+  void clear() {
+    data_.clear();
+    offsets_.assign(1, 0);
+  }
+
+ private:
+  std::vector<char> data_;
+  std::vector<uint64_t> offsets_;
+};
+
 /**
  * @brief Join one or more path components intelligently.
  *
+ * The components are not copied; the result is allocated once.
+ *
  * @param paths One or more path components to join.
  * @return std::string The joined path.
  */
-inline std::string path_join(const std::initializer_list<std::string> &paths) {
+inline std::string path_join(std::initializer_list<PathView> paths) {
+  std::size_t size = 0;
+  for (const auto &path : paths) {
+    size += path.size() + 1;
+  }
   std::string result;
+  result.reserve(size);
   for (const auto &path : paths) {
     if (!result.empty() && result.back() != path_separator &&
-        path.front() != path_separator) {
+        (path.empty() || path.front() != path_separator)) {
       result += path_separator;
     }
-    result += path;
+    result.append(path.data(), path.size());
   }
   return result;
 }
@@ -67,13 +610,27 @@ inline std::string path_join(const std::initializer_list<std::string> &paths) {
  * @return std::string The joined path.
  */
 template <typename... Args>
-inline std::string path_join(const std::string &path1, Args... paths) {
-  return path_join({path1, paths...});
+inline std::string path_join(PathView path1, const Args &...paths) {
+  return path_join({path1, PathView(paths)...});
+}
+
+/// 创建单级目录，目录已存在时也视为成功；失败时 errno 保存原因
+inline bool make_one_dir(const std::string &path, mode_t mode) {
+#ifdef _WIN32
+  (void)mode;
+  return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+  return mkdir(path.c_str(), mode) == 0 || errno == EEXIST;
+#endif
 }
 
 /**
  * @brief Make a directory recursively.
  *
+ * The leaf directory is created first; the path is only walked upwards when
+ * that fails with ENOENT, so creating a directory whose parent already
+ * exists costs a single mkdir.
+ *
  * @param path The directory path to create.
  * @return bool True if the directory was created successfully, false otherwise.
  */
@@ -82,705 +639,7182 @@ inline bool makedirs(const std::string &path,
   if (path.empty()) {
     return false;
   }
-  std::string::size_type pos = 0;
-  while ((pos = path.find_first_of(path_separator, pos + 1)) !=
-         std::string::npos) {
-    std::string sub_path = path.substr(0, pos);
-    if (sub_path.empty()) {
-      continue;
-    }
-#ifdef _WIN32
-    if (_mkdir(sub_path.c_str()) != 0 && errno != EEXIST)
-#else
-    if (mkdir(sub_path.c_str(), mode) != 0 && errno != EEXIST)
-#endif
-    {
-      return false;
-    }
+  if (make_one_dir(path, mode)) {
+    return true;
   }
-#ifdef _WIN32
-  if (_mkdir(path.c_str()) != 0 && errno != EEXIST)
-#else
-  if (mkdir(path.c_str(), mode) != 0 && errno != EEXIST)
-#endif
+  if (errno != ENOENT) {
     return false;
-  return true;
+  }
+  // 父目录不存在，先创建父目录再重试
+  std::string::size_type end = path.find_last_not_of(path_separator);
+  if (end == std::string::npos) {
+    return false;
+  }
+  std::string::size_type pos = path.find_last_of(path_separator, end);
+  if (pos == std::string::npos) {
+    return false;
+  }
+  std::string::size_type parent_end = path.find_last_not_of(path_separator, pos);
+  if (parent_end == std::string::npos ||
+      !makedirs(path.substr(0, parent_end + 1), mode)) {
+    return false;
+  }
+  return make_one_dir(path, mode);
 }
 
+}  // namespace
+
+// 匿名命名空间中的静态对象每个翻译单元各有一份；需要在整个进程内共享的
+// 缓存放在具名命名空间中，再引入匿名命名空间
+namespace fs_utils_shared {
+
 /**
- * @brief Check whether a file or directory exists.
+ * @brief A thread-safe set of directories known to exist.
  *
- * @param path The file or directory path to check.
- * @return bool True if the file or directory exists, false otherwise.
+ * Used by makedirs_cached() and valid_filepath() to skip mkdir calls for
+ * directories that were already created. Paths are compared as given, so
+ * "out/a" and "./out/a" are different entries. The set is split into shards
+ * with separate locks so concurrent writers rarely contend.
  */
-inline bool path_exists(const std::string &path) {
-#ifdef _WIN32
-  DWORD attrs = GetFileAttributesA(path.c_str());
-  if (attrs == INVALID_FILE_ATTRIBUTES) {
-    return false;
+class DirCache {
+ public:
+  bool contains(const std::string &path) {
+    Shard &shard = shard_for(path);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    return shard.dirs.count(path) > 0;
   }
-  return true;
-#else
-  struct stat st;
-  if (stat(path.c_str(), &st) == 0) {
-    return true;
+
+  void insert(const std::string &path) {
+    Shard &shard = shard_for(path);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.dirs.insert(path);
   }
-  if (errno == ENOENT) {
-    return false;
+
+  /// Forget path and every cached directory below it.
+  void erase_prefix(const std::string &path) {
+    std::string prefix = path;
+    while (prefix.size() > 1 && prefix.back() == path_separator) {
+      prefix.pop_back();
+    }
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      for (auto it = shard.dirs.begin(); it != shard.dirs.end();) {
+        const std::string &dir = *it;
+        bool below = dir.compare(0, prefix.size(), prefix) == 0 &&
+                     (dir.size() == prefix.size() ||
+                      dir[prefix.size()] == path_separator ||
+                      prefix.back() == path_separator);
+        it = below ? shard.dirs.erase(it) : std::next(it);
+      }
+    }
   }
-  return false;
-#endif
+
+  void clear() {
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      shard.dirs.clear();
+    }
+  }
+
+  std::size_t size() {
+    std::size_t total = 0;
+    for (auto &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      total += shard.dirs.size();
+    }
+    return total;
+  }
+
+ private:
+  struct Shard {
+    std::mutex mtx;
+    std::unordered_set<std::string> dirs;
+  };
+
+  Shard &shard_for(const std::string &path) {
+    return shards_[std::hash<std::string>()(path) % shard_count];
+  }
+
+  static constexpr std::size_t shard_count = 16;
+  Shard shards_[shard_count];
+};
+
+/// The directory cache shared by makedirs_cached() and valid_filepath(),
+/// one per process.
+inline DirCache &dir_cache() {
+  static DirCache cache;
+  return cache;
 }
 
+}  // namespace fs_utils_shared
+
+namespace {
+
+using fs_utils_shared::DirCache;
+using fs_utils_shared::dir_cache;
+
 /**
- * @brief Check whether a path is a directory.
+ * @brief makedirs() that remembers which directories already exist.
  *
- * @param path The path to check.
- * @return bool True if the path is a directory, false otherwise.
+ * A directory found in dir_cache() costs no system call at all, so the
+ * cache can be stale: directories removed with remove_path() or
+ * remove_tree() (from any translation unit) are dropped from it, but a
+ * directory deleted by other means, or by another process, is still
+ * reported as existing and is not recreated. Call dir_cache().erase_prefix()
+ * or clear() after such deletions. Removing a regular file leaves the cache
+ * untouched.
+ *
+ * @param path The directory path to create.
+ * @return bool True if the directory exists, false otherwise (including
+ * when path names an existing non-directory).
  */
-inline bool is_dir(const std::string &path) {
+inline bool makedirs_cached(const std::string &path,
+                            mode_t mode = S_IRWXU | S_IRWXG | S_IRWXO) {
+  if (dir_cache().contains(path)) {
+    return true;
+  }
+  if (!makedirs(path, mode)) {
+    return false;
+  }
+  // mkdir 对已存在的普通文件同样报 EEXIST，确认是目录后才缓存
 #ifdef _WIN32
   DWORD attrs = GetFileAttributesA(path.c_str());
-  if (attrs == INVALID_FILE_ATTRIBUTES) {
+  if (attrs == INVALID_FILE_ATTRIBUTES ||
+      !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+    errno = ENOTDIR;
     return false;
   }
-  return (attrs & FILE_ATTRIBUTE_DIRECTORY);
 #else
   struct stat st;
-  if (stat(path.c_str(), &st) == 0) {
-    return S_ISDIR(st.st_mode);
+  if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return false;
   }
-  return false;
 #endif
+  dir_cache().insert(path);
+  return true;
 }
 
+#ifndef _WIN32
+}  // namespace
+
+namespace fs_utils_shared {
+
 /**
- * @brief 检查指定路径是否是文件
+ * @brief A cache of stat() results, invalidated through inotify.
  *
- * @param path 要检查的路径
- * @return true 如果指定路径是文件
- * @return false 如果指定路径不存在、不是文件或者出错
- */
-inline bool is_file(const std::string &path) {
-  struct stat statbuf;
-  if (stat(path.c_str(), &statbuf) == -1) {
-    return false;
-  }
-  return S_ISREG(statbuf.st_mode);
-}
-
-/**
- * @brief List all files and directories in a directory.
+ * Results are keyed by the path string exactly as given and include
+ * failures, so repeated checks for a missing file are cached too. The first
+ * lookup below a directory places an inotify watch on that directory; a
+ * background thread drops the cached entries of every name the kernel
+ * reports as created, deleted, moved, modified or changed in its
+ * attributes. When inotify is unavailable (or for changes it cannot see,
+ * such as the target of a symbolic link in another directory or a network
+ * file system) entries simply expire after the TTL.
  *
- * @param path The path to the directory.
- * @param entries A vector to store the entries in the directory.
- * @return true if the directory is listed successfully, false otherwise.
+ * Only the immediate parent is watched: renaming or removing a directory
+ * further up (e.g. "a" for the path "a/b/c") is not seen, and the cached
+ * results below it stay valid until the TTL expires. A path whose parent
+ * cannot be watched (e.g. because it does not exist) is not cached while
+ * inotify is in use. A watch is removed again together with the last
+ * cached name below it, so the number of watches never exceeds the number
+ * of directories with cached entries.
+ *
+ * Hits skip the system call entirely; the hit and miss counters tell how
+ * well the cache works for a given workload.
  */
-inline bool list_dir(const std::string &path,
-                     std::vector<std::string> &entries) {
-  entries.clear();
-#ifdef _WIN32
-  std::string pattern = path + "\\*";
-  WIN32_FIND_DATAA find_data;
-  HANDLE handle = FindFirstFileA(pattern.c_str(), &find_data);
-  if (handle == INVALID_HANDLE_VALUE) {
-    return false;
-  }
-  do {
-    std::string entry_name = find_data.cFileName;
-    if (entry_name != "." && entry_name != "..") {
-      entries.push_back(entry_name);
+class StatCache {
+ public:
+  /**
+   * @param ttl How long an entry stays valid without an invalidation.
+   * @param use_inotify Whether to watch parent directories for changes.
+   * @param max_entries The cache is emptied when it grows beyond this.
+   */
+  explicit StatCache(
+      std::chrono::milliseconds ttl = std::chrono::milliseconds(5000),
+      bool use_inotify = true, std::size_t max_entries = 1 << 20)
+      : ttl_(ttl), max_entries_(max_entries) {
+#ifdef __linux__
+    if (use_inotify) {
+      inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (inotify_fd_ >= 0 && pipe2(wake_fds_, O_CLOEXEC) != 0) {
+        ::close(inotify_fd_);
+        inotify_fd_ = -1;
+      }
+      if (inotify_fd_ >= 0) {
+        watcher_ = std::thread(&StatCache::watch_loop, this);
+      }
     }
-  } while (FindNextFileA(handle, &find_data) != 0);
-  FindClose(handle);
 #else
-  DIR *dir = opendir(path.c_str());
-  if (!dir) {
-    return false;
+    (void)use_inotify;
+#endif
   }
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != nullptr) {
-    std::string entry_name = entry->d_name;
-    if (entry_name != "." && entry_name != "..") {
-      entries.push_back(entry_name);
+
+  ~StatCache() {
+#ifdef __linux__
+    if (inotify_fd_ >= 0) {
+      char c = 0;
+      while (write(wake_fds_[1], &c, 1) < 0 && errno == EINTR) {
+      }
+      watcher_.join();
+      ::close(wake_fds_[0]);
+      ::close(wake_fds_[1]);
+      ::close(inotify_fd_);
     }
-  }
-  closedir(dir);
 #endif
-  return true;
-}
+  }
 
-/**
- * @brief Remove the file or directory at the given path.
- *
- * @param path The path to remove.
- * @return true if the operation was successful, false otherwise.
- */
-inline bool remove_path(const std::string &path) {
-  if (is_dir(path)) {
-    // directory
-    std::vector<std::string> entries;
-    if (!list_dir(path, entries)) {
-      return false;
+  StatCache(const StatCache &) = delete;
+  StatCache &operator=(const StatCache &) = delete;
+
+  /**
+   * @brief stat() through the cache.
+   *
+   * @return 0 on success, otherwise the errno value stat() failed with.
+   */
+  int stat(const std::string &path, struct stat &st) {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      auto it = entries_.find(path);
+      if (it != entries_.end() && it->second.expires > now) {
+        ++hits_;
+        st = it->second.st;
+        return it->second.error;
+      }
+      ++misses_;
+      // 先腾出空间再加监视，否则清空缓存时会连同刚加的监视一起移除
+      if (entries_.size() >= max_entries_) {
+        clear_locked();
+      }
+      // 先加监视再 stat，之后的变化一定会触发失效
+      watch_parent(path);
+      generation = generation_;
     }
-    for (const auto &entry : entries) {
-      if (entry != "." && entry != "..") {
-        const std::string full_path = path_join(path, entry);
-        if (!remove_path(full_path)) {
-          return false;
+
+    int error = ::stat(path.c_str(), &st) == 0 ? 0 : errno;
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto w = watches_.find(parent_of(path));
+    // 期间没有处理过任何事件，且父目录仍被监视（或未启用 inotify），结果
+    // 可以放心缓存
+    if (generation == generation_ &&
+        (inotify_fd_ < 0 || w != watches_.end())) {
+      auto inserted = entries_.emplace(path, Entry());
+      Entry &entry = inserted.first->second;
+      entry.st = st;
+      entry.error = error;
+      entry.expires = now + ttl_;
+      if (w != watches_.end()) {
+        // 过期条目被覆盖时文件名可能已登记过，不重复加入
+        auto &names = watch_names_[w->second];
+        std::string name = basename_of(path);
+        auto range = names.equal_range(name);
+        bool known = !inserted.second &&
+                     std::any_of(range.first, range.second,
+                                 [&](const std::pair<const std::string,
+                                                     std::string> &item) {
+                                   return item.second == path;
+                                 });
+        if (!known) {
+          names.insert(std::make_pair(std::move(name), path));
         }
       }
     }
-#ifdef _WIN32
-    if (_rmdir(path.c_str()) != 0) {
-#else
-    if (rmdir(path.c_str()) != 0) {
+#ifdef __linux__
+    // 结果未缓存时，为它新加的监视可能没有任何文件名
+    if (w != watches_.end()) {
+      release_watch_if_unused(w->second);
+    }
 #endif
-      return false;
+    return error;
+  }
+
+  /// Drop the cached result for a path.
+  void invalidate(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (entries_.erase(path) == 0) {
+      return;
     }
-  } else {
-    // file
-#ifdef _WIN32
-    if (_unlink(path.c_str()) != 0) {
-#else
-    if (unlink(path.c_str()) != 0) {
+#ifdef __linux__
+    auto w = watches_.find(parent_of(path));
+    if (w == watches_.end()) {
+      return;
+    }
+    int wd = w->second;
+    auto names = watch_names_.find(wd);
+    if (names != watch_names_.end()) {
+      auto range = names->second.equal_range(basename_of(path));
+      for (auto item = range.first; item != range.second; ++item) {
+        if (item->second == path) {
+          names->second.erase(item);
+          break;
+        }
+      }
+    }
+    release_watch_if_unused(wd);
 #endif
-      return false;
+  }
+
+  /// Drop all cached results and the watches that served them.
+  void clear() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    clear_locked();
+  }
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+  /// Whether changes are tracked through inotify.
+  bool watching() const { return inotify_fd_ >= 0; }
+
+  /// Number of directories currently watched.
+  std::size_t watch_count() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return watches_.size();
+  }
+
+ private:
+  struct Entry {
+    struct stat st;
+    int error;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  static std::string parent_of(const std::string &path) {
+    std::string::size_type end = path.find_last_not_of(path_separator);
+    if (end == std::string::npos) {
+      return std::string(1, path_separator);
+    }
+    std::string::size_type pos = path.find_last_of(path_separator, end);
+    if (pos == std::string::npos) {
+      return ".";
     }
+    std::string::size_type parent_end = path.find_last_not_of(path_separator, pos);
+    return parent_end == std::string::npos ? std::string(1, path_separator)
+                                           : path.substr(0, parent_end + 1);
   }
-  return true;
-}
 
-/**
- * @brief Normalize a pathname by collapsing redundant separators and up-level
- * references.
- *
- * @param path Path to be normalized.
- * @return Normalized path.
- */
-inline std::string normpath(const std::string &path) {
-  if (path.empty() || path == ".") {
-    return ".";
+  static std::string basename_of(const std::string &path) {
+    std::string::size_type end = path.find_last_not_of(path_separator);
+    if (end == std::string::npos) {
+      return std::string();
+    }
+    std::string::size_type pos = path.find_last_of(path_separator, end);
+    std::string::size_type begin = pos == std::string::npos ? 0 : pos + 1;
+    return path.substr(begin, end + 1 - begin);
   }
 
-  std::vector<std::string> parts;
-  std::stringstream ss(path);
-  std::string part;
+  void clear_locked() {
+    entries_.clear();
+#ifdef __linux__
+    for (const auto &watch : watch_dirs_) {
+      inotify_rm_watch(inotify_fd_, watch.first);
+    }
+    watches_.clear();
+    watch_dirs_.clear();
+    watch_names_.clear();
+#endif
+  }
 
-  // Split the path into its components
-  while (std::getline(ss, part, path_separator)) {
-    if (part == "" || part == ".") {
-      continue;
+  void watch_parent(const std::string &path) {
+#ifdef __linux__
+    if (inotify_fd_ < 0) {
+      return;
     }
-    if (part == ".." && !parts.empty() && parts.back() != "..") {
-      parts.pop_back();
-    } else {
-      parts.push_back(part);
+    std::string parent = parent_of(path);
+    if (watches_.count(parent) > 0) {
+      return;
+    }
+    int wd = inotify_add_watch(
+        inotify_fd_, parent.c_str(),
+        IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd >= 0) {
+      watches_[parent] = wd;
+      watch_dirs_[wd] = parent;
     }
+#else
+    (void)path;
+#endif
   }
 
-  // Recombine the parts into a path
-  std::string normalized_path;
-  for (const auto &part : parts) {
-    normalized_path += part + path_separator;
+#ifdef __linux__
+  /// 监视下已没有缓存的文件名时移除它，避免耗尽 max_user_watches
+  void release_watch_if_unused(int wd) {
+    auto names = watch_names_.find(wd);
+    if (names != watch_names_.end() && !names->second.empty()) {
+      return;
+    }
+    auto dir = watch_dirs_.find(wd);
+    if (dir == watch_dirs_.end()) {
+      return;
+    }
+    inotify_rm_watch(inotify_fd_, wd);
+    watches_.erase(dir->second);
+    watch_dirs_.erase(dir);
+    if (names != watch_names_.end()) {
+      watch_names_.erase(names);
+    }
   }
 
-  // Remove the trailing separator, unless the path is just "/"
-  if (normalized_path.size() > 1 && normalized_path.back() == path_separator) {
-    normalized_path.pop_back();
+  void drop_names(int wd, const char *name) {
+    auto it = watch_names_.find(wd);
+    if (it == watch_names_.end()) {
+      return;
+    }
+    if (name == nullptr) {
+      for (const auto &item : it->second) {
+        entries_.erase(item.second);
+      }
+      it->second.clear();
+      return;
+    }
+    auto range = it->second.equal_range(name);
+    for (auto item = range.first; item != range.second; ++item) {
+      entries_.erase(item->second);
+    }
+    it->second.erase(range.first, range.second);
   }
 
-  // Add the root separator if the path had one
-  if (path.size() > 0 && path[0] == path_separator) {
-    normalized_path = path_separator + normalized_path;
+  void watch_loop() {
+    alignas(struct inotify_event) char buffer[16384];
+    struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+    for (;;) {
+      if (poll(fds, 2, -1) < 0) {
+        continue;
+      }
+      if (fds[1].revents != 0) {
+        return;
+      }
+      ssize_t n = read(inotify_fd_, buffer, sizeof(buffer));
+      if (n <= 0) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(mtx_);
+      ++generation_;
+      for (char *p = buffer; p < buffer + n;) {
+        const struct inotify_event *event =
+            reinterpret_cast<const struct inotify_event *>(p);
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          // 事件丢失，无法确定哪些结果失效
+          clear_locked();
+          continue;
+        }
+        if (event->len > 0) {
+          drop_names(event->wd, event->name);
+          release_watch_if_unused(event->wd);
+        }
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+          // 被监视的目录本身消失或改名，该目录下的结果全部失效
+          drop_names(event->wd, nullptr);
+          auto dir = watch_dirs_.find(event->wd);
+          if (dir != watch_dirs_.end()) {
+            if (!(event->mask & IN_IGNORED)) {
+              inotify_rm_watch(inotify_fd_, event->wd);
+            }
+            watches_.erase(dir->second);
+            watch_dirs_.erase(dir);
+          }
+          watch_names_.erase(event->wd);
+        }
+      }
+    }
   }
+#endif
 
-  return normalized_path;
+  std::chrono::milliseconds ttl_;
+  std::size_t max_entries_;
+  std::mutex mtx_;
+  std::unordered_map<std::string, Entry> entries_;
+  // 被监视的目录 -> watch 描述符，以及每个 watch 下已缓存的 (文件名, 路径)
+  std::unordered_map<std::string, int> watches_;
+  std::unordered_map<int, std::string> watch_dirs_;
+  std::unordered_map<int, std::unordered_multimap<std::string, std::string>>
+      watch_names_;
+  uint64_t generation_ = 0;
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  int inotify_fd_ = -1;
+  int wake_fds_[2] = {-1, -1};
+  std::thread watcher_;
+};
+
+/// 当前启用的全局 StatCache，未启用时为空；整个进程共享一个
+inline std::shared_ptr<StatCache> &stat_cache_slot() {
+  static std::shared_ptr<StatCache> cache;
+  return cache;
 }
 
+}  // namespace fs_utils_shared
+
+namespace {
+
+using fs_utils_shared::StatCache;
+using fs_utils_shared::stat_cache_slot;
+
 /**
- * @brief Split a path into its directory and file components.
+ * @brief Route path_exists(), is_dir(), is_file() and getsize() through a
+ * StatCache.
  *
- * This function takes a path string and returns a pair of strings: the
- * directory component and the file component. The directory component is the
- * portion of the path up to (but not including) the final path separator. The
- * file component is the portion of the path after the final path separator.
- *
- * On Windows, both forward slashes ('/') and backslashes ('\\') are recognized
- * as path separators.
- *
- * If the path does not contain a path separator, the directory component is the
- * empty string and the file component is the entire path.
+ * Replaces any previously enabled cache, in every translation unit of the
+ * process. Safe to call while other threads use those functions.
  *
- * @param path The path to split.
- * @return A pair of strings: the directory component and the file component.
+ * @param ttl How long a result stays valid without an invalidation.
+ * @param use_inotify Whether to invalidate results through inotify.
+ * @return The cache, e.g. to read its hit and miss counters.
  */
-inline std::pair<std::string, std::string> path_split(const std::string &path) {
-  size_t pos = path.find_last_of(path_separator);
-  if (pos == std::string::npos) {
-    return {"", path};
-  } else {
-    return {path.substr(0, pos), path.substr(pos + 1)};
-  }
+inline std::shared_ptr<StatCache> enable_stat_cache(
+    std::chrono::milliseconds ttl = std::chrono::milliseconds(5000),
+    bool use_inotify = true) {
+  std::shared_ptr<StatCache> cache = std::make_shared<StatCache>(ttl, use_inotify);
+  std::atomic_store(&stat_cache_slot(), cache);
+  return cache;
 }
 
-/**
- * @brief Split a pathname into a pair (root, ext).
- *
- * @param path Pathname to split.
- * @return A pair (root, ext). ext is empty if path has no
- *         extension. If path ends with a dot, it is considered the
- *         extension. The root component is everything that comes
- *         before the last dot in the path.
- */
-inline std::pair<std::string, std::string> splitext(const std::string &path) {
-  // Find the position of the last dot in the path
-  auto last_dot = path.find_last_of('.');
-  if (last_dot == std::string::npos) {
-    // No dot found, return the whole path as root with empty extension
-    return std::make_pair(path, "");
-  } else if (last_dot == 0) {
-    // Dot at the beginning, return the whole path as extension with empty root
-    return std::make_pair(path, "");
-  } else {
-    // Split the path at the last dot position
-    auto root = path.substr(0, last_dot);
-    auto ext = path.substr(last_dot);
-    return std::make_pair(root, ext);
-  }
+/// Go back to uncached stat() calls.
+inline void disable_stat_cache() {
+  std::atomic_store(&stat_cache_slot(), std::shared_ptr<StatCache>());
 }
 
-/// 获取文件扩展名（不带.）
-inline std::string get_file_ext(const std::string &fpath) {
-  std::string ext = splitext(fpath).second;
-  return ext.empty() ? ext : ext.substr(1);
+/// The enabled StatCache, or nullptr.
+inline std::shared_ptr<StatCache> stat_cache() {
+  return std::atomic_load(&stat_cache_slot());
 }
 
-/// 删除扩展名
-inline std::string remove_file_ext(const std::string &filename) {
-  std::string filename_without_ext = splitext(filename).first;
-  return filename_without_ext;
+/// stat() that goes through the enabled StatCache, if any. Returns 0 or -1
+/// with errno set, like stat().
+inline int stat_path(const std::string &path, struct stat &st) {
+  std::shared_ptr<StatCache> cache = stat_cache();
+  if (!cache) {
+    return ::stat(path.c_str(), &st);
+  }
+  int error = cache->stat(path, st);
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
 }
+#endif
 
 /**
- * @brief 返回路径的目录部分（最后一个分隔符之前的部分）
+ * @brief Check whether a file or directory exists.
  *
- * @param path 要处理的路径字符串
- * @return std::string 返回目录部分的字符串
+ * @param path The file or directory path to check.
+ * @return bool True if the file or directory exists, false otherwise.
  */
-inline std::string dirname(const std::string &path) {
-  // 如果路径为空，则返回当前目录 "."
-  if (path.empty()) {
-    return ".";
+inline bool path_exists(const std::string &path) {
+#ifdef _WIN32
+  DWORD attrs = GetFileAttributesA(path.c_str());
+  if (attrs == INVALID_FILE_ATTRIBUTES) {
+    return false;
   }
-
-  // 如果路径只有一个字符，则返回当前目录 "."
-  if (path.size() == 1) {
-    return (path[0] == path_separator) ? std::string(1, path_separator) : ".";
+  return true;
+#else
+  struct stat st;
+  if (stat_path(path, st) == 0) {
+    return true;
   }
-
-  // 找到最后一个分隔符的位置
-  auto pos = path.find_last_of(path_separator);
-
-  // 如果没有分隔符，则返回当前目录 "."
-  if (pos == std::string::npos) {
-    return ".";
+  if (errno == ENOENT) {
+    return false;
   }
+  return false;
+#endif
+}
 
-  // 如果分隔符在第一个位置，则返回 "/"
-  if (pos == 0) {
-    return std::string(1, path_separator);
+/**
+ * @brief Check whether a path is a directory.
+ *
+ * @param path The path to check.
+ * @return bool True if the path is a directory, false otherwise.
+ */
+inline bool is_dir(const std::string &path) {
+#ifdef _WIN32
+  DWORD attrs = GetFileAttributesA(path.c_str());
+  if (attrs == INVALID_FILE_ATTRIBUTES) {
+    return false;
+  }
+  return (attrs & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat st;
+  if (stat_path(path, st) == 0) {
+    return S_ISDIR(st.st_mode);
   }
+  return false;
+#endif
+}
 
-  // 返回分隔符之前的部分
-  return path.substr(0, pos);
+/**
+ * @brief 检查指定路径是否是文件
+ *
+ * @param path 要检查的路径
+ * @return true 如果指定路径是文件
+ * @return false 如果指定路径不存在、不是文件或者出错
+ */
+inline bool is_file(const std::string &path) {
+  struct stat statbuf;
+#ifdef _WIN32
+  if (stat(path.c_str(), &statbuf) == -1) {
+#else
+  if (stat_path(path, statbuf) == -1) {
+#endif
+    return false;
+  }
+  return S_ISREG(statbuf.st_mode);
 }
 
+#ifndef _WIN32
 /**
- * @brief 返回路径的文件名部分（不含目录部分）
+ * @brief Reads the entries of a directory in large batches.
  *
- * @param path 要处理的路径字符串
- * @return std::string 返回文件名部分的字符串
+ * On Linux the entries are fetched with the raw getdents64 system call into a
+ * buffer of buffer_size bytes, so a directory with many entries is read with
+ * few system calls and without copying names out of the kernel records. On
+ * other systems it falls back to readdir().
+ *
+ * "." and ".." are skipped. The name of an entry points into the reader's
+ * buffer and stays valid until the next call to next().
  */
-inline std::string basename(const std::string &path) {
-  // 如果路径为空，则返回空字符串
-  if (path.empty()) {
-    return "";
+class DirReader {
+ public:
+  struct Entry {
+    const char *name;
+    unsigned char type;  ///< DT_* value, may be DT_UNKNOWN
+  };
+
+  /// Default buffer size, large enough for a few thousand entries per call.
+  static constexpr std::size_t default_buffer_size = 128 * 1024;
+
+  /**
+   * @brief Open a directory for reading.
+   *
+   * @param path The directory to read.
+   * @param buffer_size Size of the getdents64 buffer in bytes.
+   */
+  explicit DirReader(const std::string &path,
+                     std::size_t buffer_size = default_buffer_size) {
+    open_fd(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                   buffer_size);
   }
 
-  // 如果路径只有一个字符，则返回该字符
-  if (path.size() == 1) {
-    return (path[0] == path_separator) ? std::string(1, path_separator)
-                                       : std::string(1, path[0]);
+  /**
+   * @brief Open a directory relative to an already open directory.
+   *
+   * Symbolic links are not followed: opening a link fails with ELOOP or
+   * ENOTDIR.
+   *
+   * @param dir_fd File descriptor of the parent directory.
+   * @param name Name of the directory inside the parent.
+   * @param buffer_size Size of the getdents64 buffer in bytes.
+   */
+  DirReader(int dir_fd, const char *name,
+            std::size_t buffer_size = default_buffer_size) {
+    open_fd(::openat(dir_fd, name,
+                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC),
+            buffer_size);
   }
 
-  // 找到最后一个分隔符的位置
-  auto pos = path.find_last_of(path_separator);
+  ~DirReader() { close(); }
 
-  // 如果没有分隔符，则返回原路径
-  if (pos == std::string::npos) {
-    return path;
-  }
+  DirReader(const DirReader &) = delete;
+  DirReader &operator=(const DirReader &) = delete;
 
-  // 返回分隔符之后的部分
-  return path.substr(pos + 1);
-}
+  /// Whether the directory was opened successfully.
+  bool is_open() const { return fd_ >= 0; }
 
-/**
- * Lists the contents of a directory specified by the given path, filtered by
+  /// The directory file descriptor, valid while the reader is open.
+  int fd() const { return fd_; }
+
+  /// errno of the last failure, 0 if none.
+  int error() const { return error_; }
+
+  /**
+   * @brief Fetch the next entry.
+   *
+   * @param entry Receives the entry.
+   * @return true if an entry was read, false at the end of the directory or
+   * on error (see error()).
+   */
+  bool next(Entry &entry) {
+    if (fd_ < 0) {
+      return false;
+    }
+#ifdef __linux__
+    for (;;) {
+      if (pos_ >= end_) {
+        long n = syscall(SYS_getdents64, fd_, buffer_.get(), buffer_size_);
+        if (n <= 0) {
+          if (n < 0) {
+            error_ = errno;
+          }
+          return false;
+        }
+        pos_ = 0;
+        end_ = static_cast<std::size_t>(n);
+      }
+      const Dirent64 *d =
+          reinterpret_cast<const Dirent64 *>(buffer_.get() + pos_);
+      pos_ += d->d_reclen;
+      if (is_dot_or_dotdot(d->d_name)) {
+        continue;
+      }
+      entry.name = d->d_name;
+      entry.type = d->d_type;
+      return true;
+    }
+#else
+    struct dirent *d;
+    errno = 0;
+    while ((d = readdir(dir_)) != nullptr) {
+      if (is_dot_or_dotdot(d->d_name)) {
+        continue;
+      }
+      entry.name = d->d_name;
+      entry.type = d->d_type;
+      return true;
+    }
+    error_ = errno;
+    return false;
+#endif
+  }
+
+  /**
+   * @brief Return the type of an entry, calling fstatat() relative to the
+   * directory only when the file system did not report it (DT_UNKNOWN).
+   *
+   * Symbolic links are not followed. Returns DT_UNKNOWN if the entry vanished.
+   */
+  unsigned char type_of(const Entry &entry) const {
+    if (entry.type != DT_UNKNOWN) {
+      return entry.type;
+    }
+    struct stat st;
+    if (fstatat(fd_, entry.name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      return DT_UNKNOWN;
+    }
+    return mode_to_dtype(st.st_mode);
+  }
+
+  /// Convert the S_IFMT bits of a mode to the matching DT_* value.
+  static unsigned char mode_to_dtype(mode_t mode) {
+    switch (mode & S_IFMT) {
+      case S_IFREG:
+        return DT_REG;
+      case S_IFDIR:
+        return DT_DIR;
+      case S_IFLNK:
+        return DT_LNK;
+      case S_IFIFO:
+        return DT_FIFO;
+      case S_IFSOCK:
+        return DT_SOCK;
+      case S_IFCHR:
+        return DT_CHR;
+      case S_IFBLK:
+        return DT_BLK;
+      default:
+        return DT_UNKNOWN;
+    }
+  }
+
+  /**
+   * @brief Give up ownership of the directory file descriptor.
+   *
+   * The reader is closed afterwards; the caller must close() the returned
+   * descriptor. Returns -1 if the reader was not open.
+   */
+  int release() {
+    int fd = fd_;
+#ifdef __linux__
+    fd_ = -1;
+    buffer_.reset();
+#else
+    if (dir_ != nullptr) {
+      fd = dup(fd_);
+      close();
+    }
+#endif
+    return fd;
+  }
+
+  /// Close the directory early.
+  void close() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+#else
+    if (dir_ != nullptr) {
+      closedir(dir_);
+      dir_ = nullptr;
+    }
+#endif
+    fd_ = -1;
+  }
+
+ private:
+#ifdef __linux__
+  struct Dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+  };
+#endif
+
+  static bool is_dot_or_dotdot(const char *name) {
+    return name[0] == '.' &&
+           (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+  }
+
+  void open_fd(int fd, std::size_t buffer_size) {
+    if (fd < 0) {
+      error_ = errno;
+      return;
+    }
+#ifdef __linux__
+    // 至少要能容纳一条最长的记录
+    buffer_size_ = std::max<std::size_t>(buffer_size, 1024);
+    buffer_.reset(new char[buffer_size_]);
+    fd_ = fd;
+#else
+    (void)buffer_size;
+    dir_ = fdopendir(fd);
+    if (dir_ == nullptr) {
+      error_ = errno;
+      ::close(fd);
+      return;
+    }
+    fd_ = fd;
+#endif
+  }
+
+  int fd_ = -1;
+  int error_ = 0;
+#ifdef __linux__
+  std::unique_ptr<char[]> buffer_;
+  std::size_t buffer_size_ = 0;
+  std::size_t pos_ = 0;
+  std::size_t end_ = 0;
+#else
+  DIR *dir_ = nullptr;
+#endif
+};
+
+/// What walk_tree() should do after visiting an entry.
+enum class WalkAction {
+  Continue,  ///< Descend into the entry if it is a directory
+  Skip,      ///< Do not descend into the entry
+  Stop,      ///< End the whole walk
+};
+
+/**
+ * @brief An entry reported by walk_tree().
+ *
+ * The entry is addressed relative to its parent directory: dir_fd() and
+ * name() can be passed straight to the *at() system calls. The full path is
+ * only assembled when path() is called.
+ */
+class WalkEntry {
+ public:
+  WalkEntry(const std::string &root, const std::vector<const char *> &parents,
+            int dir_fd, const char *name, unsigned char type)
+      : root_(root),
+        parents_(parents),
+        dir_fd_(dir_fd),
+        name_(name),
+        type_(type) {}
+
+  /// File descriptor of the directory that contains the entry.
+  int dir_fd() const { return dir_fd_; }
+
+  /// Name of the entry inside its directory.
+  const char *name() const { return name_; }
+
+  /// DT_* type of the entry; symbolic links are reported as DT_LNK.
+  unsigned char type() const { return type_; }
+
+  bool is_dir() const { return type_ == DT_DIR; }
+
+  /// Number of directories between the walk root and the entry (0 for the
+  /// root's own children).
+  std::size_t depth() const { return parents_.size(); }
+
+  /// Full path of the entry, starting with the walk root.
+  const std::string &path() const {
+    if (path_.empty()) {
+      std::size_t size = root_.size() + std::strlen(name_) + 1;
+      for (const char *parent : parents_) {
+        size += std::strlen(parent) + 1;
+      }
+      path_.reserve(size);
+      path_ = root_;
+      for (const char *parent : parents_) {
+        path_ += path_separator;
+        path_ += parent;
+      }
+      path_ += path_separator;
+      path_ += name_;
+    }
+    return path_;
+  }
+
+ private:
+  const std::string &root_;
+  const std::vector<const char *> &parents_;
+  int dir_fd_;
+  const char *name_;
+  unsigned char type_;
+  mutable std::string path_;
+};
+
+/// Visitor called for every entry found by walk_tree().
+using WalkVisitor = std::function<WalkAction(const WalkEntry &)>;
+
+/**
+ * @brief Recursively walk a directory tree using directory file descriptors.
+ *
+ * Every directory is opened with openat() relative to its parent and every
+ * entry is classified from d_type (falling back to fstatat()), so the kernel
+ * never has to resolve a full path below the root. Symbolic links are
+ * reported but never followed.
+ *
+ * visit is called for every entry below root in depth-first pre-order. For a
+ * directory it decides whether to descend. leave_dir, if given, is called
+ * for every visited directory after all of its contents have been handled,
+ * which is the point where a directory can be removed with
+ * unlinkat(entry.dir_fd(), entry.name(), AT_REMOVEDIR).
+ *
+ * One directory file descriptor is kept open per level of the tree.
+ *
+ * @param root The directory to walk.
+ * @param visit Called for every entry.
+ * @param leave_dir Called after the contents of a directory were walked.
+ * @return false if root could not be opened or the walk was stopped, true
+ * otherwise.
+ */
+inline bool walk_tree(const std::string &root, const WalkVisitor &visit,
+                      const std::function<void(const WalkEntry &)> &leave_dir =
+                          nullptr) {
+  struct Walker {
+    const std::string &root;
+    const WalkVisitor &visit;
+    const std::function<void(const WalkEntry &)> &leave_dir;
+    std::vector<const char *> parents;
+    bool stopped;
+
+    void walk(DirReader &reader) {
+      DirReader::Entry e;
+      while (!stopped && reader.next(e)) {
+        unsigned char type = reader.type_of(e);
+        if (type == DT_UNKNOWN) {
+          continue;
+        }
+        WalkEntry entry(root, parents, reader.fd(), e.name, type);
+        WalkAction action = visit(entry);
+        if (action == WalkAction::Stop) {
+          stopped = true;
+          return;
+        }
+        if (action == WalkAction::Skip || type != DT_DIR) {
+          continue;
+        }
+        {
+          DirReader child(reader.fd(), e.name);
+          if (child.is_open()) {
+            parents.push_back(e.name);
+            walk(child);
+            parents.pop_back();
+          }
+        }
+        if (!stopped && leave_dir) {
+          leave_dir(entry);
+        }
+      }
+    }
+  };
+
+  DirReader reader(root);
+  if (!reader.is_open()) {
+    return false;
+  }
+  Walker walker = {root, visit, leave_dir, {}, false};
+  walker.walk(reader);
+  return !walker.stopped;
+}
+#endif
+
+/**
+ * @brief List all files and directories in a directory.
+ *
+ * @param path The path to the directory.
+ * @param entries A vector to store the entries in the directory.
+ * @return true if the directory is listed successfully, false otherwise.
+ */
+inline bool list_dir(const std::string &path,
+                     std::vector<std::string> &entries) {
+  entries.clear();
+#ifdef _WIN32
+  std::string pattern = path + "\\*";
+  WIN32_FIND_DATAA find_data;
+  HANDLE handle = FindFirstFileA(pattern.c_str(), &find_data);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  do {
+    std::string entry_name = find_data.cFileName;
+    if (entry_name != "." && entry_name != "..") {
+      entries.push_back(entry_name);
+    }
+  } while (FindNextFileA(handle, &find_data) != 0);
+  FindClose(handle);
+#else
+  DIR *dir = opendir(path.c_str());
+  if (!dir) {
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string entry_name = entry->d_name;
+    if (entry_name != "." && entry_name != "..") {
+      entries.push_back(entry_name);
+    }
+  }
+  closedir(dir);
+#endif
+  return true;
+}
+
+/**
+ * @brief Remove the file or directory at the given path.
+ *
+ * @param path The path to remove.
+ * @return true if the operation was successful, false otherwise.
+ */
+inline bool remove_path(const std::string &path) {
+#ifdef _WIN32
+  if (is_dir(path)) {
+    dir_cache().erase_prefix(path);
+    // directory
+    std::vector<std::string> entries;
+    if (!list_dir(path, entries)) {
+      return false;
+    }
+    for (const auto &entry : entries) {
+      if (entry != "." && entry != "..") {
+        const std::string full_path = path_join(path, entry);
+        if (!remove_path(full_path)) {
+          return false;
+        }
+      }
+    }
+    if (_rmdir(path.c_str()) != 0) {
+      return false;
+    }
+  } else {
+    // file
+    if (_unlink(path.c_str()) != 0) {
+      return false;
+    }
+  }
+  return true;
+#else
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    return false;
+  }
+  // 只有目录（或可能指向目录的符号链接）会出现在目录缓存中
+  if (S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)) {
+    dir_cache().erase_prefix(path);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    // file (or symbolic link, which is removed itself, not its target)
+    return unlink(path.c_str()) == 0;
+  }
+  // directory: every entry is removed relative to its parent's fd
+  bool failed = false;
+  bool walked = walk_tree(
+      path,
+      [](const WalkEntry &entry) -> WalkAction {
+        if (entry.is_dir()) {
+          return WalkAction::Continue;
+        }
+        return unlinkat(entry.dir_fd(), entry.name(), 0) == 0
+                   ? WalkAction::Continue
+                   : WalkAction::Stop;
+      },
+      [&](const WalkEntry &entry) {
+        if (unlinkat(entry.dir_fd(), entry.name(), AT_REMOVEDIR) != 0) {
+          failed = true;
+        }
+      });
+  return walked && !failed && rmdir(path.c_str()) == 0;
+#endif
+}
+
+/**
+ * @brief Normalize a path in place, in a single scan.
+ *
+ * Components are located with memchr() and moved towards the front of the
+ * buffer, so the output never overtakes the input and no other memory is
+ * needed. Unlike normpath(), an empty or "." path normalizes to an empty
+ * one.
+ *
+ * @param buf The path, overwritten with the normalized path.
+ * @param size Length of the path.
+ * @return Length of the normalized path.
+ */
+inline std::size_t normalize_path(char *buf, std::size_t size) {
+  bool absolute = size > 0 && buf[0] == path_separator;
+  // [base, fixed) 是无法再回退的前导 ".." 分量
+  std::size_t base = absolute ? 1 : 0;
+  std::size_t fixed = base;
+  std::size_t out = base;
+  std::size_t pos = 0;
+  while (pos < size) {
+    const char *sep = static_cast<const char *>(
+        std::memchr(buf + pos, path_separator, size - pos));
+    std::size_t end = sep != nullptr ? static_cast<std::size_t>(sep - buf) : size;
+    std::size_t len = end - pos;
+    bool up = len == 2 && buf[pos] == '.' && buf[pos + 1] == '.';
+    if (len == 0 || (len == 1 && buf[pos] == '.')) {
+      // 空分量或 "."
+    } else if (up && out > fixed) {
+      while (out > fixed && buf[out - 1] != path_separator) {
+        --out;
+      }
+      if (out > base) {
+        --out;
+      }
+    } else {
+      if (out > base) {
+        buf[out++] = path_separator;
+      }
+      std::memmove(buf + out, buf + pos, len);
+      out += len;
+      if (up) {
+        fixed = out;
+      }
+    }
+    pos = end + 1;
+  }
+  return out;
+}
+
+/// Normalize a path held in a std::string without reallocating it; the
+/// result is the same as normpath(path).
+inline void normpath_inplace(std::string &path) {
+  if (path.empty() || path == ".") {
+    path = ".";
+    return;
+  }
+  path.resize(normalize_path(&path[0], path.size()));
+}
+
+/**
+ * @brief Normalize a pathname by collapsing redundant separators and up-level
+ * references.
+ *
+ * The result is built in one buffer by normalize_path().
+ *
+ * @param path Path to be normalized.
+ * @return Normalized path.
+ */
+inline std::string normpath(PathView path) {
+  if (path.empty() || path == ".") {
+    return ".";
+  }
+  std::string normalized = path.str();
+  normalized.resize(normalize_path(&normalized[0], normalized.size()));
+  return normalized;
+}
+
+/**
+ * @brief Split a path into its directory and file components.
+ *
+ * This function takes a path string and returns a pair of strings: the
+ * directory component and the file component. The directory component is the
+ * portion of the path up to (but not including) the final path separator. The
+ * file component is the portion of the path after the final path separator.
+ *
+ * On Windows, both forward slashes ('/') and backslashes ('\\') are recognized
+ * as path separators.
+ *
+ * If the path does not contain a path separator, the directory component is the
+ * empty string and the file component is the entire path.
+ *
+ * @param path The path to split.
+ * @return A pair of strings: the directory component and the file component.
+ */
+inline std::pair<std::string, std::string> path_split(const std::string &path) {
+  std::pair<PathView, PathView> parts = PathView(path).split();
+  return {parts.first.str(), parts.second.str()};
+}
+
+/**
+ * @brief Split a pathname into a pair (root, ext).
+ *
+ * @param path Pathname to split.
+ * @return A pair (root, ext). ext is empty if path has no
+ *         extension. If path ends with a dot, it is considered the
+ *         extension. The root component is everything that comes
+ *         before the last dot in the path.
+ */
+inline std::pair<std::string, std::string> splitext(const std::string &path) {
+  std::pair<PathView, PathView> parts = PathView(path).splitext();
+  return {parts.first.str(), parts.second.str()};
+}
+
+/// 获取文件扩展名（不带.）
+inline std::string get_file_ext(const std::string &fpath) {
+  return PathView(fpath).ext().str();
+}
+
+/// 删除扩展名
+inline std::string remove_file_ext(const std::string &filename) {
+  return PathView(filename).stem().str();
+}
+
+/**
+ * @brief 返回路径的目录部分（最后一个分隔符之前的部分）
+ *
+ * @param path 要处理的路径字符串
+ * @return std::string 返回目录部分的字符串
+ */
+inline std::string dirname(const std::string &path) {
+  return PathView(path).dirname().str();
+}
+
+/**
+ * @brief 返回路径的文件名部分（不含目录部分）
+ *
+ * @param path 要处理的路径字符串
+ * @return std::string 返回文件名部分的字符串
+ */
+inline std::string basename(const std::string &path) {
+  return PathView(path).basename().str();
+}
+
+/// Order of the names returned by list_dir().
+enum class ListOrder {
+  /// scandir() with versionsort(): one allocation per entry and a
+  /// strverscmp() call per comparison.
+  Version,
+  /// Directory order, streamed with DirReader and not sorted at all.
+  Unordered,
+  /// Natural order (digit runs compared by value) from precomputed keys,
+  /// see sort_natural().
+  Natural,
+};
+
+/**
+ * @brief Build a key whose plain byte order is the natural order of names.
+ *
+ * Every run of digits is replaced by '0', the number of significant digits
+ * as one byte, and the significant digits, so "frame9" sorts before
+ * "frame10"; other bytes are copied. The result matches versionsort() for
+ * names without leading zeros, but names that differ only in leading zeros
+ * ("a01", "a1") compare equal.
+ *
+ * @param name The name.
+ * @param key Receives the key; its capacity is reused.
+ */
+inline void natural_sort_key(PathView name, std::string &key) {
+  key.clear();
+  key.reserve(name.size() + 4);
+  const char *p = name.data();
+  const char *end = p + name.size();
+  while (p < end) {
+    if (*p < '0' || *p > '9') {
+      key += *p++;
+      continue;
+    }
+    while (p < end && *p == '0') {
+      ++p;
+    }
+    const char *digits = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+      ++p;
+    }
+    // 超过 255 位的数字按 255 位截断比较
+    std::size_t len = std::min<std::size_t>(p - digits, 255);
+    key += '0';
+    key += static_cast<char>(len);
+    key.append(digits, len);
+  }
+}
+
+/**
+ * @brief Sort names into natural order, see natural_sort_key().
+ *
+ * Each name's key is computed once, so a comparison is a memcmp() instead
+ * of a strverscmp() parse; names with equal keys fall back to byte order.
+ * Large lists are sorted with parallel_sort().
+ *
+ * @param names The names to sort.
+ * @param num_threads Threads for a large list, 0 means one per hardware
+ * thread.
+ */
+inline void sort_natural(std::vector<std::string> &names,
+                         std::size_t num_threads = 0) {
+  // 所有键存放在同一块缓冲区中，排序时只移动 16 字节的条目
+  struct Item {
+    std::size_t offset;
+    uint32_t size;
+    uint32_t index;
+  };
+  std::vector<Item> items(names.size());
+  std::string keys;
+  std::string key;
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    natural_sort_key(names[i], key);
+    items[i] = {keys.size(), static_cast<uint32_t>(key.size()),
+                static_cast<uint32_t>(i)};
+    keys += key;
+  }
+  const char *k = keys.data();
+  parallel_sort(
+      items.begin(), items.end(),
+      [&](const Item &a, const Item &b) {
+        int c = std::memcmp(k + a.offset, k + b.offset,
+                            std::min(a.size, b.size));
+        if (c != 0) {
+          return c < 0;
+        }
+        if (a.size != b.size) {
+          return a.size < b.size;
+        }
+        return names[a.index] < names[b.index];
+      },
+      num_threads);
+  std::vector<std::string> sorted;
+  sorted.reserve(names.size());
+  for (const Item &item : items) {
+    sorted.push_back(std::move(names[item.index]));
+  }
+  names.swap(sorted);
+}
+
+/**
+ * Lists the contents of a directory specified by the given path, filtered by
  * the provided filter function.
  *
- * @param path The path of the directory to list.
- * @param filter The filter function to apply to the directory contents. Only
- * files that pass the filter will be included in the result.
- * @return A vector of strings representing the names of the files in the
- * directory that passed the filter.
+ * @param path The path of the directory to list.
+ * @param filter The filter function to apply to the directory contents. Only
+ * files that pass the filter will be included in the result.
+ * @param order How to order the names. Unordered and Natural read the
+ * directory with DirReader instead of scandir(); use Unordered when the
+ * order does not matter, it is the cheapest by far for large directories.
+ * @param num_threads Threads for sorting a large Natural listing, 0 means
+ * one per hardware thread.
+ * @return A vector of strings representing the names of the files in the
+ * directory that passed the filter.
+ */
+inline std::vector<std::string> list_dir(
+    const std::string &path,
+    const std::function<bool(const std::string &)> &filter,
+    ListOrder order = ListOrder::Version, std::size_t num_threads = 0) {
+  std::vector<std::string> filenames;
+
+  if (order != ListOrder::Version) {
+    DirReader reader(path);
+    DirReader::Entry e;
+    std::string name;
+    while (reader.next(e)) {
+      if (reader.type_of(e) != DT_REG) {
+        continue;
+      }
+      name.assign(e.name);
+      if (filter(name)) {
+        filenames.push_back(std::move(name));
+      }
+    }
+    if (order == ListOrder::Natural) {
+      sort_natural(filenames, num_threads);
+    }
+    return filenames;
+  }
+
+  struct dirent **namelist;
+  int n = scandir(path.c_str(), &namelist, nullptr, versionsort);
+  if (n >= 0) {
+    for (int i = 0; i < n; ++i) {
+      auto f = namelist[i];
+      if (f->d_type == DT_REG && filter(f->d_name)) {
+        filenames.emplace_back(f->d_name);
+      }
+      free(f);
+    }
+    free(namelist);
+  }
+
+  return filenames;
+}
+
+/**
+ * Lists all files in the specified directory that have the specified
+ * extensions.
+ *
+ * @param path The path to the directory to list files from.
+ * @param exts A vector of file extensions to filter by. If empty, all files
+ * will be returned.
+ * @param order How to order the names, see ListOrder.
+ * @param num_threads Threads for sorting a large Natural listing.
+ * @return A vector of file paths in the specified directory that have the
+ * specified extensions.
+ */
+inline std::vector<std::string> list_dir(
+    const std::string &path, const std::vector<std::string> &exts = {},
+    ListOrder order = ListOrder::Version, std::size_t num_threads = 0) {
+  std::vector<std::string> filenames;
+
+  auto filter = [&](const std::string &filename) {
+    if (exts.empty()) {
+      return true;
+    }
+    PathView ext = PathView(filename).ext();
+    return std::find(exts.begin(), exts.end(), ext) != exts.end();
+  };
+
+  filenames = list_dir(path, filter, order, num_threads);
+
+  return filenames;
+}
+
+/// All regular files in a directory, in the given order; see list_dir().
+inline std::vector<std::string> list_dir(const std::string &path,
+                                         ListOrder order,
+                                         std::size_t num_threads = 0) {
+  return list_dir(
+      path, [](const std::string &) { return true; }, order, num_threads);
+}
+
+#ifndef _WIN32
+/**
+ * @brief Arena-backed version of list_dir(): the names of the regular files
+ * in a directory, in the same version-sorted order, stored in one
+ * StringArena instead of one std::string each.
+ *
+ * @param path The directory to list.
+ * @param filter If set, only names for which it returns true are kept.
+ * @return The names; empty if the directory cannot be read.
+ */
+inline StringArena list_dir_arena(
+    const std::string &path,
+    const std::function<bool(PathView)> &filter = nullptr) {
+  StringArena names;
+  std::size_t total_size = 0;
+  DirReader reader(path);
+  DirReader::Entry e;
+  while (reader.next(e)) {
+    PathView name(e.name);
+    if (reader.type_of(e) == DT_REG && (!filter || filter(name))) {
+      names.add(name);
+      total_size += name.size();
+    }
+  }
+  std::vector<std::size_t> order(names.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+    return strverscmp(names[a].data(), names[b].data()) < 0;
+  });
+  StringArena sorted;
+  sorted.reserve(names.size(), total_size);
+  for (std::size_t i : order) {
+    sorted.add(names[i]);
+  }
+  return sorted;
+}
+#endif
+
+#ifndef _WIN32
+/**
+ * @brief Read the remaining entries of an open directory, appending the names
+ * of its subdirectories and files to the given vectors.
+ *
+ * Symbolic links count as files; entries that vanish while the directory is
+ * read are skipped.
+ */
+inline void scan_dir(DirReader &reader, std::vector<std::string> &dirnames,
+                     std::vector<std::string> &filenames) {
+  DirReader::Entry entry;
+  while (reader.next(entry)) {
+    unsigned char type = reader.type_of(entry);
+    if (type == DT_UNKNOWN) {
+      // 读取目录后被删除的条目
+      continue;
+    }
+    if (type == DT_DIR) {
+      dirnames.emplace_back(entry.name);
+    } else {
+      filenames.emplace_back(entry.name);
+    }
+  }
+}
+#endif
+
+/**
+ * @brief Scan a single directory, appending the names of its subdirectories
+ * and files to the given vectors.
+ *
+ * Entries are classified with lstat semantics: symbolic links are reported as
+ * files and never followed. The type reported by the directory itself
+ * (d_type) is trusted; an lstat is only issued for entries whose type is
+ * unknown.
+ *
+ * @param dir The directory to scan.
+ * @param dirnames Receives the names of the subdirectories.
+ * @param filenames Receives the names of the other entries.
+ * @return true if the directory could be opened, false otherwise.
+ */
+inline bool scan_dir(const std::string &dir, std::vector<std::string> &dirnames,
+                     std::vector<std::string> &filenames) {
+#ifdef _WIN32
+  std::string pattern = dir + path_separator + "*.*";
+  WIN32_FIND_DATAA data;
+  HANDLE hFind = FindFirstFileA(pattern.c_str(), &data);
+  if (hFind == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  do {
+    std::string filename = data.cFileName;
+    if (filename == "." || filename == "..") continue;
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      dirnames.push_back(filename);
+    } else {
+      filenames.push_back(filename);
+    }
+  } while (FindNextFileA(hFind, &data) != 0);
+  FindClose(hFind);
+#else
+  DirReader reader(dir);
+  if (!reader.is_open()) {
+    return false;
+  }
+  scan_dir(reader, dirnames, filenames);
+#endif
+  return true;
+}
+
+/**
+ * @brief Lazily walks a directory tree one directory at a time, like
+ * Python's os.walk() with topdown=True.
+ *
+ * Iterating yields the same (dir, subdirs, files) tuples as path_walk(), but
+ * in depth-first pre-order and only one directory at a time. The yielded
+ * tuple may be modified before advancing: removing names from its subdirs
+ * vector prunes those subtrees from the walk.
+ *
+ * Only the directory being yielded and the pending subdirectory names of its
+ * ancestors are kept in memory, so memory use grows with the depth of the
+ * tree rather than its size. On POSIX systems each level holds one directory
+ * file descriptor and subdirectories are opened relative to it.
+ *
+ * @code
+ * for (auto &item : DirWalker("data")) {
+ *   auto &subdirs = std::get<1>(item);
+ *   subdirs.erase(std::remove(subdirs.begin(), subdirs.end(), ".git"),
+ *                 subdirs.end());
+ * }
+ * @endcode
+ */
+class DirWalker {
+ public:
+  using value_type = std::tuple<std::string, std::vector<std::string>,
+                                std::vector<std::string>>;
+
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = DirWalker::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = value_type *;
+    using reference = value_type &;
+
+    iterator() = default;
+    explicit iterator(DirWalker *walker) : walker_(walker) {}
+
+    reference operator*() const { return walker_->current_; }
+    pointer operator->() const { return &walker_->current_; }
+
+    iterator &operator++() {
+      if (!walker_->advance()) {
+        walker_ = nullptr;
+      }
+      return *this;
+    }
+
+    bool operator==(const iterator &other) const {
+      return walker_ == other.walker_;
+    }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+
+   private:
+    DirWalker *walker_ = nullptr;
+  };
+
+  /**
+   * @brief Open the root directory. Nothing is yielded if it cannot be read.
+   *
+   * @param root_path The directory to start the traversal from.
+   */
+  explicit DirWalker(const std::string &root_path) {
+    std::get<0>(current_) = root_path;
+#ifdef _WIN32
+    valid_ = scan_dir(root_path, std::get<1>(current_), std::get<2>(current_));
+#else
+    DirReader reader(root_path);
+    if (reader.is_open()) {
+      scan_dir(reader, std::get<1>(current_), std::get<2>(current_));
+      current_fd_ = reader.release();
+      valid_ = true;
+    }
+#endif
+  }
+
+  ~DirWalker() { close_all(); }
+
+  DirWalker(DirWalker &&other)
+      : current_(std::move(other.current_)),
+        stack_(std::move(other.stack_)),
+        current_fd_(other.current_fd_),
+        valid_(other.valid_) {
+    other.stack_.clear();
+    other.current_fd_ = -1;
+    other.valid_ = false;
+  }
+
+  DirWalker(const DirWalker &) = delete;
+  DirWalker &operator=(const DirWalker &) = delete;
+
+  /// Iterator to the current directory; the walk can only be iterated once.
+  iterator begin() { return valid_ ? iterator(this) : iterator(); }
+  iterator end() { return iterator(); }
+
+ private:
+  struct Frame {
+    std::string path;
+    int fd;
+    std::vector<std::string> subdirs;
+    std::size_t next;
+  };
+
+  /// Move to the next directory; returns false when the walk is finished.
+  bool advance() {
+    // 当前目录（可能已被调用者剪枝）的子目录入栈
+    Frame frame = {std::move(std::get<0>(current_)), current_fd_,
+                   std::move(std::get<1>(current_)), 0};
+    stack_.push_back(std::move(frame));
+    current_fd_ = -1;
+
+    while (!stack_.empty()) {
+      Frame &top = stack_.back();
+      if (top.next == top.subdirs.size()) {
+        close_fd(top.fd);
+        stack_.pop_back();
+        continue;
+      }
+      const std::string &name = top.subdirs[top.next++];
+      std::vector<std::string> dirnames;
+      std::vector<std::string> filenames;
+      std::string path = top.path + path_separator + name;
+#ifdef _WIN32
+      if (!scan_dir(path, dirnames, filenames)) {
+        continue;
+      }
+#else
+      DirReader reader(top.fd, name.c_str());
+      if (!reader.is_open()) {
+        continue;
+      }
+      scan_dir(reader, dirnames, filenames);
+      current_fd_ = reader.release();
+#endif
+      current_ = std::make_tuple(std::move(path), std::move(dirnames),
+                                 std::move(filenames));
+      return true;
+    }
+    valid_ = false;
+    return false;
+  }
+
+  static void close_fd(int fd) {
+#ifndef _WIN32
+    if (fd >= 0) {
+      ::close(fd);
+    }
+#else
+    (void)fd;
+#endif
+  }
+
+  void close_all() {
+    for (const auto &frame : stack_) {
+      close_fd(frame.fd);
+    }
+    stack_.clear();
+    close_fd(current_fd_);
+    current_fd_ = -1;
+  }
+
+  value_type current_;
+  std::vector<Frame> stack_;
+  int current_fd_ = -1;
+  bool valid_ = false;
+};
+
+/**
+ * @brief Recursively walks a directory tree and returns information about each
+ * directory and file encountered
+ *
+ * The function walks a directory tree, and for each directory and file it
+ * encounters, returns information about the directory or file in a tuple. The
+ * returned vector contains a tuple for each directory visited, and each tuple
+ * contains three elements:
+ *
+ * 1. The absolute path of the directory
+ * 2. A vector of the names of the subdirectories in the directory
+ * 3. A vector of the names of the files in the directory
+ *
+ * The function accepts a callback function, which will be called for each
+ * directory visited. The callback function can be used to customize the
+ * behavior of the directory traversal.
+ *
+ * @param path The path to the directory to start the traversal from
+ * @return A vector containing a tuple for each directory visited. Each tuple
+ * contains three elements: the absolute path of the directory, a vector of the
+ * names of the subdirectories in the directory, and a vector of the names of
+ * the files in the directory.
+ */
+inline std::vector<
+    std::tuple<std::string, std::vector<std::string>, std::vector<std::string>>>
+path_walk(const std::string &root_path) {
+  std::vector<std::tuple<std::string, std::vector<std::string>,
+                         std::vector<std::string>>>
+      result;
+
+  std::vector<std::string> subdir_list;
+  subdir_list.push_back(root_path);
+
+  for (size_t i = 0; i < subdir_list.size(); i++) {
+    std::vector<std::string> dirnames;
+    std::vector<std::string> filenames;
+
+    std::string subdir = subdir_list[i];
+    if (!scan_dir(subdir, dirnames, filenames)) {
+      continue;
+    }
+    for (const auto &name : dirnames) {
+      subdir_list.push_back(subdir + path_separator + name);
+    }
+
+    result.push_back(std::make_tuple(subdir, dirnames, filenames));
+  }
+
+  return result;
+}
+
+/**
+ * @brief Recursively walk through a directory and execute the callback function
+ * for each file encountered.
+ *
+ * @param path The path to the directory to walk through.
+ * @param cb The callback function to execute for each file encountered. The
+ * absolute path of the file is passed as the argument.
+ */
+inline void walkdir(const std::string &path,
+                    const std::function<void(const std::string &)> &cb) {
+#ifdef _WIN32
+  std::string pattern = path + path_separator + "*";
+  WIN32_FIND_DATA data;
+  HANDLE handle = FindFirstFile(pattern.c_str(), &data);
+
+  if (handle != INVALID_HANDLE_VALUE) {
+    do {
+      std::string filename = data.cFileName;
+      if (filename != "." && filename != "..") {
+        std::string filepath = path + path_separator + filename;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+          walkdir(filepath, cb);
+        } else {
+          cb(filepath);
+        }
+      }
+    } while (FindNextFile(handle, &data));
+    FindClose(handle);
+  }
+#else
+  walk_tree(path, [&](const WalkEntry &entry) -> WalkAction {
+    if (!entry.is_dir()) {
+      cb(entry.path());
+    }
+    return WalkAction::Continue;
+  });
+#endif
+}
+
+/**
+ * @brief Parallel version of path_walk().
+ *
+ * Every directory is scanned as a separate task on a WorkStealingPool, so
+ * sibling subtrees are listed concurrently.
+ *
+ * With ordered = true the result is exactly what path_walk() returns for the
+ * same tree: the directories come out in breadth-first order and each list of
+ * names keeps the order in which the directory was read. With ordered =
+ * false the tuples are returned in completion order, which avoids keeping the
+ * whole directory tree around until the walk has finished.
+ *
+ * @param root_path The directory to start the traversal from.
+ * @param num_threads Number of worker threads, 0 means one per hardware
+ * thread.
+ * @param ordered Whether to return the tuples in path_walk() order.
+ * @return The same (dir, subdirs, files) tuples as path_walk().
+ */
+inline std::vector<
+    std::tuple<std::string, std::vector<std::string>, std::vector<std::string>>>
+path_walk_parallel(const std::string &root_path, std::size_t num_threads = 0,
+                   bool ordered = true) {
+  using WalkTuple = std::tuple<std::string, std::vector<std::string>,
+                               std::vector<std::string>>;
+  struct Node {
+    WalkTuple item;
+    bool ok = false;
+    std::vector<Node *> children;
+  };
+
+  WorkStealingPool pool(num_threads);
+  std::vector<WalkTuple> result;
+
+  if (!ordered) {
+    // 每个线程把结果写到各自的 vector 中，最后拼接
+    std::vector<std::vector<WalkTuple>> parts(pool.size() + 1);
+    std::function<void(const std::string &)> visit =
+        [&](const std::string &dir) {
+          WalkTuple item;
+          std::get<0>(item) = dir;
+          if (!scan_dir(dir, std::get<1>(item), std::get<2>(item))) {
+            return;
+          }
+          for (const auto &name : std::get<1>(item)) {
+            std::string subdir = dir + path_separator + name;
+            pool.submit([&visit, subdir] { visit(subdir); });
+          }
+          parts[pool.worker_index()].push_back(std::move(item));
+        };
+    pool.submit([&visit, root_path] { visit(root_path); });
+    pool.wait();
+    for (auto &part : parts) {
+      std::move(part.begin(), part.end(), std::back_inserter(result));
+    }
+    return result;
+  }
+
+  // 保留目录树结构，结束后按广度优先顺序输出；节点由创建它的线程持有
+  std::vector<std::vector<std::unique_ptr<Node>>> nodes(pool.size() + 1);
+  std::function<void(Node *)> visit = [&](Node *node) {
+    const std::string &dir = std::get<0>(node->item);
+    const std::vector<std::string> &dirnames = std::get<1>(node->item);
+    if (!scan_dir(dir, std::get<1>(node->item), std::get<2>(node->item))) {
+      return;
+    }
+    node->ok = true;
+    auto &own_nodes = nodes[pool.worker_index()];
+    for (const auto &name : dirnames) {
+      own_nodes.emplace_back(new Node);
+      Node *child = own_nodes.back().get();
+      std::get<0>(child->item) = dir + path_separator + name;
+      node->children.push_back(child);
+      pool.submit([&visit, child] { visit(child); });
+    }
+  };
+
+  std::unique_ptr<Node> root(new Node);
+  std::get<0>(root->item) = root_path;
+  Node *root_node = root.get();
+  pool.submit([&visit, root_node] { visit(root_node); });
+  pool.wait();
+
+  std::deque<Node *> queue{root_node};
+  while (!queue.empty()) {
+    Node *node = queue.front();
+    queue.pop_front();
+    if (!node->ok) {
+      continue;
+    }
+    result.push_back(std::move(node->item));
+    queue.insert(queue.end(), node->children.begin(), node->children.end());
+  }
+  return result;
+}
+
+/**
+ * @brief Parallel version of walkdir().
+ *
+ * Subdirectories are scanned concurrently on a WorkStealingPool. The callback
+ * is invoked from the worker threads, possibly at the same time for different
+ * files, so it must be thread-safe. Files are reported in no particular order.
+ *
+ * @param path The path to the directory to walk through.
+ * @param cb The callback function to execute for each file encountered.
+ * @param num_threads Number of worker threads, 0 means one per hardware
+ * thread.
+ */
+inline void walkdir_parallel(const std::string &path,
+                             const std::function<void(const std::string &)> &cb,
+                             std::size_t num_threads = 0) {
+  WorkStealingPool pool(num_threads);
+  std::function<void(const std::string &)> visit =
+      [&](const std::string &dir) {
+        std::vector<std::string> dirnames;
+        std::vector<std::string> filenames;
+        if (!scan_dir(dir, dirnames, filenames)) {
+          return;
+        }
+        for (const auto &name : dirnames) {
+          std::string subdir = dir + path_separator + name;
+          pool.submit([&visit, subdir] { visit(subdir); });
+        }
+        for (const auto &name : filenames) {
+          cb(dir + path_separator + name);
+        }
+      };
+  pool.submit([&visit, path] { visit(path); });
+  pool.wait();
+}
+
+#ifndef _WIN32
+/**
+ * @brief A directory tree stored as names and parent links.
+ *
+ * Entry 0 is the root, whose name is the root path. Every other entry
+ * keeps only its own name, in a StringArena, and the id of its parent
+ * directory, so a shared directory prefix is stored once no matter how many
+ * entries are below it. Full paths are assembled on demand by path().
+ */
+class PathTree {
+ public:
+  using Id = uint32_t;
+  /// Parent of the root.
+  static constexpr Id none = static_cast<Id>(-1);
+
+  PathTree() = default;
+  explicit PathTree(PathView root) { add(none, root, DT_DIR); }
+
+  /// Add an entry below parent and return its id.
+  Id add(Id parent, PathView name, unsigned char type) {
+    names_.add(name);
+    parents_.push_back(parent);
+    types_.push_back(type);
+    return static_cast<Id>(parents_.size() - 1);
+  }
+
+  /// Number of entries, including the root.
+  std::size_t size() const { return parents_.size(); }
+  bool empty() const { return parents_.empty(); }
+
+  PathView name(Id id) const { return names_[id]; }
+  Id parent(Id id) const { return parents_[id]; }
+  /// DT_* type of the entry; symbolic links are DT_LNK.
+  unsigned char type(Id id) const { return types_[id]; }
+  bool is_dir(Id id) const { return types_[id] == DT_DIR; }
+
+  /// Append the full path of an entry, starting with the root, to out.
+  void append_path(Id id, std::string &out) const {
+    std::size_t start = out.size();
+    std::size_t size = 0;
+    for (Id i = id; i != none; i = parents_[i]) {
+      size += names_[i].size() + 1;
+    }
+    // 从叶子向根回溯，从后往前填充
+    std::size_t end = start + size - 1;
+    out.resize(end);
+    for (Id i = id; i != none; i = parents_[i]) {
+      PathView name = names_[i];
+      end -= name.size();
+      std::memcpy(&out[end], name.data(), name.size());
+      if (end > start) {
+        out[--end] = path_separator;
+      }
+    }
+  }
+
+  /// The full path of an entry, starting with the root.
+  std::string path(Id id) const {
+    std::string out;
+    append_path(id, out);
+    return out;
+  }
+
+  /// Bytes held by the tree.
+  std::size_t memory_usage() const {
+    return names_.memory_usage() + parents_.capacity() * sizeof(Id) +
+           types_.capacity();
+  }
+
+ private:
+  StringArena names_;
+  std::vector<Id> parents_;
+  std::vector<unsigned char> types_;
+};
+
+constexpr PathTree::Id PathTree::none;
+
+/**
+ * @brief Walk a directory tree into a PathTree.
+ *
+ * The compact counterpart of path_walk(): every entry is recorded in
+ * walk_tree() order (depth-first, parents before their contents) with one
+ * copy of its name, and no full path is built. Symbolic links are recorded
+ * but not followed.
+ *
+ * @param root The directory to walk.
+ * @return The tree; only the root entry if root cannot be read.
+ */
+inline PathTree path_walk_tree(const std::string &root) {
+  PathTree tree(root);
+  // 当前路径上各级目录的 id，下标为深度
+  std::vector<PathTree::Id> dirs(1, 0);
+  walk_tree(root, [&](const WalkEntry &entry) -> WalkAction {
+    dirs.resize(entry.depth() + 1);
+    PathTree::Id id =
+        tree.add(dirs.back(), PathView(entry.name()), entry.type());
+    if (entry.is_dir()) {
+      dirs.push_back(id);
+    }
+    return WalkAction::Continue;
+  });
+  return tree;
+}
+#endif
+
+/**
+ * @brief A glob pattern compiled into a small automaton over path
+ * components.
+ *
+ * Supported syntax, applied to '/'-separated paths relative to a root:
+ *   - `*` any run of characters within one component, `?` one character
+ *   - `[abc]`, `[a-z]`, `[!a-z]` (or `[^a-z]`) character classes
+ *   - `**` as a whole component: zero or more directories
+ *   - `{jpg,png}` alternatives, which may be nested and contain `/`
+ *   - `\` escapes the next character
+ *
+ * Wildcards also match names starting with a dot. An unterminated `[` or a
+ * brace group without a comma is taken literally.
+ *
+ * The pattern is parsed once; matching a name against a component does not
+ * allocate. The state functions (initial(), step(), ...) let a traversal
+ * keep one set of states per directory, so it can tell whether anything
+ * below a directory can still match before opening it; see glob_walk().
+ */
+class GlobPattern {
+ public:
+  /// A state of the automaton: an index into the compiled components.
+  using State = uint32_t;
+
+  explicit GlobPattern(const std::string &pattern) : pattern_(pattern) {
+    std::vector<std::string> alternatives;
+    expand_braces(pattern, alternatives);
+    for (const auto &alternative : alternatives) {
+      starts_.push_back(static_cast<State>(segments_.size()));
+      std::size_t start = 0;
+      while (start <= alternative.size()) {
+        std::size_t end = alternative.find('/', start);
+        if (end == std::string::npos) {
+          end = alternative.size();
+        }
+        std::string part = alternative.substr(start, end - start);
+        start = end + 1;
+        if (part.empty() || part == ".") {
+          continue;
+        }
+        if (part == "**") {
+          if (segments_.size() > starts_.back() &&
+              segments_.back().kind == GlobStar) {
+            continue;  // 连续的 ** 等价于一个
+          }
+          segments_.push_back({GlobStar, std::string()});
+        } else {
+          bool literal = part.find_first_of("*?[\\") == std::string::npos;
+          segments_.push_back({literal ? Literal : Wildcard, part});
+        }
+      }
+      segments_.push_back({End, std::string()});
+    }
+  }
+
+  /// The pattern as given.
+  const std::string &pattern() const { return pattern_; }
+
+  /**
+   * @brief Match one name against one wildcard component (no `**`, no
+   * braces), without allocating.
+   */
+  static bool match_name(PathView pattern, PathView name) {
+    const char *p = pattern.begin();
+    const char *pe = pattern.end();
+    const char *s = name.begin();
+    const char *se = name.end();
+    const char *star_p = nullptr;
+    const char *star_s = nullptr;
+    while (s < se) {
+      if (p < pe && *p == '*') {
+        star_p = ++p;
+        star_s = s;
+        continue;
+      }
+      const char *next = p < pe ? match_char(p, pe, *s) : nullptr;
+      if (next != nullptr) {
+        p = next;
+        ++s;
+      } else if (star_p != nullptr) {
+        // 回溯：让上一个 * 多吞一个字符
+        p = star_p;
+        s = ++star_s;
+      } else {
+        return false;
+      }
+    }
+    while (p < pe && *p == '*') {
+      ++p;
+    }
+    return p == pe;
+  }
+
+  /// Whether a path relative to the root, '/'-separated, matches.
+  bool match(PathView path) const {
+    for (State start : starts_) {
+      if (match_from(start, path)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// The states before any component has been consumed.
+  void initial(std::vector<State> &states) const {
+    states.clear();
+    for (State start : starts_) {
+      add_closure(start, states);
+    }
+  }
+
+  /**
+   * @brief Consume one path component.
+   *
+   * @param from The states of the parent directory.
+   * @param name The component.
+   * @param to Receives the states after name.
+   * @return true if the path ending in name matches the pattern.
+   */
+  bool step(const std::vector<State> &from, PathView name,
+            std::vector<State> &to) const {
+    to.clear();
+    for (State state : from) {
+      const Segment &segment = segments_[state];
+      if (segment.kind == GlobStar) {
+        add_closure(state, to);
+      } else if ((segment.kind == Literal && name == segment.text) ||
+                 (segment.kind == Wildcard &&
+                  match_name(segment.text, name))) {
+        add_closure(state + 1, to);
+      }
+    }
+    return accepts(to);
+  }
+
+  /// Whether states contain a complete match.
+  bool accepts(const std::vector<State> &states) const {
+    for (State state : states) {
+      if (segments_[state].kind == End) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// Whether a longer path can still match, i.e. a directory in these
+  /// states is worth opening.
+  bool can_descend(const std::vector<State> &states) const {
+    for (State state : states) {
+      if (segments_[state].kind != End) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief If every state that can consume a component only accepts a
+   * fixed name, collect those names, so the directory does not have to be
+   * listed.
+   *
+   * @return false if some state accepts a wildcard.
+   */
+  bool literal_names(const std::vector<State> &states,
+                     std::vector<const char *> &names) const {
+    names.clear();
+    for (State state : states) {
+      const Segment &segment = segments_[state];
+      if (segment.kind == End) {
+        continue;
+      }
+      if (segment.kind != Literal) {
+        return false;
+      }
+      const char *name = segment.text.c_str();
+      if (std::find_if(names.begin(), names.end(), [&](const char *other) {
+            return std::strcmp(other, name) == 0;
+          }) == names.end()) {
+        names.push_back(name);
+      }
+    }
+    return true;
+  }
+
+ private:
+  enum Kind : uint8_t { Literal, Wildcard, GlobStar, End };
+  struct Segment {
+    Kind kind;
+    std::string text;
+  };
+
+  /// 展开第一个含逗号的花括号，递归处理其余部分
+  static void expand_braces(const std::string &pattern,
+                            std::vector<std::string> &out) {
+    for (std::size_t i = 0; i < pattern.size(); ++i) {
+      if (pattern[i] == '\\') {
+        ++i;
+        continue;
+      }
+      if (pattern[i] != '{') {
+        continue;
+      }
+      std::vector<std::size_t> commas;
+      int depth = 0;
+      std::size_t close = std::string::npos;
+      for (std::size_t j = i + 1; j < pattern.size(); ++j) {
+        char c = pattern[j];
+        if (c == '\\') {
+          ++j;
+        } else if (c == '{') {
+          ++depth;
+        } else if (c == '}') {
+          if (depth-- == 0) {
+            close = j;
+            break;
+          }
+        } else if (c == ',' && depth == 0) {
+          commas.push_back(j);
+        }
+      }
+      if (close == std::string::npos || commas.empty()) {
+        continue;
+      }
+      std::string prefix = pattern.substr(0, i);
+      std::string suffix = pattern.substr(close + 1);
+      commas.push_back(close);
+      std::size_t begin = i + 1;
+      for (std::size_t comma : commas) {
+        expand_braces(prefix + pattern.substr(begin, comma - begin) + suffix,
+                      out);
+        begin = comma + 1;
+      }
+      return;
+    }
+    out.push_back(pattern);
+  }
+
+  /// Match c against the pattern element at p; returns the position after
+  /// the element, or nullptr.
+  static const char *match_char(const char *p, const char *pe, char c) {
+    if (*p == '?') {
+      return p + 1;
+    }
+    if (*p == '\\' && p + 1 < pe) {
+      return p[1] == c ? p + 2 : nullptr;
+    }
+    if (*p != '[') {
+      return *p == c ? p + 1 : nullptr;
+    }
+    const char *q = p + 1;
+    bool negate = q < pe && (*q == '!' || *q == '^');
+    if (negate) {
+      ++q;
+    }
+    bool matched = false;
+    bool first = true;
+    unsigned char uc = static_cast<unsigned char>(c);
+    for (; q < pe && (first || *q != ']'); first = false) {
+      unsigned char lo = static_cast<unsigned char>(*q++);
+      unsigned char hi = lo;
+      if (q + 1 < pe && *q == '-' && q[1] != ']') {
+        hi = static_cast<unsigned char>(q[1]);
+        q += 2;
+      }
+      if (lo <= uc && uc <= hi) {
+        matched = true;
+      }
+    }
+    if (q >= pe) {
+      // 没有 ']'，'[' 按普通字符处理
+      return c == '[' ? p + 1 : nullptr;
+    }
+    return matched != negate ? q + 1 : nullptr;
+  }
+
+  void add_closure(State state, std::vector<State> &states) const {
+    for (;;) {
+      if (std::find(states.begin(), states.end(), state) == states.end()) {
+        states.push_back(state);
+      }
+      if (segments_[state].kind != GlobStar) {
+        return;
+      }
+      ++state;
+    }
+  }
+
+  /// 回溯匹配，无需分配状态集合
+  bool match_from(State state, PathView path) const {
+    while (!path.empty() && path.front() == '/') {
+      path = path.substr(1);
+    }
+    const Segment &segment = segments_[state];
+    if (path.empty()) {
+      return segment.kind == End ||
+             (segment.kind == GlobStar && match_from(state + 1, path));
+    }
+    std::size_t slash = 0;
+    while (slash < path.size() && path[slash] != '/') {
+      ++slash;
+    }
+    PathView name = path.substr(0, slash);
+    PathView rest = path.substr(slash);
+    if (name == ".") {
+      return match_from(state, rest);
+    }
+    switch (segment.kind) {
+      case End:
+        return false;
+      case GlobStar:
+        return match_from(state + 1, path) || match_from(state, rest);
+      case Literal:
+        return name == segment.text && match_from(state + 1, rest);
+      case Wildcard:
+        return match_name(segment.text, name) && match_from(state + 1, rest);
+    }
+    return false;
+  }
+
+  std::string pattern_;
+  std::vector<Segment> segments_;
+  std::vector<State> starts_;
+};
+
+#ifndef _WIN32
+/**
+ * @brief Walk only the parts of a directory tree that can match a glob
+ * pattern.
+ *
+ * Every directory carries the set of GlobPattern states reached by its
+ * path. A name is tested against those states before anything else is done
+ * with it, and a subdirectory is opened only if some state can consume
+ * further components: a pattern that starts with "data/" never reads a
+ * directory outside data, and one that continues with "2024-*" only opens
+ * the matching subdirectories of data. Where the states only accept fixed names the
+ * directory is not listed at all; the names are looked up with fstatat().
+ * Symbolic links are reported but never followed.
+ *
+ * @param root The directory the pattern is relative to.
+ * @param pattern The compiled pattern.
+ * @param visit Called for every matching entry, files and directories;
+ * WalkAction::Skip keeps a matching directory from being descended into.
+ * @param enter_dir If given, called for every directory just before its
+ * contents are walked.
+ * @return false if root could not be opened or the walk was stopped.
+ */
+inline bool glob_walk(const std::string &root, const GlobPattern &pattern,
+                      const WalkVisitor &visit,
+                      const std::function<void(const WalkEntry &)> &enter_dir =
+                          nullptr) {
+  struct Walker {
+    const std::string &root;
+    const GlobPattern &pattern;
+    const WalkVisitor &visit;
+    const std::function<void(const WalkEntry &)> &enter_dir;
+    std::vector<const char *> parents;
+    // 每层目录一个状态集合，重复使用避免分配
+    std::vector<std::vector<GlobPattern::State>> levels;
+    std::vector<std::vector<const char *>> literals;
+    bool stopped;
+
+    /// Handle one entry of the directory at depth.
+    void entry(int dir_fd, std::size_t depth, const char *name,
+               unsigned char type) {
+      if (levels.size() <= depth + 1) {
+        levels.resize(depth + 2);
+        literals.resize(depth + 2);
+      }
+      std::vector<GlobPattern::State> &states = levels[depth + 1];
+      bool matched = pattern.step(levels[depth], PathView(name), states);
+      bool descend = pattern.can_descend(states);
+      if (!matched && !descend) {
+        return;
+      }
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          return;
+        }
+        type = DirReader::mode_to_dtype(st.st_mode);
+      }
+      WalkEntry walk_entry(root, parents, dir_fd, name, type);
+      if (matched) {
+        WalkAction action = visit(walk_entry);
+        if (action == WalkAction::Stop) {
+          stopped = true;
+          return;
+        }
+        if (action == WalkAction::Skip) {
+          return;
+        }
+      }
+      if (!descend || type != DT_DIR) {
+        return;
+      }
+      DirReader child(dir_fd, name);
+      if (!child.is_open()) {
+        return;
+      }
+      if (enter_dir) {
+        enter_dir(walk_entry);
+      }
+      parents.push_back(name);
+      walk(child, depth + 1);
+      parents.pop_back();
+    }
+
+    void walk(DirReader &reader, std::size_t depth) {
+      // 递归会扩充 levels/literals，因此每次都按下标访问
+      if (pattern.literal_names(levels[depth], literals[depth])) {
+        for (std::size_t i = 0; i < literals[depth].size() && !stopped; ++i) {
+          entry(reader.fd(), depth, literals[depth][i], DT_UNKNOWN);
+        }
+        return;
+      }
+      DirReader::Entry e;
+      while (!stopped && reader.next(e)) {
+        entry(reader.fd(), depth, e.name, e.type);
+      }
+    }
+  };
+
+  DirReader reader(root);
+  if (!reader.is_open()) {
+    return false;
+  }
+  Walker walker = {root, pattern, visit, enter_dir, {}, {}, {}, false};
+  walker.levels.resize(1);
+  walker.literals.resize(1);
+  pattern.initial(walker.levels[0]);
+  walker.walk(reader, 0);
+  return !walker.stopped;
+}
+
+/**
+ * @brief walkdir() that only reports files matching a glob pattern,
+ * relative to path. Directories that cannot contain a match are not
+ * opened; see glob_walk().
+ */
+inline void walkdir(const std::string &path, const GlobPattern &pattern,
+                    const std::function<void(const std::string &)> &cb) {
+  glob_walk(path, pattern, [&](const WalkEntry &entry) -> WalkAction {
+    if (!entry.is_dir()) {
+      cb(entry.path());
+    }
+    return WalkAction::Continue;
+  });
+}
+
+/**
+ * @brief path_walk() restricted to a glob pattern, relative to root_path.
+ *
+ * Only the directories that can contain a match are opened. Each tuple
+ * lists the subdirectories that were descended into and the files that
+ * matched; the tuples come in depth-first order.
+ */
+inline std::vector<
+    std::tuple<std::string, std::vector<std::string>, std::vector<std::string>>>
+path_walk(const std::string &root_path, const GlobPattern &pattern) {
+  std::vector<std::tuple<std::string, std::vector<std::string>,
+                         std::vector<std::string>>>
+      result;
+  // 当前路径上各级目录在 result 中的下标
+  std::vector<std::size_t> stack;
+  auto current = [&](const WalkEntry &entry)
+      -> std::tuple<std::string, std::vector<std::string>,
+                    std::vector<std::string>> & {
+    stack.resize(entry.depth() + 1);
+    return result[stack.back()];
+  };
+  result.emplace_back(root_path, std::vector<std::string>(),
+                      std::vector<std::string>());
+  stack.push_back(0);
+  bool ok = glob_walk(
+      root_path, pattern,
+      [&](const WalkEntry &entry) -> WalkAction {
+        if (!entry.is_dir()) {
+          std::get<2>(current(entry)).emplace_back(entry.name());
+        }
+        return WalkAction::Continue;
+      },
+      [&](const WalkEntry &entry) {
+        std::get<1>(current(entry)).emplace_back(entry.name());
+        result.emplace_back(entry.path(), std::vector<std::string>(),
+                            std::vector<std::string>());
+        stack.push_back(result.size() - 1);
+      });
+  if (!ok) {
+    result.clear();
+  }
+  return result;
+}
+#endif
+
+#ifndef _WIN32
+/// Counters reported by remove_tree().
+struct RemoveStats {
+  std::size_t files = 0;   ///< Files, links and other non-directories removed
+  std::size_t dirs = 0;    ///< Directories removed, including the root
+  std::size_t failed = 0;  ///< Entries that could not be removed or read
+  int first_error = 0;     ///< errno of the first failure
+};
+
+/// Options for remove_tree().
+struct RemoveOptions {
+  /// Worker threads, 0 means one per hardware thread.
+  std::size_t num_threads = 0;
+  /// Called every progress_interval removed entries and once at the end.
+  /// Calls are serialized but may come from any worker thread.
+  std::function<void(const RemoveStats &)> progress;
+  std::size_t progress_interval = 10000;
+};
+
+/**
+ * @brief Remove a file or a whole directory tree, deleting sibling subtrees
+ * in parallel.
+ *
+ * Every directory is scanned as a task on a WorkStealingPool. Entries are
+ * classified from d_type and removed with unlinkat() relative to their
+ * directory's file descriptor; a directory is removed as soon as its last
+ * child is gone. Symbolic links are removed, never followed.
+ *
+ * Unlike remove_path(), a failure does not stop the deletion: everything
+ * that can be removed is removed and the failures are counted.
+ *
+ * @param path The file or directory to remove.
+ * @param options Thread count and progress reporting.
+ * @return Counts of removed and failed entries; failed == 0 means path no
+ * longer exists.
+ */
+inline RemoveStats remove_tree(const std::string &path,
+                               const RemoveOptions &options = RemoveOptions()) {
+  struct Counters {
+    std::atomic<std::size_t> files{0};
+    std::atomic<std::size_t> dirs{0};
+    std::atomic<std::size_t> failed{0};
+    std::atomic<int> first_error{0};
+    std::mutex progress_mtx;
+
+    RemoveStats snapshot() const {
+      RemoveStats stats;
+      stats.files = files;
+      stats.dirs = dirs;
+      stats.failed = failed;
+      stats.first_error = first_error;
+      return stats;
+    }
+  };
+  struct Node {
+    Node *parent;
+    std::string name;
+    int fd;
+    // 本目录的扫描任务加上尚未删除的子目录数
+    std::atomic<std::size_t> pending;
+  };
+
+  Counters counters;
+  auto fail = [&](int error) {
+    ++counters.failed;
+    int expected = 0;
+    counters.first_error.compare_exchange_strong(expected, error);
+  };
+  auto removed = [&](std::atomic<std::size_t> &counter) {
+    ++counter;
+    if (options.progress && options.progress_interval > 0 &&
+        (counters.files + counters.dirs) % options.progress_interval == 0) {
+      std::lock_guard<std::mutex> lock(counters.progress_mtx);
+      options.progress(counters.snapshot());
+    }
+  };
+
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    fail(errno);
+    return counters.snapshot();
+  }
+  if (S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode)) {
+    dir_cache().erase_prefix(path);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (unlink(path.c_str()) == 0) {
+      removed(counters.files);
+    } else {
+      fail(errno);
+    }
+    return counters.snapshot();
+  }
+
+  WorkStealingPool pool(options.num_threads);
+  std::function<void(Node *)> complete = [&](Node *node) {
+    while (node != nullptr && --node->pending == 0) {
+      // 所有子项都已处理，删除该目录本身
+      if (node->fd >= 0) {
+        ::close(node->fd);
+      }
+      Node *parent = node->parent;
+      int result = parent != nullptr
+                       ? unlinkat(parent->fd, node->name.c_str(), AT_REMOVEDIR)
+                       : rmdir(path.c_str());
+      if (result == 0) {
+        removed(counters.dirs);
+      } else {
+        fail(errno);
+      }
+      delete node;
+      node = parent;
+    }
+  };
+  std::function<void(Node *)> scan = [&](Node *node) {
+    std::unique_ptr<DirReader> reader(
+        node->parent != nullptr
+            ? new DirReader(node->parent->fd, node->name.c_str())
+            : new DirReader(path));
+    if (!reader->is_open()) {
+      fail(reader->error());
+      complete(node);
+      return;
+    }
+    node->fd = reader->fd();
+    DirReader::Entry entry;
+    while (reader->next(entry)) {
+      unsigned char type = reader->type_of(entry);
+      if (type == DT_DIR) {
+        Node *child = new Node;
+        child->parent = node;
+        child->name = entry.name;
+        child->fd = -1;
+        child->pending = 1;
+        ++node->pending;
+        pool.submit([&scan, child] { scan(child); });
+      } else if (unlinkat(node->fd, entry.name, 0) == 0) {
+        removed(counters.files);
+      } else if (errno != ENOENT) {
+        fail(errno);
+      }
+    }
+    if (reader->error() != 0) {
+      fail(reader->error());
+    }
+    // 子目录任务仍会使用该描述符，由 complete() 负责关闭
+    reader->release();
+    complete(node);
+  };
+
+  Node *root = new Node;
+  root->parent = nullptr;
+  root->fd = -1;
+  root->pending = 1;
+  pool.submit([&scan, root] { scan(root); });
+  pool.wait();
+
+  RemoveStats stats = counters.snapshot();
+  if (options.progress) {
+    options.progress(stats);
+  }
+  return stats;
+}
+#endif
+
+/**
+ * @brief 获取文件大小
+ *
+ * @param path 文件路径
+ * @return std::size_t 文件大小（单位：字节）
+ */
+inline std::size_t getsize(const std::string &path) {
+  std::size_t size = 0;
+
+#ifdef _WIN32
+  // Windows 平台下使用 GetFileSizeEx 获取文件大小
+  HANDLE hFile =
+      CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (hFile != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(hFile, &fileSize)) {
+      size = static_cast<std::size_t>(fileSize.QuadPart);
+    }
+    CloseHandle(hFile);
+  }
+#else
+  // Unix 平台下使用 stat 获取文件大小
+  struct stat st;
+  if (stat_path(path, st) == 0) {
+    size = static_cast<std::size_t>(st.st_size);
+  }
+#endif
+
+  return size;
+}
+
+#ifndef _WIN32
+/// How copy_file() moved the data.
+enum class CopyMethod {
+  None,           ///< Nothing copied: an error, or skipped as unchanged
+  Reflink,        ///< FICLONE, the copy shares extents with the source
+  CopyFileRange,  ///< copy_file_range(), copied inside the kernel
+  Sendfile,       ///< sendfile(), copied inside the kernel
+  ReadWrite,      ///< read() and write() through a user-space buffer
+};
+
+/// Options for copy_file() and copy_tree().
+struct CopyOptions {
+  /// Worker threads for copy_tree(), 0 means one per hardware thread.
+  std::size_t num_threads = 0;
+  /// Leave a destination file alone when its size and modification time
+  /// match the source, for incremental copies.
+  bool skip_unchanged = false;
+  /// Try a FICLONE reflink first on copy-on-write file systems.
+  bool reflink = true;
+};
+
+/// Counters reported by copy_tree().
+struct CopyStats {
+  std::size_t files = 0;     ///< Files copied
+  std::size_t dirs = 0;      ///< Directories created or already present
+  std::size_t symlinks = 0;  ///< Symbolic links recreated
+  std::size_t skipped = 0;   ///< Unchanged files left alone
+  std::size_t reflinked = 0;  ///< Copied files cloned with FICLONE
+  uint64_t bytes = 0;        ///< Bytes of the copied files
+  std::size_t failed = 0;    ///< Entries that could not be copied
+  int first_error = 0;       ///< errno of the first failure
+};
+
+/**
+ * @brief Copy size bytes from in to out, both positioned at offset 0,
+ * without passing them through user space where the system allows.
+ *
+ * Tries a FICLONE reflink, then copy_file_range(), then sendfile(), and
+ * falls back to read()/write() when the kernel or file system refuses,
+ * e.g. with EXDEV between file systems on older kernels. A method that
+ * copies nothing at offset 0 of a non-empty file counts as refusing.
+ *
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int copy_fd(int in, int out, uint64_t size, bool reflink,
+                   CopyMethod &method) {
+  method = CopyMethod::None;
+  uint64_t done = 0;
+#ifdef __linux__
+#ifdef FICLONE
+  if (reflink && size > 0 && ioctl(out, FICLONE, in) == 0) {
+    method = CopyMethod::Reflink;
+    return 0;
+  }
+#else
+  (void)reflink;
+#endif
+#if CPP_UTILS_HAS_COPY_FILE_RANGE
+  while (done < size) {
+    ssize_t n = copy_file_range(in, nullptr, out, nullptr,
+                                static_cast<std::size_t>(std::min<uint64_t>(
+                                    size - done, 1u << 30)),
+                                0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      // 偏移 0 处返回 0 视为不支持（procfs、部分 FUSE/NFS、5.3~5.18
+      // 内核的跨文件系统复制），与 coreutils 一样换下一种方式
+      if (done == 0 &&
+          (n == 0 || errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+           errno == EOPNOTSUPP || errno == EPERM)) {
+        break;
+      }
+      if (n < 0) {
+        return errno;
+      }
+      // 文件在复制过程中变短
+      method = CopyMethod::CopyFileRange;
+      return 0;
+    }
+    done += static_cast<uint64_t>(n);
+  }
+  if (done > 0 || size == 0) {
+    method = CopyMethod::CopyFileRange;
+    return 0;
+  }
+#endif
+  while (done < size) {
+    ssize_t n = sendfile(out, in, nullptr,
+                         static_cast<std::size_t>(
+                             std::min<uint64_t>(size - done, 1u << 30)));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (done == 0 && (n == 0 || errno == EINVAL || errno == ENOSYS)) {
+        break;
+      }
+      if (n < 0) {
+        return errno;
+      }
+      method = CopyMethod::Sendfile;
+      return 0;
+    }
+    done += static_cast<uint64_t>(n);
+  }
+  if (done > 0) {
+    method = CopyMethod::Sendfile;
+    return 0;
+  }
+#else
+  (void)reflink;
+#endif
+  std::vector<char> buffer(static_cast<std::size_t>(
+      std::min<uint64_t>(std::max<uint64_t>(size, 1), 1024 * 1024)));
+  while (done < size) {
+    ssize_t n = read(in, buffer.data(), buffer.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return errno;
+    }
+    if (n == 0) {
+      break;
+    }
+    for (ssize_t written = 0; written < n;) {
+      ssize_t w = write(out, buffer.data() + written,
+                        static_cast<std::size_t>(n - written));
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w < 0) {
+        return errno;
+      }
+      written += w;
+    }
+    done += static_cast<uint64_t>(n);
+  }
+  method = CopyMethod::ReadWrite;
+  return 0;
+}
+
+/**
+ * @brief Copy a regular file, keeping its permission bits and
+ * modification time.
+ *
+ * The destination is created or truncated. The data is moved by copy_fd(),
+ * so it stays inside the kernel, or is shared outright by a reflink, where
+ * the file systems allow.
+ *
+ * @param src The file to copy.
+ * @param dst The new file; its directory must exist.
+ * @param options skip_unchanged and reflink are used.
+ * @param method If not null, receives how the data was copied.
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int copy_file(const std::string &src, const std::string &dst,
+                     const CopyOptions &options = CopyOptions(),
+                     CopyMethod *method = nullptr) {
+  CopyMethod used = CopyMethod::None;
+  if (method != nullptr) {
+    *method = used;
+  }
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return errno;
+  }
+  struct stat st;
+  if (fstat(in, &st) != 0) {
+    int error = errno;
+    close(in);
+    return error;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(in);
+    return EINVAL;
+  }
+  struct stat dst_st;
+  if (options.skip_unchanged && stat(dst.c_str(), &dst_st) == 0 &&
+      S_ISREG(dst_st.st_mode) && dst_st.st_size == st.st_size &&
+      dst_st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+      dst_st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+    close(in);
+    return 0;
+  }
+  int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 st.st_mode & 07777);
+  if (out < 0) {
+    int error = errno;
+    close(in);
+    return error;
+  }
+#ifdef __linux__
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  int error = copy_fd(in, out, static_cast<uint64_t>(st.st_size),
+                      options.reflink, used);
+  if (error == 0) {
+    // 保留修改时间，增量复制据此判断文件是否变化
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    if (fchmod(out, st.st_mode & 07777) != 0 || futimens(out, times) != 0) {
+      error = errno;
+    }
+  }
+  close(in);
+  if (close(out) != 0 && error == 0) {
+    error = errno;
+  }
+  if (method != nullptr) {
+    *method = error == 0 ? used : CopyMethod::None;
+  }
+  return error;
+}
+
+/**
+ * @brief Copy a directory tree, copying sibling directories and files in
+ * parallel.
+ *
+ * Every directory is listed as a task on a WorkStealingPool; its
+ * subdirectories are created before their own tasks are queued, and every
+ * file is copied with copy_file() as a separate task. Symbolic links are
+ * recreated, not followed; other special files are counted as failures
+ * with ENOTSUP. Existing destination entries are overwritten, or left
+ * alone when options.skip_unchanged finds them unchanged.
+ *
+ * @param src The directory whose contents are copied; a file is copied on
+ * its own.
+ * @param dst The destination directory, created if missing.
+ * @param options Threads, incremental mode and reflinks.
+ * @return Counts of copied, skipped and failed entries.
+ */
+inline CopyStats copy_tree(const std::string &src, const std::string &dst,
+                           const CopyOptions &options = CopyOptions()) {
+  struct Counters {
+    std::atomic<std::size_t> files{0};
+    std::atomic<std::size_t> dirs{0};
+    std::atomic<std::size_t> symlinks{0};
+    std::atomic<std::size_t> skipped{0};
+    std::atomic<std::size_t> reflinked{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<std::size_t> failed{0};
+    std::atomic<int> first_error{0};
+  };
+  Counters counters;
+  auto fail = [&](int error) {
+    ++counters.failed;
+    int expected = 0;
+    counters.first_error.compare_exchange_strong(expected, error);
+  };
+  auto copy_one = [&](const std::string &from, const std::string &to) {
+    CopyMethod method;
+    int error = copy_file(from, to, options, &method);
+    if (error != 0) {
+      fail(error);
+    } else if (method == CopyMethod::None) {
+      ++counters.skipped;
+    } else {
+      ++counters.files;
+      counters.reflinked += method == CopyMethod::Reflink;
+      counters.bytes += static_cast<uint64_t>(getsize(from));
+    }
+  };
+  auto snapshot = [&] {
+    CopyStats stats;
+    stats.files = counters.files;
+    stats.dirs = counters.dirs;
+    stats.symlinks = counters.symlinks;
+    stats.skipped = counters.skipped;
+    stats.reflinked = counters.reflinked;
+    stats.bytes = counters.bytes;
+    stats.failed = counters.failed;
+    stats.first_error = counters.first_error;
+    return stats;
+  };
+
+  struct stat st;
+  if (stat(src.c_str(), &st) != 0) {
+    fail(errno);
+    return snapshot();
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    copy_one(src, dst);
+    return snapshot();
+  }
+  if (!makedirs(dst)) {
+    fail(errno);
+    return snapshot();
+  }
+  ++counters.dirs;
+
+  WorkStealingPool pool(options.num_threads);
+  std::function<void(const std::string &, const std::string &)> copy_dir =
+      [&](const std::string &from, const std::string &to) {
+        DirReader reader(from);
+        if (!reader.is_open()) {
+          fail(reader.error());
+          return;
+        }
+        DirReader::Entry e;
+        while (reader.next(e)) {
+          std::string src_path = from + path_separator + e.name;
+          std::string dst_path = to + path_separator + e.name;
+          unsigned char type = reader.type_of(e);
+          if (type == DT_DIR) {
+            if (mkdir(dst_path.c_str(), 0777) != 0 && errno != EEXIST) {
+              fail(errno);
+              continue;
+            }
+            ++counters.dirs;
+            pool.submit([&copy_dir, src_path, dst_path] {
+              copy_dir(src_path, dst_path);
+            });
+          } else if (type == DT_REG) {
+            pool.submit([&copy_one, src_path, dst_path] {
+              copy_one(src_path, dst_path);
+            });
+          } else if (type == DT_LNK) {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(reader.fd(), e.name, target, sizeof(target));
+            if (n < 0 || n == sizeof(target)) {
+              fail(n < 0 ? errno : ENAMETOOLONG);
+              continue;
+            }
+            target[n] = '\0';
+            if (symlink(target, dst_path.c_str()) != 0 &&
+                (errno != EEXIST || unlink(dst_path.c_str()) != 0 ||
+                 symlink(target, dst_path.c_str()) != 0)) {
+              fail(errno);
+              continue;
+            }
+            ++counters.symlinks;
+          } else if (type != DT_UNKNOWN) {
+            // DT_UNKNOWN 表示条目在列出后已被删除
+            fail(ENOTSUP);
+          }
+        }
+        if (reader.error() != 0) {
+          fail(reader.error());
+        }
+      };
+  pool.submit([&copy_dir, &src, &dst] { copy_dir(src, dst); });
+  pool.wait();
+  return snapshot();
+}
+#endif
+
+/// 确保文件父目录存在（已创建过的目录会被缓存，见 makedirs_cached；
+/// 被其他进程删除的目录不会重新创建）
+inline std::string valid_filepath(std::string const &fpath) {
+  makedirs_cached(dirname(fpath));
+  return fpath;
+}
+
+/**
+ * @brief Format a time as the date and time directories used by
+ * get_now_datetime_path(), without std::put_time.
+ *
+ * @param t The time, converted to local time.
+ * @param seconds Include seconds ("%Y-%m-%d/%H-%M-%S") or stop at minutes
+ * ("%Y-%m-%d/%H-%M").
+ */
+inline std::string format_datetime_path(std::time_t t, bool seconds = true) {
+  std::tm tm;
+#ifdef _WIN32
+  localtime_s(&tm, &t);
+#else
+  localtime_r(&t, &tm);
+#endif
+  char buf[32];
+  int n = std::snprintf(buf, sizeof(buf), "%04d-%02d-%02d%c%02d-%02d",
+                        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                        path_separator, tm.tm_hour, tm.tm_min);
+  if (seconds) {
+    n += std::snprintf(buf + n, sizeof(buf) - n, "-%02d", tm.tm_sec);
+  }
+  return std::string(buf, static_cast<std::size_t>(n));
+}
+
+inline std::string get_now_datetime_path() {
+  return format_datetime_path(std::time(nullptr));
+}
+
+/// Length of the time buckets of an OutputLayout.
+enum class TimeBucket { Second, Minute };
+
+/// Options for OutputLayout.
+struct OutputLayoutOptions {
+  TimeBucket bucket = TimeBucket::Second;
+  /// Hash subdirectories per bucket, named in hex ("00".."ff" for 256);
+  /// 0 puts files directly in the bucket directory.
+  unsigned shards = 256;
+  /// Create the next bucket directory on a background thread before the
+  /// clock reaches it. Shards are always created on first use.
+  bool precreate = true;
+};
+
+/**
+ * @brief Lays out output files as root/date/time/shard/name, e.g.
+ * "out/2024-05-01/12-30-05/3f/frame.jpg", with the directories already
+ * created.
+ *
+ * The bucket directory is the one get_now_datetime_path() would return,
+ * but it is formatted only when the second (or minute) rolls over rather
+ * than on every call. The shard is a hash of the file name, so a busy
+ * bucket spreads its files over many directories instead of one huge one.
+ * A background thread creates the next bucket directory ahead of time, so
+ * a quiet second costs one mkdir rather than one per shard; a shard is
+ * created by the first path() that needs it, and later calls for it make
+ * no system call at all. When writing pauses or stops, the precreated
+ * bucket is left behind empty.
+ *
+ * path() is thread-safe; directories are created without holding the
+ * lock, so producers do not queue behind each other's mkdir calls.
+ */
+class OutputLayout {
+ public:
+  explicit OutputLayout(
+      const std::string &root,
+      const OutputLayoutOptions &options = OutputLayoutOptions())
+      : root_(root), options_(options) {
+    std::size_t digits = 1;
+    for (unsigned n = 16; n < options.shards; n *= 16) {
+      ++digits;
+    }
+    shard_digits_ = options.shards > 0 ? digits : 0;
+    if (options.precreate) {
+      worker_ = std::thread([this] { run(); });
+    }
+  }
+
+  OutputLayout(const OutputLayout &) = delete;
+  OutputLayout &operator=(const OutputLayout &) = delete;
+
+  ~OutputLayout() {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    if (worker_.joinable()) {
+      worker_.join();
+    }
+  }
+
+  /// The bucket directory for time t.
+  std::string bucket_dir(std::time_t t) const {
+    return path_join(root_, format_datetime_path(
+                                t, options_.bucket == TimeBucket::Second));
+  }
+
+  /// The shard subdirectory name for a file name, empty without shards.
+  std::string shard_name(const std::string &name) const {
+    if (options_.shards == 0) {
+      return std::string();
+    }
+    return shard_dir(shard_of(name));
+  }
+
+  /**
+   * @brief The path to write a file called name to now; its directory
+   * exists unless it could not be created.
+   */
+  std::string path(const std::string &name) {
+    std::string out;
+    path(name, out);
+    return out;
+  }
+
+  /// path() into a caller-supplied string, reusing its capacity.
+  void path(const std::string &name, std::string &out) {
+    std::size_t shard = options_.shards > 0 ? shard_of(name) : 0;
+    std::time_t t = std::time(nullptr);
+    int64_t key = bucket_key(t);
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (key != current_key_) {
+      roll_over(key, t);
+    }
+    out.assign(current_dir_);
+    if (options_.shards > 0) {
+      out += path_separator;
+      append_shard(out, shard);
+    }
+    if (!ready_[shard]) {
+      // 目录尚未创建；mkdir 在锁外进行，并发创建同一目录也无妨
+      lock.unlock();
+      bool created = makedirs(out);
+      lock.lock();
+      if (created && current_key_ == key) {
+        ready_[shard] = 1;
+      }
+    }
+    out += path_separator;
+    out += name;
+  }
+
+ private:
+  int64_t bucket_key(std::time_t t) const {
+    // 本地时间与 UTC 的偏移是整分钟，分钟边界与 t / 60 一致
+    return options_.bucket == TimeBucket::Second
+               ? static_cast<int64_t>(t)
+               : static_cast<int64_t>(t) / 60;
+  }
+
+  std::time_t key_time(int64_t key) const {
+    return static_cast<std::time_t>(
+        options_.bucket == TimeBucket::Second ? key : key * 60);
+  }
+
+  std::size_t shard_of(const std::string &name) const {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : name) {
+      h = (h ^ c) * 0x100000001b3ull;
+    }
+    return static_cast<std::size_t>(h % options_.shards);
+  }
+
+  void append_shard(std::string &out, std::size_t shard) const {
+    static const char hex[] = "0123456789abcdef";
+    for (std::size_t i = shard_digits_; i > 0; --i) {
+      out += hex[(shard >> (4 * (i - 1))) & 0xf];
+    }
+  }
+
+  std::string shard_dir(std::size_t shard) const {
+    std::string s;
+    append_shard(s, shard);
+    return s;
+  }
+
+  /// Make key the current bucket; called with mtx_ held.
+  void roll_over(int64_t key, std::time_t t) {
+    current_key_ = key;
+    current_dir_ = bucket_dir(t);
+    // 后台线程只创建时间段目录，分片目录在首次使用时创建
+    ready_.assign(std::max(options_.shards, 1u),
+                  options_.shards == 0 && key == prepared_key_);
+    if (options_.precreate) {
+      wanted_key_ = key + 1;
+      cv_.notify_one();
+    }
+  }
+
+  /// Create the bucket directory with the given key.
+  void prepare(int64_t key) { makedirs(bucket_dir(key_time(key))); }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    for (;;) {
+      cv_.wait(lock, [this] { return stop_ || wanted_key_ > prepared_key_; });
+      if (stop_) {
+        return;
+      }
+      int64_t key = wanted_key_;
+      lock.unlock();
+      prepare(key);
+      lock.lock();
+      prepared_key_ = key;
+      if (current_key_ == key && options_.shards == 0) {
+        // 准备期间时钟已进入该时间段
+        ready_[0] = 1;
+      }
+    }
+  }
+
+  std::string root_;
+  OutputLayoutOptions options_;
+  std::size_t shard_digits_ = 0;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  int64_t current_key_ = INT64_MIN;
+  std::string current_dir_;
+  std::vector<char> ready_;  ///< Shards of the current bucket known to exist
+  int64_t wanted_key_ = INT64_MIN;
+  int64_t prepared_key_ = INT64_MIN;
+  bool stop_ = false;
+  std::thread worker_;
+};
+
+}  // namespace
+
+namespace fs_utils_shared {
+
+/// Category of a file name as determined by classify_file().
+enum class FileCategory : uint8_t {
+  Unknown = 0,
+  Image,
+  Video,
+  Audio,
+  Archive,
+  Document,
+  /// First value available for categories added through register_file_ext().
+  User = 64,
+};
+
+/**
+ * @brief Pack a lowercased extension of up to 8 characters into an integer.
+ *
+ * Usable in constant expressions, so the built-in extension table of
+ * classify_file() compiles into a switch over integer constants.
+ */
+constexpr uint64_t file_ext_key(const char *ext, std::size_t size,
+                                std::size_t i = 0) {
+  return i == size ? 0
+                   : (uint64_t(static_cast<unsigned char>(
+                          ext[i] >= 'A' && ext[i] <= 'Z' ? ext[i] | 0x20
+                                                         : ext[i]))
+                      << (8 * i)) |
+                         file_ext_key(ext, size, i + 1);
+}
+
+template <std::size_t N>
+constexpr uint64_t file_ext_key(const char (&ext)[N]) {
+  static_assert(N - 1 <= 8, "extension too long");
+  return file_ext_key(ext, N - 1);
+}
+
+/// 用户注册的扩展名，写时复制，查找时无需加锁；整个进程共享一份
+class FileExtRegistry {
+ public:
+  using Map = std::unordered_map<uint64_t, FileCategory>;
+
+  static FileExtRegistry &instance() {
+    static FileExtRegistry registry;
+    return registry;
+  }
+
+  /// The current map, or nullptr if nothing was registered.
+  const Map *map() const { return map_.load(std::memory_order_acquire); }
+
+  void add(uint64_t key, FileCategory category) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    const Map *current = map_.load(std::memory_order_relaxed);
+    std::unique_ptr<Map> next(current ? new Map(*current) : new Map());
+    (*next)[key] = category;
+    map_.store(next.get(), std::memory_order_release);
+    // 旧的表可能仍在被其他线程读取，保留到进程结束
+    maps_.push_back(std::move(next));
+  }
+
+ private:
+  std::mutex mtx_;
+  std::atomic<const Map *> map_{nullptr};
+  std::vector<std::unique_ptr<Map>> maps_;
+};
+
+}  // namespace fs_utils_shared
+
+namespace {
+
+using fs_utils_shared::FileCategory;
+using fs_utils_shared::FileExtRegistry;
+using fs_utils_shared::file_ext_key;
+
+/**
+ * @brief Add or override the category of an extension for classify_file().
+ *
+ * Meant to be called during start-up; each call copies the registry, while
+ * lookups stay lock-free. The registry is shared by every translation unit
+ * of the process.
+ *
+ * @param ext The extension without the dot, case-insensitive, at most 8
+ * characters.
+ * @param category A built-in category or FileCategory::User + n.
+ * @return false if ext is empty or too long.
+ */
+inline bool register_file_ext(const std::string &ext, FileCategory category) {
+  if (ext.empty() || ext.size() > 8) {
+    return false;
+  }
+  FileExtRegistry::instance().add(file_ext_key(ext.data(), ext.size()),
+                                  category);
+  return true;
+}
+
+/**
+ * @brief Classify a file name by its extension.
+ *
+ * The extension is whatever follows the last dot of the last path
+ * component; a leading dot (a hidden file) does not start one. The
+ * extension is matched case-insensitively without allocating: at most 9
+ * characters are read from the end of the name, packed into an integer and
+ * looked up in the user registry, then in a switch over the built-in
+ * extensions.
+ *
+ * @param name A file name or path.
+ * @param size Length of name.
+ */
+inline FileCategory classify_file(const char *name, std::size_t size) {
+  uint64_t key = 0;
+  std::size_t length = 0;
+  std::size_t i = size;
+  for (; i > 0; --i) {
+    char c = name[i - 1];
+    if (c == '.') {
+      break;
+    }
+    if (c == '/' || c == path_separator || length == 8) {
+      return FileCategory::Unknown;
+    }
+    if (c >= 'A' && c <= 'Z') {
+      c |= 0x20;
+    }
+    key = (key << 8) | static_cast<unsigned char>(c);
+    ++length;
+  }
+  // 没有扩展名，或是以点开头的隐藏文件
+  if (i <= 1 || length == 0 || name[i - 2] == '/' ||
+      name[i - 2] == path_separator) {
+    return FileCategory::Unknown;
+  }
+
+  const FileExtRegistry::Map *user = FileExtRegistry::instance().map();
+  if (user != nullptr) {
+    auto it = user->find(key);
+    if (it != user->end()) {
+      return it->second;
+    }
+  }
+
+  switch (key) {
+    case file_ext_key("bmp"):
+    case file_ext_key("gif"):
+    case file_ext_key("jpeg"):
+    case file_ext_key("jpg"):
+    case file_ext_key("png"):
+    case file_ext_key("svg"):
+    case file_ext_key("tif"):
+    case file_ext_key("tiff"):
+    case file_ext_key("webp"):
+      return FileCategory::Image;
+    case file_ext_key("avi"):
+    case file_ext_key("mp4"):
+    case file_ext_key("mkv"):
+    case file_ext_key("mov"):
+    case file_ext_key("wmv"):
+    case file_ext_key("flv"):
+    case file_ext_key("f4v"):
+    case file_ext_key("rmvb"):
+    case file_ext_key("rm"):
+    case file_ext_key("3gp"):
+    case file_ext_key("dat"):
+    case file_ext_key("ts"):
+    case file_ext_key("mts"):
+    case file_ext_key("vob"):
+    case file_ext_key("mpg"):
+    case file_ext_key("mpeg"):
+    case file_ext_key("m4v"):
+    case file_ext_key("webm"):
+      return FileCategory::Video;
+    case file_ext_key("aac"):
+    case file_ext_key("aiff"):
+    case file_ext_key("ape"):
+    case file_ext_key("flac"):
+    case file_ext_key("m4a"):
+    case file_ext_key("mp3"):
+    case file_ext_key("ogg"):
+    case file_ext_key("opus"):
+    case file_ext_key("wav"):
+    case file_ext_key("wma"):
+      return FileCategory::Audio;
+    case file_ext_key("7z"):
+    case file_ext_key("bz2"):
+    case file_ext_key("gz"):
+    case file_ext_key("lz4"):
+    case file_ext_key("rar"):
+    case file_ext_key("tar"):
+    case file_ext_key("tgz"):
+    case file_ext_key("xz"):
+    case file_ext_key("zip"):
+    case file_ext_key("zst"):
+      return FileCategory::Archive;
+    case file_ext_key("csv"):
+    case file_ext_key("doc"):
+    case file_ext_key("docx"):
+    case file_ext_key("md"):
+    case file_ext_key("odp"):
+    case file_ext_key("ods"):
+    case file_ext_key("odt"):
+    case file_ext_key("pdf"):
+    case file_ext_key("ppt"):
+    case file_ext_key("pptx"):
+    case file_ext_key("rtf"):
+    case file_ext_key("txt"):
+    case file_ext_key("xls"):
+    case file_ext_key("xlsx"):
+      return FileCategory::Document;
+    default:
+      return FileCategory::Unknown;
+  }
+}
+
+inline FileCategory classify_file(const std::string &name) {
+  return classify_file(name.data(), name.size());
+}
+
+inline FileCategory classify_file(const char *name) {
+  return classify_file(name, std::strlen(name));
+}
+
+#if __cplusplus >= 201703L
+inline FileCategory classify_file(std::string_view name) {
+  return classify_file(name.data(), name.size());
+}
+#endif
+
+/**
+ * @brief Determine if a file is a image file by its extension.
+ *
+ * The extension is matched case-insensitively, see classify_file(). A
+ * hidden file has no extension unless its name contains another dot, so
+ * "dir/.png" is not an image while "dir/.a.png" is.
+ *
+ * @param path The path to the file.
+ * @return true if the file is a image file, false otherwise.
+ */
+inline bool is_image(const std::string &path) {
+  return classify_file(path.data(), path.size()) == FileCategory::Image;
+}
+
+/**
+ * @brief Determine if a file is a video file by its extension.
+ *
+ * The extension is matched case-insensitively, see classify_file(). A
+ * hidden file has no extension unless its name contains another dot, so
+ * "dir/.mp4" is not a video while "dir/.a.mp4" is.
+ *
+ * @param path The path to the file.
+ * @return true if the file is a video file, false otherwise.
+ */
+inline bool is_video(const std::string &path) {
+  return classify_file(path.data(), path.size()) == FileCategory::Video;
+}
+
+/// Number of bytes read from the start of a file by sniff_files(); enough
+/// to see the third packet of an MPEG transport stream.
+constexpr std::size_t file_head_size = 512;
+
+/// A file signature ("magic number") recognised by match_file_magic().
+struct FileMagic {
+  /// Short name of the format, e.g. "png".
+  const char *format;
+  FileCategory category;
+  /// Number of leading bytes the signature covers, at most 16.
+  std::size_t size;
+  /// The expected bytes and the mask of those that must match, as two
+  /// words in memory order.
+  uint64_t pattern[2];
+  uint64_t mask[2];
+};
+
+/// 构造签名，bytes 中的 '?' 匹配任意字节
+inline FileMagic make_file_magic(const char *format, FileCategory category,
+                                 const char *bytes, std::size_t size) {
+  unsigned char pattern[16] = {};
+  unsigned char mask[16] = {};
+  for (std::size_t i = 0; i < size; ++i) {
+    if (bytes[i] != '?') {
+      pattern[i] = static_cast<unsigned char>(bytes[i]);
+      mask[i] = 0xff;
+    }
+  }
+  FileMagic magic = {format, category, size, {0, 0}, {0, 0}};
+  std::memcpy(magic.pattern, pattern, sizeof(pattern));
+  std::memcpy(magic.mask, mask, sizeof(mask));
+  return magic;
+}
+
+/// The signature table, most specific first.
+inline const std::vector<FileMagic> &file_magics() {
+  static const std::vector<FileMagic> magics = {
+      make_file_magic("jpeg", FileCategory::Image, "\xFF\xD8\xFF", 3),
+      make_file_magic("png", FileCategory::Image, "\x89PNG\r\n\x1A\n", 8),
+      make_file_magic("gif", FileCategory::Image, "GIF87a", 6),
+      make_file_magic("gif", FileCategory::Image, "GIF89a", 6),
+      make_file_magic("webp", FileCategory::Image, "RIFF????WEBP", 12),
+      make_file_magic("bmp", FileCategory::Image, "BM????\0\0\0\0", 10),
+      make_file_magic("tiff", FileCategory::Image, "II*\0", 4),
+      make_file_magic("tiff", FileCategory::Image, "MM\0*", 4),
+      make_file_magic("heic", FileCategory::Image, "????ftypheic", 12),
+      make_file_magic("heic", FileCategory::Image, "????ftypheix", 12),
+      make_file_magic("heif", FileCategory::Image, "????ftypmif1", 12),
+      make_file_magic("heif", FileCategory::Image, "????ftypmsf1", 12),
+      make_file_magic("heif", FileCategory::Image, "????ftyphevc", 12),
+      make_file_magic("heif", FileCategory::Image, "????ftyphevx", 12),
+      make_file_magic("avif", FileCategory::Image, "????ftypavif", 12),
+      make_file_magic("avif", FileCategory::Image, "????ftypavis", 12),
+      make_file_magic("m4a", FileCategory::Audio, "????ftypM4A ", 12),
+      make_file_magic("m4a", FileCategory::Audio, "????ftypM4B ", 12),
+      make_file_magic("m4a", FileCategory::Audio, "????ftypM4P ", 12),
+      // ISO-BMFF 只认已知的视频品牌，其他品牌（如 crx、jp2）不当作视频
+      make_file_magic("mp4", FileCategory::Video, "????ftypiso", 11),
+      make_file_magic("mp4", FileCategory::Video, "????ftypmp4", 11),
+      make_file_magic("mp4", FileCategory::Video, "????ftypavc1", 12),
+      make_file_magic("mp4", FileCategory::Video, "????ftypdash", 12),
+      make_file_magic("mp4", FileCategory::Video, "????ftypmmp4", 12),
+      make_file_magic("mp4", FileCategory::Video, "????ftypMSNV", 12),
+      make_file_magic("m4v", FileCategory::Video, "????ftypM4V", 11),
+      make_file_magic("f4v", FileCategory::Video, "????ftypF4V ", 12),
+      make_file_magic("f4v", FileCategory::Video, "????ftypf4v ", 12),
+      make_file_magic("3gp", FileCategory::Video, "????ftyp3g", 10),
+      make_file_magic("mov", FileCategory::Video, "????ftypqt  ", 12),
+      // 没有 ftyp 的旧 QuickTime 文件直接以其他顶层 atom 开头
+      make_file_magic("mov", FileCategory::Video, "????moov", 8),
+      make_file_magic("mov", FileCategory::Video, "????mdat", 8),
+      make_file_magic("mov", FileCategory::Video, "????wide", 8),
+      make_file_magic("mov", FileCategory::Video, "????free", 8),
+      make_file_magic("mov", FileCategory::Video, "????skip", 8),
+      make_file_magic("mov", FileCategory::Video, "????pnot", 8),
+      make_file_magic("mkv", FileCategory::Video, "\x1A\x45\xDF\xA3", 4),
+      make_file_magic("avi", FileCategory::Video, "RIFF????AVI ", 12),
+      make_file_magic("dat", FileCategory::Video, "RIFF????CDXA", 12),
+      make_file_magic("rm", FileCategory::Video, ".RMF", 4),
+      make_file_magic("flv", FileCategory::Video, "FLV\x01", 4),
+      make_file_magic("asf", FileCategory::Video,
+                      "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8),
+      make_file_magic("mpeg", FileCategory::Video, "\0\0\1\xBA", 4),
+      make_file_magic("mpeg", FileCategory::Video, "\0\0\1\xB3", 4),
+      make_file_magic("wav", FileCategory::Audio, "RIFF????WAVE", 12),
+      make_file_magic("aiff", FileCategory::Audio, "FORM????AIFF", 12),
+      make_file_magic("mp3", FileCategory::Audio, "ID3", 3),
+      make_file_magic("flac", FileCategory::Audio, "fLaC", 4),
+      make_file_magic("ogg", FileCategory::Audio, "OggS", 4),
+      make_file_magic("zip", FileCategory::Archive, "PK\3\4", 4),
+      make_file_magic("zip", FileCategory::Archive, "PK\5\6", 4),
+      make_file_magic("gzip", FileCategory::Archive, "\x1F\x8B", 2),
+      make_file_magic("bzip2", FileCategory::Archive, "BZh", 3),
+      make_file_magic("xz", FileCategory::Archive, "\xFD" "7zXZ\0", 6),
+      make_file_magic("7z", FileCategory::Archive, "7z\xBC\xAF\x27\x1C", 6),
+      make_file_magic("rar", FileCategory::Archive, "Rar!\x1A\x07", 6),
+      make_file_magic("zstd", FileCategory::Archive, "\x28\xB5\x2F\xFD", 4),
+      make_file_magic("pdf", FileCategory::Document, "%PDF-", 5),
+      make_file_magic("ole", FileCategory::Document,
+                      "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", 8),
+  };
+  return magics;
+}
+
+/// 无法用开头固定字节描述的格式：MPEG-TS 与 SVG
+inline const FileMagic *match_file_structure(const unsigned char *p,
+                                             std::size_t size) {
+  static const FileMagic ts =
+      make_file_magic("mpegts", FileCategory::Video, "\x47", 1);
+  static const FileMagic m2ts =
+      make_file_magic("m2ts", FileCategory::Video, "????\x47", 5);
+  static const FileMagic svg =
+      make_file_magic("svg", FileCategory::Image, "<", 1);
+  // 188 字节的传输包都以同步字节 0x47 开头；M2TS 每包前另有 4 字节时间码
+  if (size > 188 && p[0] == 0x47 && p[188] == 0x47 &&
+      (size <= 376 || p[376] == 0x47)) {
+    return &ts;
+  }
+  if (size > 196 && p[4] == 0x47 && p[196] == 0x47 &&
+      (size <= 388 || p[388] == 0x47)) {
+    return &m2ts;
+  }
+  // 跳过 BOM 和空白后是标记，且开头部分出现 <svg 元素
+  std::size_t i = 0;
+  if (size >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) {
+    i = 3;
+  }
+  while (i < size && (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' ||
+                      p[i] == '\n')) {
+    ++i;
+  }
+  if (i < size && p[i] == '<') {
+    for (; i + 4 < size; ++i) {
+      if (std::memcmp(p + i, "<svg", 4) == 0 &&
+          (p[i + 4] == ' ' || p[i + 4] == '>' || p[i + 4] == '\t' ||
+           p[i + 4] == '\r' || p[i + 4] == '\n')) {
+        return &svg;
+      }
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Find the signature that the start of a file matches.
+ *
+ * The first 16 bytes are loaded once as two words; each signature is then
+ * checked with two masked word compares instead of a byte-wise memcmp.
+ * Formats without a fixed leading signature are checked afterwards: MPEG
+ * transport streams by their sync bytes (this needs at least 189 bytes)
+ * and SVG by an <svg element within the data.
+ *
+ * @param data The first bytes of the file.
+ * @param size Number of bytes available.
+ * @return The matching entry of file_magics(), or nullptr.
+ */
+inline const FileMagic *match_file_magic(const void *data, std::size_t size) {
+  uint64_t word[2] = {0, 0};
+  std::memcpy(word, data, std::min<std::size_t>(size, sizeof(word)));
+  for (const auto &magic : file_magics()) {
+    if (size >= magic.size &&
+        (((word[0] & magic.mask[0]) ^ magic.pattern[0]) |
+         ((word[1] & magic.mask[1]) ^ magic.pattern[1])) == 0) {
+      return &magic;
+    }
+  }
+  return match_file_structure(static_cast<const unsigned char *>(data), size);
+}
+
+/**
+ * @brief Determine the category of a file from its first bytes, ignoring
+ * its name. Zip based formats (docx, xlsx) are reported as archives.
+ *
+ * @param data The first bytes of the file, file_head_size is enough.
+ * @param size Number of bytes available.
+ */
+inline FileCategory sniff_file_type(const void *data, std::size_t size) {
+  const FileMagic *magic = match_file_magic(data, size);
+  return magic != nullptr ? magic->category : FileCategory::Unknown;
+}
+
+///  判断是否为在线视频
+inline bool is_online_video(const std::string &url) {
+  static const std::vector<std::string> remote_protocols = {
+      "http://", "https://", "ftp://", "sftp://", "rtsp://", "rtmp://"};
+  return std::any_of(
+      remote_protocols.begin(), remote_protocols.end(),
+      [&](const std::string &protocol) { return url.find(protocol) == 0; });
+}
+
+/**
+ * @brief Lists all image files in the specified directory.
+ *
+ * This function returns a vector of strings containing the names of all image
+ * files (i.e., files with extensions .jpg, .jpeg, .png, .bmp, .gif) in the
+ * specified directory.
+ *
+ * @param path The path to the directory to search for image files. Defaults to
+ * the current directory.
+ *
+ * @return A vector of strings containing the names of all image files in the
+ * specified directory.
+ */
+inline std::vector<std::string> list_images(const std::string &path = ".") {
+  return list_dir(path, is_image);
+}
+
+/**
+ * @brief Lists all video files in the specified directory.
+ *
+ * This function returns a vector of strings containing the names of all video
+ * files (i.e., files with extensions .avi, .mp4, .mkv, .mov, .wmv, .flv, .f4v,
+ * .rmvb, .rm, .3gp, .dat, .ts, .mts, .vob, .mpg, .mpeg, .m4v, .webm) in the
+ * specified directory.
+ *
+ * @param path The path to the directory to search for video files. Defaults to
+ * the current directory.
+ *
+ * @return A vector of strings containing the names of all video files in the
+ * specified directory.
+ */
+inline std::vector<std::string> list_videos(const std::string &path = ".") {
+  return list_dir(path, is_video);
+}
+
+#ifndef _WIN32
+/**
+ * @brief Read the start of a file with a single pread().
+ *
+ * @param path The file to read.
+ * @param buf Receives up to size bytes.
+ * @param size Size of buf.
+ * @param got Number of bytes read.
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int read_file_head(const std::string &path, char *buf,
+                          std::size_t size, std::size_t &got) {
+  got = 0;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+  ssize_t n;
+  do {
+    n = pread(fd, buf, size, 0);
+  } while (n < 0 && errno == EINTR);
+  int error = n < 0 ? errno : 0;
+  close(fd);
+  if (n > 0) {
+    got = static_cast<std::size_t>(n);
+  }
+  return error;
+}
+
+/**
+ * @brief Determine the category of many files from their content.
+ *
+ * Only the first file_head_size bytes of every file are read. The paths are
+ * split into batches that a WorkStealingPool reads in parallel, so the
+ * latency of the open()/pread() pairs overlaps. Files that cannot be read
+ * are reported as FileCategory::Unknown.
+ *
+ * @param paths The files to check.
+ * @param num_threads Worker threads, 0 means one per hardware thread.
+ * @return The category of every path, in the order of paths.
+ */
+inline std::vector<FileCategory> sniff_files(
+    const std::vector<std::string> &paths, std::size_t num_threads = 0) {
+  const std::size_t batch = 64;
+  std::vector<FileCategory> categories(paths.size(), FileCategory::Unknown);
+  auto sniff_range = [&](std::size_t begin, std::size_t end) {
+    char head[file_head_size];
+    for (std::size_t i = begin; i < end; ++i) {
+      std::size_t got;
+      if (read_file_head(paths[i], head, sizeof(head), got) == 0) {
+        categories[i] = sniff_file_type(head, got);
+      }
+    }
+  };
+  if (paths.size() <= batch) {
+    sniff_range(0, paths.size());
+    return categories;
+  }
+  WorkStealingPool pool(num_threads);
+  for (std::size_t begin = 0; begin < paths.size(); begin += batch) {
+    std::size_t end = std::min(begin + batch, paths.size());
+    pool.submit([&sniff_range, begin, end] { sniff_range(begin, end); });
+  }
+  pool.wait();
+  return categories;
+}
+
+/// How list_images() and list_videos() decide whether a file qualifies.
+enum class TypeCheck {
+  /// Trust the extension, see classify_file().
+  Extension,
+  /// Look only at the first bytes of every file, see sniff_file_type().
+  Content,
+  /// Require both a matching extension and matching content.
+  ExtensionAndContent,
+};
+
+/**
+ * @brief Lists the files of a directory that belong to a category.
+ *
+ * With TypeCheck::Content or TypeCheck::ExtensionAndContent the candidates
+ * are read with sniff_files(), so files with a wrong or missing extension
+ * are found or rejected here rather than when they fail to decode.
+ *
+ * @param path The directory to list.
+ * @param category The category to keep.
+ * @param check How the category of a file is determined.
+ * @return The matching file names, in list_dir() order.
+ */
+inline std::vector<std::string> list_category(const std::string &path,
+                                              FileCategory category,
+                                              TypeCheck check) {
+  std::vector<std::string> names =
+      list_dir(path, [&](const std::string &name) {
+        return check == TypeCheck::Content || classify_file(name) == category;
+      });
+  if (check == TypeCheck::Extension) {
+    return names;
+  }
+
+  std::vector<std::string> paths;
+  paths.reserve(names.size());
+  for (const auto &name : names) {
+    paths.push_back(path_join(path, name));
+  }
+  std::vector<FileCategory> categories = sniff_files(paths);
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    if (categories[i] == category) {
+      if (kept != i) {
+        names[kept] = std::move(names[i]);
+      }
+      ++kept;
+    }
+  }
+  names.resize(kept);
+  return names;
+}
+
+/// Lists the image files of a directory, see list_category().
+inline std::vector<std::string> list_images(const std::string &path,
+                                            TypeCheck check) {
+  return list_category(path, FileCategory::Image, check);
+}
+
+/// Lists the video files of a directory, see list_category().
+inline std::vector<std::string> list_videos(const std::string &path,
+                                            TypeCheck check) {
+  return list_category(path, FileCategory::Video, check);
+}
+#endif
+
+#ifndef _WIN32
+/// Usage of the files sharing one extension, see TreeUsage.
+struct ExtUsage {
+  uint64_t files = 0;
+  uint64_t apparent_bytes = 0;
+  uint64_t allocated_bytes = 0;
+};
+
+/// Space used by a directory tree, as reported by tree_usage().
+struct TreeUsage {
+  /// Sum of the sizes of all entries, like du --apparent-size.
+  uint64_t apparent_bytes = 0;
+  /// Sum of the allocated blocks of all entries in bytes, like du.
+  uint64_t allocated_bytes = 0;
+  uint64_t files = 0;   ///< Regular files, each hard-linked file once
+  uint64_t dirs = 0;    ///< Directories, including the root
+  uint64_t others = 0;  ///< Symbolic links, sockets, devices, ...
+  /// Additional links to files already counted, which add no usage.
+  uint64_t hard_links = 0;
+  uint64_t failed = 0;  ///< Entries that could not be read or examined
+  int first_error = 0;  ///< errno of the first failure
+  /// Regular files by lowercased extension without the dot; files without
+  /// an extension are counted under "".
+  std::map<std::string, ExtUsage> by_ext;
+};
+
+/// Options for tree_usage().
+struct TreeUsageOptions {
+  /// Worker threads, 0 means one per hardware thread.
+  std::size_t num_threads = 0;
+  /// Count a file with several hard links once, like du.
+  bool dedupe_hard_links = true;
+  /// Fill TreeUsage::by_ext.
+  bool by_extension = true;
+};
+
+/// The fields of a stat result that tree_usage() needs.
+struct EntryStat {
+  uint64_t size;
+  uint64_t blocks;  ///< 512-byte blocks
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t nlink;
+  unsigned char type;  ///< DT_* value
+};
+
+/**
+ * @brief Examine an entry relative to a directory without following
+ * symbolic links.
+ *
+ * Uses statx() with only the fields of EntryStat in its mask where
+ * available, so file systems can skip the rest (timestamps, owners).
+ *
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int stat_entry_at(int dir_fd, const char *name, EntryStat &out) {
+#if CPP_UTILS_HAS_STATX
+  struct statx stx;
+  if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW,
+            STATX_TYPE | STATX_SIZE | STATX_BLOCKS | STATX_INO | STATX_NLINK,
+            &stx) != 0) {
+    return errno;
+  }
+  out.size = stx.stx_size;
+  out.blocks = stx.stx_blocks;
+  out.dev = (static_cast<uint64_t>(stx.stx_dev_major) << 32) |
+            stx.stx_dev_minor;
+  out.ino = stx.stx_ino;
+  out.nlink = stx.stx_nlink;
+  out.type = DirReader::mode_to_dtype(stx.stx_mode);
+#else
+  struct stat st;
+  if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return errno;
+  }
+  out.size = static_cast<uint64_t>(st.st_size);
+  out.blocks = static_cast<uint64_t>(st.st_blocks);
+  out.dev = static_cast<uint64_t>(st.st_dev);
+  out.ino = static_cast<uint64_t>(st.st_ino);
+  out.nlink = static_cast<uint64_t>(st.st_nlink);
+  out.type = DirReader::mode_to_dtype(st.st_mode);
+#endif
+  return 0;
+}
+
+/// Called by walk_stat_parallel() for every entry, concurrently from the
+/// workers: the worker index, the entry's directory and name, its stat.
+using StatVisitor =
+    std::function<void(std::size_t worker, const std::string &dir,
+                       const char *name, const EntryStat &st)>;
+
+/**
+ * @brief Walk a directory tree on a WorkStealingPool, examining every
+ * entry.
+ *
+ * Every directory is listed as a separate task and its entries are
+ * examined with stat_entry_at() relative to the directory descriptor, so
+ * each path is resolved once per directory rather than once per file.
+ * Symbolic links are reported but not followed; entries that vanish during
+ * the walk are skipped. Returns once the walk has finished.
+ *
+ * @param pool The pool to run on; worker indexes are in [0, pool.size()).
+ * @param dir The directory to walk, which is not reported itself.
+ * @param visit Called for every entry.
+ * @param fail Called with the errno of every directory or entry that could
+ * not be read.
+ */
+inline void walk_stat_parallel(
+    WorkStealingPool &pool, const std::string &dir, const StatVisitor &visit,
+    const std::function<void(std::size_t worker, int error)> &fail) {
+  std::function<void(const std::string &)> list =
+      [&](const std::string &path) {
+        std::size_t worker = pool.worker_index();
+        DirReader reader(path);
+        if (!reader.is_open()) {
+          fail(worker, reader.error());
+          return;
+        }
+        DirReader::Entry e;
+        while (reader.next(e)) {
+          EntryStat st;
+          int error = stat_entry_at(reader.fd(), e.name, st);
+          if (error != 0) {
+            if (error != ENOENT) {
+              fail(worker, error);
+            }
+            continue;
+          }
+          visit(worker, path, e.name, st);
+          if (st.type == DT_DIR) {
+            std::string subdir = path + path_separator + e.name;
+            pool.submit([&list, subdir] { list(subdir); });
+          }
+        }
+        if (reader.error() != 0) {
+          fail(worker, reader.error());
+        }
+      };
+  pool.submit([&list, &dir] { list(dir); });
+  pool.wait();
+}
+
+/**
+ * @brief Compute the space used by a directory tree, like du.
+ *
+ * The tree is walked with walk_stat_parallel(). Symbolic links are counted
+ * but not followed. Files with more than one link are recorded by device
+ * and inode in a sharded set and counted once. Each worker accumulates its
+ * own totals, which are merged at the end.
+ *
+ * @param root The directory to measure; a file is measured on its own.
+ * @param options Threads, hard-link handling and extension breakdown.
+ * @return The totals; failed counts the entries that could not be read.
+ */
+inline TreeUsage tree_usage(const std::string &root,
+                            const TreeUsageOptions &options =
+                                TreeUsageOptions()) {
+  // 扩展名不超过 8 个字符时以 file_ext_key() 为键，避免为每个文件构造字符串
+  struct Partial {
+    TreeUsage usage;
+    std::unordered_map<uint64_t, ExtUsage> short_exts;
+  };
+  struct InodeHash {
+    std::size_t operator()(const std::pair<uint64_t, uint64_t> &key) const {
+      return std::hash<uint64_t>()(key.second * 0x9e3779b97f4a7c15ull ^
+                                   key.first);
+    }
+  };
+  struct InodeShard {
+    std::mutex mtx;
+    std::unordered_set<std::pair<uint64_t, uint64_t>, InodeHash> seen;
+  };
+  const std::size_t num_shards = 64;
+  std::unique_ptr<InodeShard[]> shards(new InodeShard[num_shards]);
+
+  WorkStealingPool pool(options.num_threads);
+  std::vector<Partial> partials(pool.size() + 1);
+
+  auto fail = [](TreeUsage &usage, int error) {
+    ++usage.failed;
+    if (usage.first_error == 0) {
+      usage.first_error = error;
+    }
+  };
+
+  // 返回 false 表示该条目是已计数文件的另一个硬链接
+  auto first_link = [&](const EntryStat &st) {
+    if (!options.dedupe_hard_links || st.nlink < 2) {
+      return true;
+    }
+    std::pair<uint64_t, uint64_t> key(st.dev, st.ino);
+    InodeShard &shard = shards[InodeHash()(key) % num_shards];
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    return shard.seen.insert(key).second;
+  };
+
+  auto account = [&](Partial &part, const char *name, const EntryStat &st) {
+    TreeUsage &usage = part.usage;
+    if (st.type == DT_REG && !first_link(st)) {
+      ++usage.hard_links;
+      return;
+    }
+    usage.apparent_bytes += st.size;
+    usage.allocated_bytes += st.blocks * 512;
+    if (st.type == DT_DIR) {
+      ++usage.dirs;
+      return;
+    }
+    if (st.type != DT_REG) {
+      ++usage.others;
+      return;
+    }
+    ++usage.files;
+    if (!options.by_extension) {
+      return;
+    }
+    PathView ext = PathView(name).ext();
+    ExtUsage *bucket;
+    if (ext.size() <= 8) {
+      bucket = &part.short_exts[file_ext_key(ext.data(), ext.size())];
+    } else {
+      std::string key = ext.str();
+      std::transform(key.begin(), key.end(), key.begin(),
+                     [](char c) { return c >= 'A' && c <= 'Z' ? c | 0x20 : c; });
+      bucket = &usage.by_ext[key];
+    }
+    ++bucket->files;
+    bucket->apparent_bytes += st.size;
+    bucket->allocated_bytes += st.blocks * 512;
+  };
+
+  Partial &own = partials.back();
+  EntryStat st;
+  int error = stat_entry_at(AT_FDCWD, root.c_str(), st);
+  if (error != 0) {
+    fail(own.usage, error);
+  } else {
+    account(own, basename(root).c_str(), st);
+    if (st.type == DT_DIR) {
+      walk_stat_parallel(
+          pool, root,
+          [&](std::size_t worker, const std::string &, const char *name,
+              const EntryStat &entry) {
+            account(partials[worker], name, entry);
+          },
+          [&](std::size_t worker, int error) {
+            fail(partials[worker].usage, error);
+          });
+    }
+  }
+
+  TreeUsage total;
+  for (auto &part : partials) {
+    TreeUsage &usage = part.usage;
+    total.apparent_bytes += usage.apparent_bytes;
+    total.allocated_bytes += usage.allocated_bytes;
+    total.files += usage.files;
+    total.dirs += usage.dirs;
+    total.others += usage.others;
+    total.hard_links += usage.hard_links;
+    total.failed += usage.failed;
+    if (total.first_error == 0) {
+      total.first_error = usage.first_error;
+    }
+    for (const auto &item : part.short_exts) {
+      std::string ext;
+      for (uint64_t key = item.first; key != 0; key >>= 8) {
+        ext += static_cast<char>(key & 0xff);
+      }
+      usage.by_ext[ext] = item.second;
+    }
+    for (const auto &item : usage.by_ext) {
+      ExtUsage &bucket = total.by_ext[item.first];
+      bucket.files += item.second.files;
+      bucket.apparent_bytes += item.second.apparent_bytes;
+      bucket.allocated_bytes += item.second.allocated_bytes;
+    }
+  }
+  return total;
+}
+#endif
+
+// ==============================================================================================
+//                                         文件读写
+// ==============================================================================================
+
+#ifndef _WIN32
+/**
+ * @brief Read everything from an open file descriptor into a buffer.
+ *
+ * The file is sized with a single fstat() and read straight into the buffer
+ * with as few read() calls as possible. Files that report a size of 0
+ * (procfs, pipes) are read in chunks until EOF. If the file is shorter than
+ * reported the buffer is shrunk to what was read.
+ *
+ * @tparam Buffer std::string or std::vector<char>; its capacity is reused.
+ * @param fd The file descriptor, which is left open.
+ * @param buffer Receives the contents; empty on failure.
+ * @return 0 on success, otherwise an errno value.
+ */
+template <typename Buffer>
+inline int read_fd(int fd, Buffer &buffer) {
+  buffer.clear();
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return errno;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    return EISDIR;
+  }
+  std::size_t size = static_cast<std::size_t>(st.st_size);
+  std::size_t chunk = 64 * 1024;
+  std::size_t got = 0;
+  buffer.resize(size > 0 ? size : chunk);
+  for (;;) {
+    if (got == buffer.size()) {
+      if (size > 0) {
+        break;  // 已读满 fstat 报告的大小
+      }
+      buffer.resize(buffer.size() * 2);
+    }
+    ssize_t n = read(fd, &buffer[got], buffer.size() - got);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int error = errno;
+      buffer.clear();
+      return error;
+    }
+    if (n == 0) {
+      break;
+    }
+    got += static_cast<std::size_t>(n);
+  }
+  buffer.resize(got);
+  return 0;
+}
+
+/**
+ * @brief Read a whole file into a caller-supplied buffer.
+ *
+ * Unlike read_file(), nothing is printed on failure and the buffer's
+ * capacity is reused, so a loop over many small files does not allocate once
+ * the buffer has grown to the largest file.
+ *
+ * @tparam Buffer std::string or std::vector<char>.
+ * @param path The file to read.
+ * @param buffer Receives the contents; empty on failure.
+ * @return 0 on success, otherwise an errno value.
+ */
+template <typename Buffer>
+inline int read_file_into(const std::string &path, Buffer &buffer) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    buffer.clear();
+    return errno;
+  }
+  int error = read_fd(fd, buffer);
+  close(fd);
+  return error;
+}
+
+/**
+ * @brief Read a whole file, addressed relative to a directory descriptor,
+ * into a caller-supplied buffer. See read_file_into().
+ *
+ * @param dir_fd Directory file descriptor, or AT_FDCWD.
+ * @param name Path relative to dir_fd.
+ * @param buffer Receives the contents; empty on failure.
+ * @return 0 on success, otherwise an errno value.
+ */
+template <typename Buffer>
+inline int read_file_at(int dir_fd, const char *name, Buffer &buffer) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    buffer.clear();
+    return errno;
+  }
+  int error = read_fd(fd, buffer);
+  close(fd);
+  return error;
+}
+
+/**
+ * @brief Write a whole buffer to a file descriptor, retrying after short
+ * writes and EINTR.
+ *
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int write_fd(int fd, const void *data, std::size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    p += n;
+    size -= static_cast<std::size_t>(n);
+  }
+  return 0;
+}
+
+/**
+ * @brief fsync() a directory, making the creation, renaming and removal of
+ * its entries durable.
+ *
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int sync_dir(const std::string &dir) {
+  int fd = open(dir.empty() ? "." : dir.c_str(),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+  int error = fsync(fd) == 0 ? 0 : errno;
+  close(fd);
+  return error;
+}
+
+/// Options for FileWriter and write_file().
+struct WriteOptions {
+  /// Write to a temporary file in the same directory and move it over the
+  /// target on commit, so readers see the old or the new contents, never a
+  /// partial file.
+  bool atomic = false;
+  /// On commit, fdatasync() the file and, for new or atomic files, fsync()
+  /// its directory.
+  bool sync = false;
+  /// Permission bits of a new file, before the umask.
+  mode_t mode = 0644;
+  /// Buffer for small writes; nullptr means an internal one of buffer_size
+  /// bytes, allocated on the first small write.
+  char *buffer = nullptr;
+  std::size_t buffer_size = 64 * 1024;
+};
+
+/**
+ * @brief A buffered file writer built on write(2).
+ *
+ * Small writes are collected in the buffer and written with one system
+ * call when it fills; writes at least as large as the buffer go straight
+ * to the file. Nothing is committed until commit() is called.
+ *
+ * With WriteOptions::atomic the data goes to an unnamed O_TMPFILE file in
+ * the target's directory where the kernel supports it, otherwise to a
+ * hidden temporary file next to the target. commit() links or renames it
+ * into place; destroying the writer without commit() discards it. A
+ * non-atomic writer writes to the target directly and flushes on
+ * destruction, like std::ofstream.
+ */
+class FileWriter {
+ public:
+  FileWriter() = default;
+
+  explicit FileWriter(const std::string &path,
+                      const WriteOptions &options = WriteOptions()) {
+    open(path, options);
+  }
+
+  FileWriter(const FileWriter &) = delete;
+  FileWriter &operator=(const FileWriter &) = delete;
+
+  FileWriter(FileWriter &&other) noexcept { *this = std::move(other); }
+
+  FileWriter &operator=(FileWriter &&other) noexcept {
+    if (this != &other) {
+      abandon();
+      fd_ = other.fd_;
+      error_ = other.error_;
+      path_ = std::move(other.path_);
+      tmp_ = std::move(other.tmp_);
+      options_ = other.options_;
+      unnamed_ = other.unnamed_;
+      own_ = std::move(other.own_);
+      buf_ = other.buf_;
+      used_ = other.used_;
+      other.fd_ = -1;
+      other.used_ = 0;
+      other.buf_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~FileWriter() { abandon(); }
+
+  /**
+   * @brief Open a file for writing; an open writer is abandoned first.
+   *
+   * @return 0 on success, otherwise an errno value.
+   */
+  int open(const std::string &path,
+           const WriteOptions &options = WriteOptions()) {
+    abandon();
+    path_ = path;
+    tmp_.clear();
+    options_ = options;
+    unnamed_ = false;
+    used_ = 0;
+    error_ = 0;
+    buf_ = options.buffer;
+    if (!options.atomic) {
+      fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   options.mode);
+      return error_ = fd_ < 0 ? errno : 0;
+    }
+    std::string dir = dirname(path);
+#if defined(__linux__) && defined(O_TMPFILE)
+    if (proc_fd_available()) {
+      fd_ = ::open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC,
+                   options.mode);
+      if (fd_ >= 0) {
+        unnamed_ = true;
+        return 0;
+      }
+      // 文件系统不支持 O_TMPFILE 时改用具名临时文件
+      if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        return error_ = errno;
+      }
+    }
+#endif
+    fd_ = create_temp(path, options.mode, tmp_);
+    return error_ = fd_ < 0 ? errno : 0;
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  /// The file descriptor being written, -1 when closed.
+  int fd() const { return fd_; }
+
+  /// The first errno value a call has failed with, 0 if none.
+  int error() const { return error_; }
+
+  const std::string &path() const { return path_; }
+
+  /**
+   * @brief Append data to the file.
+   *
+   * @return 0 on success, otherwise an errno value; after a failure every
+   * later call fails too.
+   */
+  int write(const void *data, std::size_t size) {
+    if (fd_ < 0 || error_ != 0) {
+      return error_ != 0 ? error_ : EBADF;
+    }
+    std::size_t capacity = options_.buffer_size;
+    if (used_ + size <= capacity && size < capacity) {
+      if (buf_ == nullptr) {
+        own_.reset(new char[capacity]);
+        buf_ = own_.get();
+      }
+      std::memcpy(buf_ + used_, data, size);
+      used_ += size;
+      return 0;
+    }
+    if (flush() != 0) {
+      return error_;
+    }
+    if (size < capacity) {
+      return write(data, size);
+    }
+    return fail(write_fd(fd_, data, size));
+  }
+
+  template <typename Buffer>
+  int write(const Buffer &data) {
+    return write(data.data(), data.size() * sizeof(*data.data()));
+  }
+
+  /// Write out the buffered data.
+  int flush() {
+    if (fd_ < 0 || error_ != 0) {
+      return error_ != 0 ? error_ : EBADF;
+    }
+    int error = write_fd(fd_, buf_, used_);
+    used_ = 0;
+    return fail(error);
+  }
+
+  /**
+   * @brief Flush, make the file durable if WriteOptions::sync is set, move
+   * an atomic file into place and close the writer.
+   *
+   * @return 0 on success, otherwise the first errno value of any call.
+   */
+  int commit() {
+    if (fd_ < 0) {
+      return error_ != 0 ? error_ : EBADF;
+    }
+    flush();
+    if (error_ == 0 && options_.sync && fdatasync(fd_) != 0) {
+      fail(errno);
+    }
+    if (error_ == 0 && unnamed_) {
+      fail(link_unnamed());
+    }
+    if (::close(fd_) != 0) {
+      fail(errno);
+    }
+    fd_ = -1;
+    if (error_ == 0 && !tmp_.empty() &&
+        rename(tmp_.c_str(), path_.c_str()) != 0) {
+      fail(errno);
+    }
+    if (!tmp_.empty() && error_ != 0) {
+      unlink(tmp_.c_str());
+    }
+    tmp_.clear();
+    if (error_ == 0 && options_.sync) {
+      fail(sync_dir(dirname(path_)));
+    }
+    return error_;
+  }
+
+ private:
+  int fail(int error) {
+    if (error_ == 0) {
+      error_ = error;
+    }
+    return error_;
+  }
+
+  /// Discard an uncommitted atomic file, or flush and close a plain one.
+  void abandon() {
+    if (fd_ < 0) {
+      return;
+    }
+    if (!options_.atomic) {
+      flush();
+    }
+    ::close(fd_);
+    fd_ = -1;
+    if (!tmp_.empty()) {
+      unlink(tmp_.c_str());
+      tmp_.clear();
+    }
+  }
+
+  /// Create a uniquely named file next to path with O_EXCL.
+  static int create_temp(const std::string &path, mode_t mode,
+                         std::string &tmp) {
+    static std::atomic<uint64_t> counter{0};
+    std::string dir = dirname(path);
+    std::string prefix = path_join(dir, "." + basename(path) + ".tmp" +
+                                            std::to_string(getpid()) + ".");
+    for (;;) {
+      tmp = prefix + std::to_string(counter++);
+      int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                      mode);
+      if (fd >= 0 || errno != EEXIST) {
+        if (fd < 0) {
+          tmp.clear();
+        }
+        return fd;
+      }
+    }
+  }
+
+#if defined(__linux__) && defined(O_TMPFILE)
+  /// An O_TMPFILE file is given a name through /proc/self/fd.
+  static bool proc_fd_available() {
+    static const bool available = access("/proc/self/fd", X_OK) == 0;
+    return available;
+  }
+
+  /// Give the unnamed file its name, replacing an existing file.
+  int link_unnamed() {
+    std::string proc = "/proc/self/fd/" + std::to_string(fd_);
+    if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, path_.c_str(),
+               AT_SYMLINK_FOLLOW) == 0) {
+      return 0;
+    }
+    if (errno != EEXIST) {
+      return errno;
+    }
+    // linkat() 不能覆盖已有文件，先链接到临时名再 rename 覆盖
+    for (;;) {
+      static std::atomic<uint64_t> counter{0};
+      std::string tmp = path_join(
+          dirname(path_), "." + basename(path_) + ".tmp" +
+                              std::to_string(getpid()) + "." +
+                              std::to_string(counter++));
+      if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, tmp.c_str(),
+                 AT_SYMLINK_FOLLOW) != 0) {
+        if (errno == EEXIST) {
+          continue;
+        }
+        return errno;
+      }
+      if (rename(tmp.c_str(), path_.c_str()) != 0) {
+        int error = errno;
+        unlink(tmp.c_str());
+        return error;
+      }
+      return 0;
+    }
+  }
+#else
+  int link_unnamed() { return EINVAL; }
+#endif
+
+  int fd_ = -1;
+  int error_ = 0;
+  std::string path_;
+  std::string tmp_;  ///< Named temporary file of an atomic writer
+  WriteOptions options_;
+  bool unnamed_ = false;  ///< Writing an O_TMPFILE file
+  std::unique_ptr<char[]> own_;
+  char *buf_ = nullptr;
+  std::size_t used_ = 0;
+};
+
+/**
+ * @brief Write a whole buffer to a file, see FileWriter.
+ *
+ * @param path The file to create or replace.
+ * @param data The contents.
+ * @param size Number of bytes.
+ * @param options Atomic replacement and durability.
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int write_file(const std::string &path, const void *data,
+                      std::size_t size,
+                      const WriteOptions &options = WriteOptions()) {
+  FileWriter writer(path, options);
+  if (!writer.is_open()) {
+    return writer.error();
+  }
+  // 整块数据直接写入，不经过缓冲区
+  int error = write_fd(writer.fd(), data, size);
+  return error != 0 ? error : writer.commit();
+}
+
+/// write_file() of a std::string or std::vector<char>.
+template <typename Buffer>
+inline int write_file(const std::string &path, const Buffer &data,
+                      const WriteOptions &options = WriteOptions()) {
+  return write_file(path, data.data(), data.size() * sizeof(*data.data()),
+                    options);
+}
+
+/**
+ * @brief Replace a file atomically: readers and a crash leave either the
+ * old or the new contents. See FileWriter.
+ *
+ * @param sync Also make the new contents durable before returning.
+ * @return 0 on success, otherwise an errno value.
+ */
+template <typename Buffer>
+inline int write_file_atomic(const std::string &path, const Buffer &data,
+                             bool sync = true) {
+  WriteOptions options;
+  options.atomic = true;
+  options.sync = sync;
+  return write_file(path, data, options);
+}
+
+/// How WriteBatch::commit() makes a batch durable.
+enum class SyncMethod {
+  /// fdatasync() every file in parallel, then fsync() every directory
+  /// once. Only the batch's own data is flushed.
+  Fdatasync,
+  /// One syncfs() per file system before and after the renames. Fewest
+  /// system calls, but flushes every dirty page of the file system.
+  Syncfs,
+};
+
+/// Options for WriteBatch.
+struct WriteBatchOptions {
+  /// Replace files atomically, see WriteOptions::atomic.
+  bool atomic = true;
+  SyncMethod method = SyncMethod::Fdatasync;
+  /// Files held open before write() commits the batch by itself.
+  std::size_t max_pending = 256;
+  /// Threads for the fdatasync() round, 0 means one per hardware thread.
+  std::size_t num_threads = 0;
+  mode_t mode = 0644;
+};
+
+/**
+ * @brief Write many files and make them durable together (group commit).
+ *
+ * Each write() writes a file without syncing it. commit() then flushes the
+ * whole batch in one round (see SyncMethod), moves atomic files into place
+ * and syncs each affected directory once, instead of paying an fsync() of
+ * the file and of its directory for every file. After commit() returns 0,
+ * every file written since the previous commit is durable; until then a
+ * crash leaves atomic targets with their old contents.
+ *
+ * The destructor commits what is pending. Not thread-safe.
+ */
+class WriteBatch {
+ public:
+  explicit WriteBatch(const WriteBatchOptions &options = WriteBatchOptions())
+      : options_(options) {}
+
+  WriteBatch(const WriteBatch &) = delete;
+  WriteBatch &operator=(const WriteBatch &) = delete;
+
+  ~WriteBatch() { commit(); }
+
+  /**
+   * @brief Write a file as part of the batch.
+   *
+   * @return 0 on success, otherwise an errno value (including one from an
+   * automatic commit()).
+   */
+  int write(const std::string &path, const void *data, std::size_t size) {
+    WriteOptions options;
+    options.atomic = options_.atomic;
+    options.mode = options_.mode;
+    FileWriter writer(path, options);
+    if (!writer.is_open()) {
+      return writer.error();
+    }
+    // 数据直接写入文件，不经过 FileWriter 的缓冲区
+    int error = write_fd(writer.fd(), data, size);
+    if (error != 0) {
+      return error;
+    }
+    pending_.push_back(std::move(writer));
+    if (options_.max_pending > 0 && pending_.size() >= options_.max_pending) {
+      return commit();
+    }
+    return 0;
+  }
+
+  template <typename Buffer>
+  int write(const std::string &path, const Buffer &data) {
+    return write(path, data.data(), data.size() * sizeof(*data.data()));
+  }
+
+  /// Files written but not yet committed.
+  std::size_t pending() const { return pending_.size(); }
+
+  /**
+   * @brief Make every pending file durable and move it into place.
+   *
+   * @return 0 on success, otherwise the first errno value; files that
+   * failed are discarded, the others are still committed.
+   */
+  int commit() {
+    if (pending_.empty()) {
+      return 0;
+    }
+    std::atomic<int> first_error{0};
+    auto fail = [&](int error) {
+      int expected = 0;
+      if (error != 0) {
+        first_error.compare_exchange_strong(expected, error);
+      }
+    };
+    std::vector<char> ok(pending_.size(), 1);
+
+    if (options_.method == SyncMethod::Syncfs) {
+      sync_filesystems(fail);
+    } else {
+      if (!pool_ && options_.num_threads != 1 && pending_.size() > 1) {
+        pool_.reset(new WorkStealingPool(options_.num_threads));
+      }
+      for (std::size_t i = 0; i < pending_.size(); ++i) {
+        auto task = [this, i, &ok, &fail] {
+          if (fdatasync(pending_[i].fd()) != 0) {
+            ok[i] = 0;
+            fail(errno);
+          }
+        };
+        if (pool_) {
+          pool_->submit(task);
+        } else {
+          task();
+        }
+      }
+      if (pool_) {
+        pool_->wait();
+      }
+    }
+
+    std::set<std::string> dirs;
+    for (std::size_t i = 0; i < pending_.size(); ++i) {
+      if (ok[i]) {
+        int error = pending_[i].commit();
+        fail(error);
+        if (error == 0) {
+          dirs.insert(dirname(pending_[i].path()));
+        }
+      }
+    }
+    if (options_.method == SyncMethod::Syncfs) {
+      sync_filesystems(dirs, fail);
+    } else {
+      for (const auto &dir : dirs) {
+        fail(sync_dir(dir));
+      }
+    }
+    pending_.clear();  // 未提交的失败文件在析构时丢弃
+    return first_error;
+  }
+
+ private:
+  static int sync_filesystem(int fd) {
+#ifdef __linux__
+    return syncfs(fd) == 0 ? 0 : errno;
+#else
+    (void)fd;
+    sync();
+    return 0;
+#endif
+  }
+
+  /// syncfs() once per device holding a pending file.
+  template <typename Fail>
+  void sync_filesystems(Fail &fail) {
+    std::set<dev_t> devices;
+    for (const auto &writer : pending_) {
+      struct stat st;
+      if (fstat(writer.fd(), &st) != 0) {
+        fail(errno);
+      } else if (devices.insert(st.st_dev).second) {
+        fail(sync_filesystem(writer.fd()));
+      }
+    }
+  }
+
+  /// syncfs() once per device holding one of dirs.
+  template <typename Fail>
+  void sync_filesystems(const std::set<std::string> &dirs, Fail &fail) {
+    std::set<dev_t> devices;
+    for (const auto &dir : dirs) {
+      int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) {
+        fail(errno);
+        continue;
+      }
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        fail(errno);
+      } else if (devices.insert(st.st_dev).second) {
+        fail(sync_filesystem(fd));
+      }
+      ::close(fd);
+    }
+  }
+
+  WriteBatchOptions options_;
+  std::vector<FileWriter> pending_;
+  std::unique_ptr<WorkStealingPool> pool_;
+};
+#endif
+
+#if CPP_UTILS_HAS_IO_URING
+/**
+ * @brief A minimal io_uring instance driven through the raw system calls.
+ *
+ * Only what the batch reader needs: get_sqe() hands out a zeroed submission
+ * entry, submit() passes the queued entries to the kernel and optionally
+ * waits for completions, and peek_cqe()/pop_cqe() drain the completion
+ * queue.
+ */
+class IoUring {
+ public:
+  /**
+   * @brief Create a ring with the given number of submission entries.
+   * Check is_open() (and error()) afterwards.
+   */
+  explicit IoUring(unsigned entries) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0) {
+      error_ = errno;
+      return;
+    }
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes +
+               params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      fail();
+      return;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ptr_ == MAP_FAILED) {
+        fail();
+        return;
+      }
+    }
+    sqe_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe *>(
+        mmap(nullptr, sqe_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+      sqes_ = nullptr;
+      fail();
+      return;
+    }
+    char *sq = static_cast<char *>(sq_ptr_);
+    char *cq = static_cast<char *>(cq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+    sq_entries_ = params.sq_entries;
+  }
+
+  ~IoUring() { fail(); }
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  bool is_open() const { return fd_ >= 0; }
+  int error() const { return error_; }
+
+  /// Whether the kernel implements every opcode in ops.
+  bool supports(std::initializer_list<int> ops) const {
+    const unsigned count = 256;
+    std::vector<char> buffer(sizeof(struct io_uring_probe) +
+                             count * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe =
+        reinterpret_cast<struct io_uring_probe *>(buffer.data());
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+                count) < 0) {
+      return false;
+    }
+    for (int op : ops) {
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /// Next free submission entry, zeroed, or nullptr if the queue is full.
+  struct io_uring_sqe *get_sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (local_tail_ - head >= sq_entries_) {
+      return nullptr;
+    }
+    unsigned index = local_tail_ & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++local_tail_;
+    return sqe;
+  }
+
+  /**
+   * @brief Submit the queued entries and wait for at least wait_nr
+   * completions.
+   *
+   * @return 0 on success, otherwise an errno value.
+   */
+  int submit(unsigned wait_nr) {
+    unsigned to_submit = local_tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr, flags,
+                   nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        return errno;
+      }
+      to_submit = 0;
+    }
+    return 0;
+  }
+
+  /// Oldest unconsumed completion, or nullptr if there is none.
+  struct io_uring_cqe *peek_cqe() {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      return nullptr;
+    }
+    return &cqes_[head & cq_mask_];
+  }
+
+  /// Mark the completion returned by peek_cqe() as consumed.
+  void pop_cqe() { __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE); }
+
+ private:
+  void fail() {
+    if (fd_ >= 0 && error_ == 0) {
+      error_ = errno;
+    }
+    if (sqes_ != nullptr) {
+      munmap(sqes_, sqe_size_);
+      sqes_ = nullptr;
+    }
+    if (cq_ptr_ != nullptr && cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+      munmap(cq_ptr_, cq_size_);
+    }
+    if (sq_ptr_ != nullptr && sq_ptr_ != MAP_FAILED) {
+      munmap(sq_ptr_, sq_size_);
+    }
+    cq_ptr_ = sq_ptr_ = nullptr;
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  int fd_ = -1;
+  int error_ = 0;
+  void *sq_ptr_ = nullptr;
+  void *cq_ptr_ = nullptr;
+  std::size_t sq_size_ = 0;
+  std::size_t cq_size_ = 0;
+  std::size_t sqe_size_ = 0;
+  struct io_uring_sqe *sqes_ = nullptr;
+  struct io_uring_cqe *cqes_ = nullptr;
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned cq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned local_tail_ = 0;
+};
+#endif
+
+/**
+ * @brief Called by read_files_batch() once per path.
+ *
+ * @param index Index of the path in the input list.
+ * @param error 0 on success, otherwise an errno value.
+ * @param data The file contents. The buffer is reused for later files once
+ * the callback returns, so move or swap it out to keep it.
+ */
+using BatchReadCallback =
+    std::function<void(std::size_t index, int error, std::string &data)>;
+
+/// Options for read_files_batch().
+struct BatchReadOptions {
+  /// Maximum number of files being read at the same time.
+  unsigned queue_depth = 64;
+  /// Worker threads of the blocking fallback, 0 means one per hardware
+  /// thread.
+  std::size_t num_threads = 0;
+  /// Use io_uring when the kernel supports it; false forces the fallback.
+  bool use_io_uring = true;
+};
+
+#if CPP_UTILS_HAS_IO_URING
+/**
+ * @brief io_uring engine of read_files_batch().
+ *
+ * @return -1 without reading anything if io_uring or one of the needed
+ * opcodes is unavailable, otherwise 0 or the errno of a failed
+ * io_uring_enter().
+ */
+inline int read_files_io_uring(const std::vector<std::string> &paths,
+                               const BatchReadCallback &cb, unsigned depth) {
+  enum Op : uint64_t { OpOpen, OpStatx, OpRead, OpClose };
+  struct Slot {
+    std::size_t index;
+    int fd = -1;
+    int error;
+    int pending;
+    bool size_known;
+    std::size_t got;
+    struct statx stx;
+    std::string path;
+    std::string data;
+  };
+
+  // 每个文件同时最多有 open 和 statx 两个请求在排队
+  IoUring ring(depth * 2);
+  if (!ring.is_open() ||
+      !ring.supports({IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                      IORING_OP_CLOSE})) {
+    return -1;
+  }
+
+  std::vector<Slot> slots(depth);
+  std::vector<unsigned> free_slots;
+  for (unsigned i = depth; i > 0; --i) {
+    free_slots.push_back(i - 1);
+  }
+  std::size_t active = 0;
+  // 已入队但尚未收到完成事件的请求数，以及使环无法继续使用的错误
+  std::size_t inflight = 0;
+  int ring_error = 0;
+
+  auto get_sqe = [&](unsigned id, Op op) -> struct io_uring_sqe * {
+    struct io_uring_sqe *sqe;
+    while ((sqe = ring.get_sqe()) == nullptr) {
+      // 提交队列已满，先交给内核；提交失败时重试只会空转
+      int error = ring.submit(0);
+      if (error != 0) {
+        ring_error = error;
+        return nullptr;
+      }
+    }
+    sqe->user_data = (static_cast<uint64_t>(id) << 8) | op;
+    ++inflight;
+    return sqe;
+  };
+  auto release = [&](unsigned id) {
+    free_slots.push_back(id);
+    --active;
+  };
+  auto queue_read = [&](unsigned id) {
+    Slot &slot = slots[id];
+    if (slot.got == slot.data.size()) {
+      slot.data.resize(slot.data.size() * 2);
+    }
+    struct io_uring_sqe *sqe = get_sqe(id, OpRead);
+    if (sqe == nullptr) {
+      return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.data[slot.got]);
+    sqe->len = static_cast<unsigned>(
+        std::min<std::size_t>(slot.data.size() - slot.got, 1u << 30));
+    sqe->off = slot.got;
+  };
+  auto finish = [&](unsigned id) {
+    Slot &slot = slots[id];
+    if (slot.error == 0) {
+      slot.data.resize(slot.got);
+    } else {
+      slot.data.clear();
+    }
+    cb(slot.index, slot.error, slot.data);
+    if (slot.fd < 0) {
+      release(id);
+      return;
+    }
+    struct io_uring_sqe *sqe = get_sqe(id, OpClose);
+    if (sqe == nullptr) {
+      return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = slot.fd;
+  };
+
+  // 出错时先等所有已提交的请求完成：在此之前内核仍可能写入 slots 中的
+  // 缓冲区，或读取其中的路径
+  auto drain_and_fail = [&](int error) {
+    for (;;) {
+      bool progress = false;
+      struct io_uring_cqe *cqe;
+      while ((cqe = ring.peek_cqe()) != nullptr) {
+        Slot &slot = slots[cqe->user_data >> 8];
+        Op op = static_cast<Op>(cqe->user_data & 0xff);
+        if (op == OpOpen && cqe->res >= 0) {
+          slot.fd = cqe->res;
+        } else if (op == OpClose) {
+          slot.fd = -1;
+        }
+        ring.pop_cqe();
+        --inflight;
+        progress = true;
+      }
+      if (inflight == 0) {
+        break;
+      }
+      if (ring.submit(1) != 0 && !progress) {
+        // 无法再等待完成事件，只能让这些缓冲区保留到进程结束
+        static_cast<void>(new std::vector<Slot>(std::move(slots)));
+        return error;
+      }
+    }
+    for (const auto &slot : slots) {
+      if (slot.fd >= 0) {
+        ::close(slot.fd);
+      }
+    }
+    return error;
+  };
+
+  std::size_t next = 0;
+  while (next < paths.size() || active > 0) {
+    while (next < paths.size() && !free_slots.empty() && ring_error == 0) {
+      unsigned id = free_slots.back();
+      free_slots.pop_back();
+      ++active;
+      Slot &slot = slots[id];
+      slot.index = next;
+      slot.fd = -1;
+      slot.error = 0;
+      slot.pending = 2;
+      slot.got = 0;
+      // 请求引用的路径放在 slot 中，出错返回后也不会指向调用者的内存
+      slot.path = paths[next++];
+      const char *path = slot.path.c_str();
+
+      struct io_uring_sqe *sqe = get_sqe(id, OpOpen);
+      if (sqe == nullptr) {
+        break;
+      }
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = reinterpret_cast<uint64_t>(path);
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+      sqe = get_sqe(id, OpStatx);
+      if (sqe == nullptr) {
+        break;
+      }
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = reinterpret_cast<uint64_t>(path);
+      sqe->len = STATX_TYPE | STATX_SIZE;
+      sqe->off = reinterpret_cast<uint64_t>(&slot.stx);
+    }
+
+    int error = ring_error != 0 ? ring_error : ring.submit(1);
+    if (error != 0) {
+      return drain_and_fail(error);
+    }
+
+    struct io_uring_cqe *cqe;
+    while (ring_error == 0 && (cqe = ring.peek_cqe()) != nullptr) {
+      unsigned id = static_cast<unsigned>(cqe->user_data >> 8);
+      Op op = static_cast<Op>(cqe->user_data & 0xff);
+      int res = cqe->res;
+      ring.pop_cqe();
+      --inflight;
+      Slot &slot = slots[id];
+
+      switch (op) {
+        case OpOpen:
+        case OpStatx:
+          if (res < 0) {
+            if (slot.error == 0) {
+              slot.error = -res;
+            }
+          } else if (op == OpOpen) {
+            slot.fd = res;
+          }
+          if (--slot.pending > 0) {
+            break;
+          }
+          if (slot.error == 0 && S_ISDIR(slot.stx.stx_mode)) {
+            slot.error = EISDIR;
+          }
+          if (slot.error != 0) {
+            finish(id);
+            break;
+          }
+          slot.size_known = slot.stx.stx_size > 0;
+          slot.data.resize(slot.size_known
+                               ? static_cast<std::size_t>(slot.stx.stx_size)
+                               : 64 * 1024);
+          queue_read(id);
+          break;
+        case OpRead:
+          if (res == -EINTR || res == -EAGAIN) {
+            queue_read(id);
+          } else if (res < 0) {
+            slot.error = -res;
+            finish(id);
+          } else {
+            slot.got += static_cast<std::size_t>(res);
+            if (res == 0 ||
+                (slot.size_known && slot.got == slot.data.size())) {
+              finish(id);
+            } else {
+              queue_read(id);
+            }
+          }
+          break;
+        case OpClose:
+          slot.fd = -1;
+          release(id);
+          break;
+      }
+    }
+  }
+  if (ring_error != 0) {
+    return drain_and_fail(ring_error);
+  }
+  return 0;
+}
+#endif
+
+/**
+ * @brief Read many files, keeping up to queue_depth of them in flight.
+ *
+ * On Linux with io_uring the open, statx, read and close of every file are
+ * submitted as asynchronous requests on one ring, so a single thread keeps
+ * the device queue full and the callback runs on the calling thread. When
+ * io_uring is unavailable (old kernel, seccomp, or use_io_uring = false)
+ * the files are read with blocking read_file_into() calls on a
+ * WorkStealingPool, and the callback runs on the worker threads,
+ * concurrently for different files.
+ *
+ * Files are delivered in completion order, not in the order of paths.
+ *
+ * @param paths The files to read.
+ * @param cb Called once per path with its contents or an errno value.
+ * @param options Queue depth and fallback settings.
+ * @return 0, or the errno value if the io_uring instance failed; files
+ * whose callback has not run by then were not read.
+ */
+inline int read_files_batch(const std::vector<std::string> &paths,
+                            const BatchReadCallback &cb,
+                            const BatchReadOptions &options =
+                                BatchReadOptions()) {
+  unsigned depth = std::max(options.queue_depth, 1u);
+#if CPP_UTILS_HAS_IO_URING
+  if (options.use_io_uring) {
+    int error = read_files_io_uring(paths, cb, depth);
+    if (error >= 0) {
+      return error;
+    }
+  }
+#endif
+  std::size_t num_threads = options.num_threads;
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  WorkStealingPool pool(std::min<std::size_t>(num_threads, depth));
+  std::vector<std::string> buffers(pool.size());
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    pool.submit([&, i] {
+      std::string &buffer = buffers[pool.worker_index()];
+      int error = read_file_into(paths[i], buffer);
+      cb(i, error, buffer);
+    });
+  }
+  pool.wait();
+  return 0;
+}
+
+/// Options for walk_and_read().
+struct PrefetchOptions {
+  /// Number of files ahead of the consumer that are opened and hinted.
+  std::size_t lookahead = 16;
+  /// Upper bound on the bytes hinted but not yet consumed. A single file
+  /// larger than the budget is still read, but on its own and without a
+  /// POSIX_FADV_WILLNEED hint.
+  std::size_t memory_budget = 64 * 1024 * 1024;
+  /// Number of paths the walker thread may queue ahead of the prefetcher.
+  std::size_t queue_capacity = 4096;
+};
+
+/**
+ * @brief Walk a directory tree and read every file, overlapping directory
+ * scanning, readahead and consumption.
+ *
+ * A background thread walks the tree with walk_tree() and queues the file
+ * paths. While the callback processes file i, the next files (up to
+ * lookahead of them and memory_budget bytes) are already open and have
+ * been announced to the kernel with posix_fadvise(POSIX_FADV_WILLNEED), so
+ * their data is being read from disk (or the network) in the background.
+ *
+ * Files are delivered in walk order on the calling thread. An exception
+ * thrown by the callback stops the walker and is propagated.
+ *
+ * @param root The directory to walk.
+ * @param cb Called for every file with its path, 0 or an errno value, and
+ * its contents. The buffer is reused for the next file.
+ * @param options Lookahead and memory limits.
+ */
+inline void walk_and_read(
+    const std::string &root,
+    const std::function<void(const std::string &path, int error,
+                             std::string &data)> &cb,
+    const PrefetchOptions &options = PrefetchOptions()) {
+  struct Pending {
+    std::string path;
+    int fd;
+    int error;
+    std::size_t size;
+  };
+
+  BoundedQueue<std::string> paths(options.queue_capacity);
+  std::atomic<bool> stop{false};
+  std::thread walker([&] {
+    walk_tree(root, [&](const WalkEntry &entry) -> WalkAction {
+      if (stop) {
+        return WalkAction::Stop;
+      }
+      if (!entry.is_dir() && !paths.push(entry.path())) {
+        return WalkAction::Stop;
+      }
+      return WalkAction::Continue;
+    });
+    paths.close();
+  });
+
+  std::deque<Pending> window;
+  std::size_t window_bytes = 0;
+  bool walk_done = false;
+  // 已打开但因内存预算暂未提示内核的文件
+  bool held = false;
+  Pending next;
+
+  // 窗口为空时等待遍历线程，否则只取已经排队的路径，不阻塞当前文件的处理
+  auto open_next = [&](bool block) -> bool {
+    std::string path;
+    if (!(block ? paths.pop(path) : paths.try_pop(path))) {
+      if (block || paths.done()) {
+        walk_done = true;
+      }
+      return false;
+    }
+    next.path = std::move(path);
+    next.size = 0;
+    next.error = 0;
+    next.fd = open(next.path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (next.fd < 0) {
+      next.error = errno;
+    } else if (fstat(next.fd, &st) == 0) {
+      next.size = static_cast<std::size_t>(st.st_size);
+    }
+    return true;
+  };
+
+  auto fill_window = [&](bool may_block) {
+    while (window.size() < std::max<std::size_t>(options.lookahead, 1)) {
+      if (!held) {
+        if (walk_done || !open_next(may_block && window.empty())) {
+          return;
+        }
+        held = true;
+      }
+      if (!window.empty() &&
+          window_bytes + next.size > options.memory_budget) {
+        return;
+      }
+      // 超出预算的文件不提示，避免一次性把整个文件拉进页缓存
+      if (next.fd >= 0 && next.size <= options.memory_budget) {
+        posix_fadvise(next.fd, 0, 0, POSIX_FADV_WILLNEED);
+      }
+      window_bytes += next.size;
+      window.push_back(std::move(next));
+      held = false;
+    }
+  };
+
+  auto cleanup = [&] {
+    stop = true;
+    paths.close();
+    walker.join();
+    for (const auto &pending : window) {
+      if (pending.fd >= 0) {
+        close(pending.fd);
+      }
+    }
+    if (held && next.fd >= 0) {
+      close(next.fd);
+    }
+  };
+
+  std::string buffer;
+  try {
+    for (;;) {
+      fill_window(true);
+      if (window.empty()) {
+        break;
+      }
+      Pending current = std::move(window.front());
+      window.pop_front();
+      window_bytes -= current.size;
+      // 先补充窗口，使内核在回调处理当前文件时继续预读后面的文件
+      fill_window(false);
+
+      int error = current.error;
+      if (current.fd >= 0) {
+        error = read_fd(current.fd, buffer);
+        close(current.fd);
+      } else {
+        buffer.clear();
+      }
+      cb(current.path, error, buffer);
+    }
+  } catch (...) {
+    cleanup();
+    throw;
+  }
+  cleanup();
+}
+
+/**
+ * @brief Streaming XXH64, a fast non-cryptographic 64-bit hash.
+ *
+ * The output is identical to the reference xxHash XXH64. Input is consumed
+ * in 32-byte stripes by four independent multiply-rotate lanes, which keeps
+ * the hash at memory bandwidth on any 64-bit CPU without needing a vector
+ * instruction set.
+ */
+class Xxh64 {
+ public:
+  explicit Xxh64(uint64_t seed = 0) { reset(seed); }
+
+  void reset(uint64_t seed = 0) {
+    seed_ = seed;
+    lanes_[0] = seed + prime1 + prime2;
+    lanes_[1] = seed + prime2;
+    lanes_[2] = seed;
+    lanes_[3] = seed - prime1;
+    total_ = 0;
+    buffered_ = 0;
+  }
+
+  void update(const void *data, std::size_t size) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    total_ += size;
+    if (buffered_ + size < 32) {
+      std::memcpy(buffer_ + buffered_, p, size);
+      buffered_ += size;
+      return;
+    }
+    if (buffered_ > 0) {
+      std::size_t fill = 32 - buffered_;
+      std::memcpy(buffer_ + buffered_, p, fill);
+      stripe(buffer_);
+      p += fill;
+      size -= fill;
+      buffered_ = 0;
+    }
+    for (; size >= 32; p += 32, size -= 32) {
+      stripe(p);
+    }
+    std::memcpy(buffer_, p, size);
+    buffered_ = size;
+  }
+
+  uint64_t digest() const {
+    uint64_t h;
+    if (total_ >= 32) {
+      h = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) +
+          rotl(lanes_[3], 18);
+      for (uint64_t lane : lanes_) {
+        h ^= round(0, lane);
+        h = h * prime1 + prime4;
+      }
+    } else {
+      h = seed_ + prime5;
+    }
+    h += total_;
+
+    const unsigned char *p = buffer_;
+    std::size_t size = buffered_;
+    for (; size >= 8; p += 8, size -= 8) {
+      h ^= round(0, read64(p));
+      h = rotl(h, 27) * prime1 + prime4;
+    }
+    if (size >= 4) {
+      h ^= static_cast<uint64_t>(read32(p)) * prime1;
+      h = rotl(h, 23) * prime2 + prime3;
+      p += 4;
+      size -= 4;
+    }
+    for (; size > 0; ++p, --size) {
+      h ^= *p * prime5;
+      h = rotl(h, 11) * prime1;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+ private:
+  static constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+  static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+  static constexpr uint64_t prime3 = 0x165667B19E3779F9ull;
+  static constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+  static constexpr uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * prime2;
+    return rotl(acc, 31) * prime1;
+  }
+
+  static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+  }
+
+  static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+  }
+
+  void stripe(const unsigned char *p) {
+    lanes_[0] = round(lanes_[0], read64(p));
+    lanes_[1] = round(lanes_[1], read64(p + 8));
+    lanes_[2] = round(lanes_[2], read64(p + 16));
+    lanes_[3] = round(lanes_[3], read64(p + 24));
+  }
+
+  uint64_t seed_;
+  uint64_t lanes_[4];
+  uint64_t total_;
+  unsigned char buffer_[32];
+  std::size_t buffered_;
+};
+
+/// XXH64 of a buffer, see Xxh64.
+inline uint64_t xxh64(const void *data, std::size_t size, uint64_t seed = 0) {
+  Xxh64 hasher(seed);
+  hasher.update(data, size);
+  return hasher.digest();
+}
+
+#ifndef _WIN32
+/**
+ * @brief Hash part of an open file with XXH64, reading it with large
+ * pread() calls into a caller-supplied buffer.
+ *
+ * @param fd The file.
+ * @param offset Where to start.
+ * @param size Number of bytes to hash; hashing stops early at EOF.
+ * @param buffer Scratch buffer, grown to 1 MiB if smaller.
+ * @param hasher Receives the bytes.
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int hash_fd_range(int fd, uint64_t offset, uint64_t size,
+                         std::vector<char> &buffer, Xxh64 &hasher) {
+  if (buffer.size() < 1024 * 1024) {
+    buffer.resize(1024 * 1024);
+  }
+  while (size > 0) {
+    std::size_t want =
+        static_cast<std::size_t>(std::min<uint64_t>(size, buffer.size()));
+    ssize_t n = pread(fd, buffer.data(), want, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (n == 0) {
+      break;
+    }
+    hasher.update(buffer.data(), static_cast<std::size_t>(n));
+    offset += static_cast<uint64_t>(n);
+    size -= static_cast<uint64_t>(n);
+  }
+  return 0;
+}
+
+/**
+ * @brief XXH64 of a whole file.
+ *
+ * @param path The file.
+ * @param hash Receives the hash.
+ * @return 0 on success, otherwise an errno value.
+ */
+inline int hash_file(const std::string &path, uint64_t &hash) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  std::vector<char> buffer;
+  Xxh64 hasher;
+  int error = hash_fd_range(fd, 0, UINT64_MAX, buffer, hasher);
+  close(fd);
+  hash = hasher.digest();
+  return error;
+}
+
+/// Files with identical contents, found by find_duplicates().
+struct DuplicateGroup {
+  uint64_t size = 0;  ///< Size of each file
+  uint64_t hash = 0;  ///< XXH64 of the contents
+  std::vector<std::string> paths;
+};
+
+/// Options for find_duplicates().
+struct DuplicateOptions {
+  /// Worker threads, 0 means one per hardware thread.
+  std::size_t num_threads = 0;
+  /// Files smaller than this are ignored; empty files are all alike.
+  uint64_t min_size = 1;
+  /// Bytes hashed at each end of a file in the first pass, 0 to hash
+  /// whole files straight away. Files no larger than twice this are hashed
+  /// completely in the first pass.
+  std::size_t partial_size = 64 * 1024;
+};
+
+/// What find_duplicates() found and how much it had to read.
+struct DuplicateReport {
+  /// Groups of two or more files, largest files first.
+  std::vector<DuplicateGroup> groups;
+  uint64_t files = 0;         ///< Regular files seen
+  uint64_t size_matches = 0;  ///< Files sharing their size with another
+  uint64_t full_hashed = 0;   ///< Files read completely
+  uint64_t bytes_read = 0;
+  uint64_t failed = 0;  ///< Entries that could not be examined or read
+};
+
+/**
+ * @brief Find files with identical contents below a directory.
+ *
+ * The tree is walked with walk_stat_parallel(), so every size comes from
+ * statx() and most files are never opened. Only files that share their
+ * size with another one are considered. Those are first hashed over their
+ * first and last partial_size bytes, and only files that still collide
+ * are hashed completely. Hashing runs on a WorkStealingPool with large
+ * pread() calls and XXH64. Hard links to one inode are counted as one file.
+ *
+ * Files are grouped by size and 64-bit hash without a byte-wise
+ * comparison; with n candidates of one size the chance of a false match is
+ * about n^2 / 2^65.
+ *
+ * @param root The directory to search.
+ * @param options Threads and hashing passes.
+ * @return The duplicate groups and counters.
+ */
+inline DuplicateReport find_duplicates(
+    const std::string &root,
+    const DuplicateOptions &options = DuplicateOptions()) {
+  struct Candidate {
+    std::string path;
+    uint64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t hash;
+    bool complete;  ///< hash covers the whole file
+    bool failed;
+  };
+
+  DuplicateReport report;
+  WorkStealingPool pool(options.num_threads);
+  std::vector<std::vector<Candidate>> found(pool.size() + 1);
+  std::atomic<uint64_t> failed{0};
+  walk_stat_parallel(
+      pool, root,
+      [&](std::size_t worker, const std::string &dir, const char *name,
+          const EntryStat &st) {
+        if (st.type == DT_REG && st.size >= options.min_size) {
+          found[worker].push_back({dir + path_separator + name, st.size,
+                                   st.dev, st.ino, 0, false, false});
+        }
+      },
+      [&](std::size_t, int) { ++failed; });
+
+  std::vector<Candidate> files;
+  for (auto &part : found) {
+    std::move(part.begin(), part.end(), std::back_inserter(files));
+    std::vector<Candidate>().swap(part);
+  }
+  report.files = files.size();
+
+  // 按大小（及 inode）排序，去掉同一 inode 的其他硬链接和大小唯一的文件
+  std::sort(files.begin(), files.end(),
+            [](const Candidate &a, const Candidate &b) {
+              return std::tie(a.size, a.dev, a.ino, a.path) <
+                     std::tie(b.size, b.dev, b.ino, b.path);
+            });
+  auto keep_groups = [&](std::vector<Candidate> &items,
+                         const std::function<bool(const Candidate &,
+                                                  const Candidate &)> &same) {
+    std::vector<Candidate> kept;
+    std::size_t begin = 0;
+    while (begin < items.size()) {
+      std::size_t end = begin + 1;
+      while (end < items.size() && same(items[begin], items[end])) {
+        ++end;
+      }
+      if (end - begin > 1) {
+        std::move(items.begin() + begin, items.begin() + end,
+                  std::back_inserter(kept));
+      }
+      begin = end;
+    }
+    items.swap(kept);
+  };
+  files.erase(std::unique(files.begin(), files.end(),
+                          [](const Candidate &a, const Candidate &b) {
+                            return a.dev == b.dev && a.ino == b.ino;
+                          }),
+              files.end());
+  keep_groups(files, [](const Candidate &a, const Candidate &b) {
+    return a.size == b.size;
+  });
+  report.size_matches = files.size();
+
+  std::vector<std::vector<char>> buffers(pool.size() + 1);
+  std::atomic<uint64_t> bytes_read{0};
+  std::atomic<uint64_t> full_hashed{0};
+  // 对每个候选计算哈希；partial 为 0 时读取整个文件
+  auto hash_all = [&](std::size_t partial) {
+    for (auto &file : files) {
+      if (file.complete) {
+        continue;
+      }
+      Candidate *target = &file;
+      pool.submit([&, target, partial] {
+        Candidate &c = *target;
+        std::vector<char> &buffer = buffers[pool.worker_index()];
+        int fd = open(c.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+          c.failed = true;
+          return;
+        }
+        Xxh64 hasher;
+        int error;
+        if (partial == 0 || c.size <= 2 * static_cast<uint64_t>(partial)) {
+          if (c.size > buffer.size()) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+          }
+          error = hash_fd_range(fd, 0, c.size, buffer, hasher);
+          c.complete = true;
+          bytes_read += c.size;
+          ++full_hashed;
+        } else {
+          error = hash_fd_range(fd, 0, partial, buffer, hasher);
+          if (error == 0) {
+            error = hash_fd_range(fd, c.size - partial, partial, buffer,
+                                  hasher);
+          }
+          bytes_read += 2 * partial;
+        }
+        close(fd);
+        c.hash = hasher.digest();
+        c.failed = error != 0;
+      });
+    }
+    pool.wait();
+    std::size_t before = files.size();
+    files.erase(std::remove_if(files.begin(), files.end(),
+                               [](const Candidate &c) { return c.failed; }),
+                files.end());
+    failed += before - files.size();
+    // 部分哈希和完整哈希不可比较，complete 也作为分组键
+    std::sort(files.begin(), files.end(),
+              [](const Candidate &a, const Candidate &b) {
+                return std::tie(a.size, a.complete, a.hash, a.path) <
+                       std::tie(b.size, b.complete, b.hash, b.path);
+              });
+    keep_groups(files, [](const Candidate &a, const Candidate &b) {
+      return a.size == b.size && a.complete == b.complete && a.hash == b.hash;
+    });
+  };
+
+  if (options.partial_size > 0) {
+    hash_all(options.partial_size);
+  }
+  hash_all(0);
+
+  std::size_t begin = 0;
+  while (begin < files.size()) {
+    DuplicateGroup group;
+    group.size = files[begin].size;
+    group.hash = files[begin].hash;
+    std::size_t end = begin;
+    for (; end < files.size() && files[end].size == group.size &&
+           files[end].hash == group.hash;
+         ++end) {
+      group.paths.push_back(std::move(files[end].path));
+    }
+    report.groups.push_back(std::move(group));
+    begin = end;
+  }
+  std::reverse(report.groups.begin(), report.groups.end());
+  report.full_hashed = full_hashed;
+  report.bytes_read = bytes_read;
+  report.failed = failed;
+  return report;
+}
+#endif
+
+/// 读取整个文件内容到string
+inline void read_file_to_string(const std::string &infile,
+                                std::string &outstr) {
+#ifdef _WIN32
+  std::ifstream in(infile, std::ios::in);
+  if (!in.is_open()) {
+    std::cerr << "open file " << infile << " failed!" << std::endl;
+    return;
+  }
+  std::istreambuf_iterator<char> beg(in), end;
+  outstr.assign(beg, end);
+  in.close();
+#else
+  if (read_file_into(infile, outstr) != 0) {
+    std::cerr << "open file " << infile << " failed!" << std::endl;
+  }
+#endif
+}
+
+/// 读取整个文件内容 (说明：由于RVO的存在，此函数性能与 read_file_to_string
+/// 差不多，而且更简洁，因此更推荐)
+inline std::string read_file(const std::string &infile) {
+  std::string s;
+  read_file_to_string(infile, s);
+  return s;  // RVO
+}
+
+#ifndef _WIN32
+/**
+ * @brief A read-only memory mapping of a whole file.
+ *
+ * The file contents can be parsed in place through data()/size() (or
+ * begin()/end()) without copying them into a heap buffer. The mapping is
+ * released when the object is destroyed; the file descriptor is closed as
+ * soon as the mapping exists.
+ *
+ * An empty file opens successfully with data() == nullptr and size() == 0.
  */
-inline std::vector<std::string> list_dir(
-    const std::string &path,
-    const std::function<bool(const std::string &)> &filter) {
-  std::vector<std::string> filenames;
+class MappedFile {
+ public:
+  /// Access pattern hints passed to madvise().
+  enum class Advice {
+    Normal,      ///< MADV_NORMAL
+    Sequential,  ///< MADV_SEQUENTIAL: aggressive readahead, early reclaim
+    Random,      ///< MADV_RANDOM: no readahead
+    WillNeed,    ///< MADV_WILLNEED: start reading the pages now
+    DontNeed,    ///< MADV_DONTNEED: the pages can be dropped
+  };
 
-  struct dirent **namelist;
-  int n = scandir(path.c_str(), &namelist, nullptr, versionsort);
-  if (n >= 0) {
-    for (int i = 0; i < n; ++i) {
-      auto f = namelist[i];
-      if (f->d_type == DT_REG && filter(f->d_name)) {
-        filenames.emplace_back(f->d_name);
+  /// Options for open(), combined with '|'.
+  enum Flags : unsigned {
+    None = 0,
+    /// Fault in the whole file while mapping it (MAP_POPULATE).
+    Populate = 1u << 0,
+    /// Place the mapping on a 2 MiB boundary and ask for transparent huge
+    /// pages. Only takes effect where the kernel and the file system support
+    /// huge pages for file mappings; otherwise it is a no-op.
+    HugePages = 1u << 1,
+  };
+
+  MappedFile() = default;
+
+  /**
+   * @brief Map a file, see open().
+   */
+  explicit MappedFile(const std::string &path, unsigned flags = None) {
+    open(path, flags);
+  }
+
+  ~MappedFile() { close(); }
+
+  MappedFile(MappedFile &&other) { swap(other); }
+
+  MappedFile &operator=(MappedFile &&other) {
+    if (this != &other) {
+      close();
+      swap(other);
+    }
+    return *this;
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  /**
+   * @brief Map a file read-only, replacing any previous mapping.
+   *
+   * @param path The file to map.
+   * @param flags A combination of Flags.
+   * @return true on success; on failure error() holds the errno value.
+   */
+  bool open(const std::string &path, unsigned flags = None) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      error_ = errno;
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      error_ = errno;
+      ::close(fd);
+      return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      error_ = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+      ::close(fd);
+      return false;
+    }
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ > 0) {
+      void *addr = map(fd, flags);
+      if (addr == MAP_FAILED) {
+        error_ = errno;
+        size_ = 0;
+        ::close(fd);
+        return false;
       }
-      free(f);
+      data_ = static_cast<const char *>(addr);
     }
-    free(namelist);
+    ::close(fd);
+    open_ = true;
+    error_ = 0;
+    return true;
   }
 
-  return filenames;
+  /// Unmap the file.
+  void close() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    open_ = false;
+  }
+
+  bool is_open() const { return open_; }
+
+  /// errno of the last failed open(), 0 if none.
+  int error() const { return error_; }
+
+  const char *data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const char *begin() const { return data_; }
+  const char *end() const { return data_ + size_; }
+
+#if __cplusplus >= 201703L
+  std::string_view view() const { return std::string_view(data_, size_); }
+#endif
+
+  /**
+   * @brief Give the kernel a hint about how a range of the file will be
+   * accessed.
+   *
+   * @param advice The expected access pattern.
+   * @param offset Start of the range, rounded down to a page boundary.
+   * @param length Length of the range; 0 means up to the end of the file.
+   * @return true on success.
+   */
+  bool advise(Advice advice, std::size_t offset = 0,
+              std::size_t length = 0) const {
+    if (data_ == nullptr || offset >= size_) {
+      return data_ == nullptr && open_;
+    }
+    static const std::size_t page_size =
+        static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t begin = offset - offset % page_size;
+    std::size_t end =
+        (length == 0 || length > size_ - offset) ? size_ : offset + length;
+    return madvise(const_cast<char *>(data_) + begin, end - begin,
+                   to_madvise(advice)) == 0;
+  }
+
+ private:
+  static int to_madvise(Advice advice) {
+    switch (advice) {
+      case Advice::Sequential:
+        return MADV_SEQUENTIAL;
+      case Advice::Random:
+        return MADV_RANDOM;
+      case Advice::WillNeed:
+        return MADV_WILLNEED;
+      case Advice::DontNeed:
+        return MADV_DONTNEED;
+      default:
+        return MADV_NORMAL;
+    }
+  }
+
+  void *map(int fd, unsigned flags) const {
+    int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (flags & Populate) {
+      map_flags |= MAP_POPULATE;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    const std::size_t huge_page_size = 2 * 1024 * 1024;
+    if ((flags & HugePages) && size_ >= huge_page_size) {
+      // 先预留一段更大的地址空间，再把文件映射到其中 2 MiB 对齐的位置
+      std::size_t reserve_size = size_ + huge_page_size;
+      void *reserved = mmap(nullptr, reserve_size, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (reserved != MAP_FAILED) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(reserved);
+        uintptr_t aligned =
+            (start + huge_page_size - 1) & ~(uintptr_t)(huge_page_size - 1);
+        void *addr = mmap(reinterpret_cast<void *>(aligned), size_, PROT_READ,
+                          map_flags | MAP_FIXED, fd, 0);
+        if (addr == MAP_FAILED) {
+          int saved = errno;
+          munmap(reserved, reserve_size);
+          errno = saved;
+          return MAP_FAILED;
+        }
+        // 文件映射的末尾按页向上取整，剩余的预留空间从那里开始释放
+        static const uintptr_t page_size =
+            static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t tail = (aligned + size_ + page_size - 1) & ~(page_size - 1);
+        uintptr_t reserved_end = start + reserve_size;
+        if ((aligned > start && munmap(reserved, aligned - start) != 0) ||
+            (reserved_end > tail &&
+             munmap(reinterpret_cast<void *>(tail), reserved_end - tail) !=
+                 0)) {
+          int saved = errno;
+          munmap(reserved, reserve_size);
+          errno = saved;
+          return MAP_FAILED;
+        }
+        madvise(addr, size_, MADV_HUGEPAGE);
+        return addr;
+      }
+    }
+#endif
+    return mmap(nullptr, size_, PROT_READ, map_flags, fd, 0);
+  }
+
+  void swap(MappedFile &other) {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(open_, other.open_);
+    std::swap(error_, other.error_);
+  }
+
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+  bool open_ = false;
+  int error_ = 0;
+};
+#endif
+
+// ==============================================================================================
+//                                         目录索引
+// ==============================================================================================
+
+#ifdef __linux__
+/// 去掉路径末尾的分隔符，根目录保持为 "/"
+inline std::string trim_separators(const std::string &path) {
+  std::string::size_type end = path.find_last_not_of(path_separator);
+  if (end == std::string::npos) {
+    return path.empty() ? path : std::string(1, path_separator);
+  }
+  return path.substr(0, end + 1);
 }
 
+/// A file or directory recorded in a DirectoryIndex or TreeSnapshot.
+struct IndexEntry {
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  unsigned char type = DT_UNKNOWN;  ///< DT_* type; symbolic links are DT_LNK
+
+  bool is_dir() const { return type == DT_DIR; }
+
+  bool operator==(const IndexEntry &other) const {
+    return size == other.size && mtime_ns == other.mtime_ns &&
+           type == other.type;
+  }
+  bool operator!=(const IndexEntry &other) const { return !(*this == other); }
+
+  static IndexEntry from_stat(const struct stat &st) {
+    IndexEntry entry;
+    entry.size = static_cast<uint64_t>(st.st_size);
+    entry.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                     st.st_mtim.tv_nsec;
+    entry.type = DirReader::mode_to_dtype(st.st_mode);
+    return entry;
+  }
+};
+
+/// A change seen by a DirectoryIndex.
+struct IndexEvent {
+  enum Kind { Added, Removed, Modified };
+
+  Kind kind;
+  std::string path;
+  IndexEntry entry;  ///< The new state, or the last known one for Removed
+};
+
+/// Receives the changes of a DirectoryIndex, one batch at a time.
+using IndexSubscriber = std::function<void(const std::vector<IndexEvent> &)>;
+
 /**
- * Lists all files in the specified directory that have the specified
- * extensions.
+ * @brief An in-memory index of a directory tree that follows changes live.
  *
- * @param path The path to the directory to list files from.
- * @param exts A vector of file extensions to filter by. If empty, all files
- * will be returned.
- * @return A vector of file paths in the specified directory that have the
- * specified extensions.
+ * The tree is walked once on construction. Afterwards every directory is
+ * watched through inotify and a background thread applies the reported
+ * creations, deletions, renames and modifications to the index, so queries
+ * such as images() are answered from memory without touching the disk.
+ * Events are treated as hints: the affected path is lstat()ed again and a
+ * newly appeared directory is scanned as a whole, which also catches
+ * entries created before its watch was in place.
+ *
+ * When the kernel event queue overflows the whole tree is rescanned and
+ * compared with the index. rescan() does the same for a subtree on demand,
+ * e.g. when the inotify watch limit was hit and part of the tree is not
+ * watched.
+ *
+ * Changes are delivered to subscribers in batches, at most one batch per
+ * batch interval. Within a batch the events of one path are folded
+ * together: a file created and deleted again is not reported at all, a file
+ * deleted and created again is reported as Modified. Subscribers are called
+ * on the background thread and may query the index.
+ *
+ * Paths in the index start with the root as given to the constructor.
+ * Symbolic links are recorded but not followed.
  */
-inline std::vector<std::string> list_dir(
-    const std::string &path, const std::vector<std::string> &exts = {}) {
-  std::vector<std::string> filenames;
+class DirectoryIndex {
+ public:
+  explicit DirectoryIndex(
+      const std::string &root,
+      std::chrono::milliseconds batch_interval = std::chrono::milliseconds(100))
+      : root_(trim_separators(root)), batch_interval_(batch_interval) {
+    struct stat st;
+    if (lstat(root_.c_str(), &st) != 0) {
+      error_ = errno;
+      return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      error_ = ENOTDIR;
+      return;
+    }
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0 || pipe2(wake_fds_, O_CLOEXEC) != 0) {
+      error_ = errno;
+      return;
+    }
+    collect(root_, entries_);
+    watcher_ = std::thread(&DirectoryIndex::watch_loop, this);
+  }
 
-  auto filter = [&](const std::string &filename) {
-    if (exts.empty()) {
-      return true;
+  ~DirectoryIndex() {
+    if (watcher_.joinable()) {
+      stop_ = true;
+      wake();
+      watcher_.join();
     }
-    std::string ext = get_file_ext(filename);
-    return std::find(exts.begin(), exts.end(), ext) != exts.end();
-  };
+    if (wake_fds_[0] >= 0) {
+      ::close(wake_fds_[0]);
+      ::close(wake_fds_[1]);
+    }
+    if (inotify_fd_ >= 0) {
+      ::close(inotify_fd_);
+    }
+  }
+
+  DirectoryIndex(const DirectoryIndex &) = delete;
+  DirectoryIndex &operator=(const DirectoryIndex &) = delete;
+
+  /// 0 if the index is live, otherwise the errno value that prevented it.
+  int error() const { return error_; }
+
+  const std::string &root() const { return root_; }
+
+  /// Number of entries, including the root directory.
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return entries_.size();
+  }
+
+  /**
+   * @brief Look up a single path.
+   *
+   * @return false if the path is not in the index.
+   */
+  bool lookup(const std::string &path, IndexEntry &entry) const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = entries_.find(trim_separators(path));
+    if (it == entries_.end()) {
+      return false;
+    }
+    entry = it->second;
+    return true;
+  }
+
+  /**
+   * @brief All non-directory entries below a directory, sorted by path.
+   *
+   * @param dir A directory inside the index, spelled starting with root().
+   * @param filter If given, only paths for which it returns true are listed.
+   */
+  std::vector<std::string> files(
+      const std::string &dir,
+      const std::function<bool(const std::string &)> &filter = nullptr) const {
+    std::vector<std::string> result;
+    std::string prefix = trim_separators(dir) + path_separator;
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto it = entries_.lower_bound(prefix);
+         it != entries_.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+         ++it) {
+      if (!it->second.is_dir() && (!filter || filter(it->first))) {
+        result.push_back(it->first);
+      }
+    }
+    return result;
+  }
+
+  std::vector<std::string> images(const std::string &dir) const {
+    return files(dir, is_image);
+  }
+
+  std::vector<std::string> videos(const std::string &dir) const {
+    return files(dir, is_video);
+  }
+
+  /**
+   * @brief Register a subscriber for future changes.
+   *
+   * @return An id for unsubscribe().
+   */
+  std::size_t subscribe(IndexSubscriber subscriber) {
+    std::lock_guard<std::mutex> lock(subscribers_mtx_);
+    subscribers_.push_back(std::make_pair(++last_subscriber_, std::move(subscriber)));
+    return last_subscriber_;
+  }
+
+  /// Remove a subscriber. A batch being delivered may still reach it.
+  void unsubscribe(std::size_t id) {
+    std::lock_guard<std::mutex> lock(subscribers_mtx_);
+    subscribers_.erase(
+        std::remove_if(subscribers_.begin(), subscribers_.end(),
+                       [id](const std::pair<std::size_t, IndexSubscriber> &s) {
+                         return s.first == id;
+                       }),
+        subscribers_.end());
+  }
+
+  /**
+   * @brief Scan a subtree again and report every difference to the index.
+   *
+   * @param dir A directory inside the index, spelled starting with root().
+   */
+  void rescan(const std::string &dir) {
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      rescan_locked(trim_separators(dir));
+    }
+    wake();
+  }
+
+ private:
+  static const uint32_t watch_mask = IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                     IN_MODIFY | IN_CLOSE_WRITE |
+                                     IN_MOVED_FROM | IN_MOVED_TO;
+
+  /// 在 std::map 中 dir 的子项紧跟在 dir + '/' 之后
+  template <typename Map>
+  static typename Map::iterator subtree_begin(Map &map, const std::string &dir) {
+    return map.lower_bound(dir + path_separator);
+  }
+
+  template <typename Map>
+  static bool in_subtree(typename Map::iterator it, Map &map,
+                         const std::string &dir) {
+    return it != map.end() && it->first.size() > dir.size() &&
+           it->first.compare(0, dir.size(), dir) == 0 &&
+           it->first[dir.size()] == path_separator;
+  }
+
+  void wake() {
+    char c = 0;
+    while (write(wake_fds_[1], &c, 1) < 0 && errno == EINTR) {
+    }
+  }
+
+  void add_watch(const std::string &dir) {
+    int wd = inotify_add_watch(inotify_fd_, dir.c_str(),
+                               watch_mask | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+      return;
+    }
+    auto it = watch_dirs_.find(wd);
+    if (it != watch_dirs_.end()) {
+      // 同一个目录被改名后又出现在索引中
+      dir_watches_.erase(it->second);
+    }
+    watch_dirs_[wd] = dir;
+    dir_watches_[dir] = wd;
+  }
+
+  void remove_watches(const std::string &dir) {
+    auto it = dir_watches_.find(dir);
+    if (it != dir_watches_.end()) {
+      inotify_rm_watch(inotify_fd_, it->second);
+      watch_dirs_.erase(it->second);
+      dir_watches_.erase(it);
+    }
+    for (it = subtree_begin(dir_watches_, dir);
+         in_subtree(it, dir_watches_, dir);) {
+      inotify_rm_watch(inotify_fd_, it->second);
+      watch_dirs_.erase(it->second);
+      it = dir_watches_.erase(it);
+    }
+  }
+
+  /// Record path and, for a directory, everything below it into out, and
+  /// watch every directory found.
+  void collect(const std::string &path, std::map<std::string, IndexEntry> &out) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+      return;
+    }
+    out[path] = IndexEntry::from_stat(st);
+    if (!S_ISDIR(st.st_mode)) {
+      return;
+    }
+    // 先加监视再遍历，遍历期间新建的项不会被漏掉
+    add_watch(path);
+    walk_tree(path, [&](const WalkEntry &entry) {
+      if (fstatat(entry.dir_fd(), entry.name(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return WalkAction::Skip;
+      }
+      out[entry.path()] = IndexEntry::from_stat(st);
+      if (entry.is_dir()) {
+        add_watch(entry.path());
+      }
+      return WalkAction::Continue;
+    });
+  }
+
+  void emit(IndexEvent::Kind kind, const std::string &path,
+            const IndexEntry &entry) {
+    auto it = pending_.find(path);
+    if (it == pending_.end()) {
+      if (pending_.empty()) {
+        pending_since_ = std::chrono::steady_clock::now();
+      }
+      IndexEvent event = {kind, path, entry};
+      pending_.insert(std::make_pair(path, event));
+      return;
+    }
+    IndexEvent &event = it->second;
+    event.entry = entry;
+    if (kind == IndexEvent::Added && event.kind == IndexEvent::Removed) {
+      event.kind = IndexEvent::Modified;
+    } else if (kind == IndexEvent::Removed) {
+      if (event.kind == IndexEvent::Added) {
+        pending_.erase(it);
+      } else {
+        event.kind = IndexEvent::Removed;
+      }
+    }
+  }
+
+  /// Drop path and everything below it from the index.
+  void remove_locked(const std::string &path) {
+    auto it = entries_.find(path);
+    if (it == entries_.end()) {
+      return;
+    }
+    if (it->second.is_dir()) {
+      remove_watches(path);
+      auto child = subtree_begin(entries_, path);
+      while (in_subtree(child, entries_, path)) {
+        emit(IndexEvent::Removed, child->first, child->second);
+        child = entries_.erase(child);
+      }
+    }
+    emit(IndexEvent::Removed, it->first, it->second);
+    entries_.erase(it);
+  }
+
+  /// Bring the index entry of path in line with the file system.
+  void refresh_locked(const std::string &path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+      remove_locked(path);
+      return;
+    }
+    IndexEntry entry = IndexEntry::from_stat(st);
+    auto it = entries_.find(path);
+    if (it != entries_.end() && it->second.is_dir() != entry.is_dir()) {
+      remove_locked(path);
+      it = entries_.end();
+    }
+    if (it == entries_.end()) {
+      std::map<std::string, IndexEntry> found;
+      collect(path, found);
+      for (const auto &item : found) {
+        emit(IndexEvent::Added, item.first, item.second);
+      }
+      entries_.insert(found.begin(), found.end());
+    } else if (it->second != entry) {
+      it->second = entry;
+      emit(IndexEvent::Modified, path, entry);
+    }
+  }
+
+  void rescan_locked(const std::string &dir) {
+    std::map<std::string, IndexEntry> found;
+    collect(dir, found);
+
+    std::vector<std::string> gone;
+    auto check = [&](const std::pair<const std::string, IndexEntry> &item) {
+      auto now = found.find(item.first);
+      if (now == found.end() || now->second.is_dir() != item.second.is_dir()) {
+        gone.push_back(item.first);
+      }
+    };
+    auto it = entries_.find(dir);
+    if (it != entries_.end()) {
+      check(*it);
+    }
+    for (it = subtree_begin(entries_, dir); in_subtree(it, entries_, dir); ++it) {
+      check(*it);
+    }
+    for (const auto &path : gone) {
+      remove_locked(path);
+    }
+    for (const auto &item : found) {
+      auto old = entries_.find(item.first);
+      if (old == entries_.end()) {
+        entries_.insert(item);
+        emit(IndexEvent::Added, item.first, item.second);
+      } else if (old->second != item.second) {
+        old->second = item.second;
+        emit(IndexEvent::Modified, item.first, item.second);
+      }
+    }
+  }
+
+  void handle_event(const struct inotify_event &event) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      // 事件丢失，只能与磁盘重新比对
+      rescan_locked(root_);
+      return;
+    }
+    auto dir = watch_dirs_.find(event.wd);
+    if (dir == watch_dirs_.end()) {
+      return;
+    }
+    if (event.mask & IN_IGNORED) {
+      dir_watches_.erase(dir->second);
+      watch_dirs_.erase(dir);
+      return;
+    }
+    if (event.len == 0) {
+      return;
+    }
+    std::string parent = dir->second;
+    std::string path = parent + path_separator + event.name;
+    if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+      remove_locked(path);
+    }
+    refresh_locked(path);
+    if (event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+      // 目录内容变化会改变目录自身的 mtime，只更新索引，不单独上报
+      struct stat st;
+      auto it = entries_.find(parent);
+      if (it != entries_.end() && lstat(parent.c_str(), &st) == 0) {
+        it->second = IndexEntry::from_stat(st);
+      }
+    }
+  }
+
+  void deliver() {
+    std::vector<IndexEvent> batch;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      if (pending_.empty() ||
+          std::chrono::steady_clock::now() < pending_since_ + batch_interval_) {
+        return;
+      }
+      batch.reserve(pending_.size());
+      for (auto &item : pending_) {
+        batch.push_back(std::move(item.second));
+      }
+      pending_.clear();
+    }
+    std::vector<std::pair<std::size_t, IndexSubscriber>> subscribers;
+    {
+      std::lock_guard<std::mutex> lock(subscribers_mtx_);
+      subscribers = subscribers_;
+    }
+    for (const auto &subscriber : subscribers) {
+      subscriber.second(batch);
+    }
+  }
+
+  void watch_loop() {
+    alignas(struct inotify_event) char buffer[65536];
+    struct pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+    while (!stop_) {
+      int timeout = -1;
+      {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!pending_.empty()) {
+          auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+              pending_since_ + batch_interval_ - std::chrono::steady_clock::now());
+          timeout = static_cast<int>(std::max<int64_t>(wait.count(), 0));
+        }
+      }
+      if (poll(fds, 2, timeout) < 0) {
+        continue;
+      }
+      if (fds[1].revents != 0) {
+        char drain[64];
+        while (read(wake_fds_[0], drain, sizeof(drain)) == sizeof(drain)) {
+        }
+      }
+      if (fds[0].revents != 0) {
+        ssize_t n;
+        while ((n = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+          std::lock_guard<std::mutex> lock(mtx_);
+          for (char *p = buffer; p < buffer + n;) {
+            const struct inotify_event *event =
+                reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            handle_event(*event);
+          }
+        }
+      }
+      deliver();
+    }
+  }
+
+  std::string root_;
+  std::chrono::milliseconds batch_interval_;
+  int error_ = 0;
 
-  filenames = list_dir(path, filter);
+  mutable std::mutex mtx_;
+  std::map<std::string, IndexEntry> entries_;
+  std::unordered_map<int, std::string> watch_dirs_;
+  std::map<std::string, int> dir_watches_;
+  std::map<std::string, IndexEvent> pending_;
+  std::chrono::steady_clock::time_point pending_since_;
 
-  return filenames;
-}
+  std::mutex subscribers_mtx_;
+  std::vector<std::pair<std::size_t, IndexSubscriber>> subscribers_;
+  std::size_t last_subscriber_ = 0;
+
+  int inotify_fd_ = -1;
+  int wake_fds_[2] = {-1, -1};
+  std::atomic<bool> stop_{false};
+  std::thread watcher_;
+};
 
 /**
- * @brief Recursively walks a directory tree and returns information about each
- * directory and file encountered
- *
- * The function walks a directory tree, and for each directory and file it
- * encounters, returns information about the directory or file in a tuple. The
- * returned vector contains a tuple for each directory visited, and each tuple
- * contains three elements:
+ * @brief A directory tree stored in a compact file that is used in place
+ * through mmap().
  *
- * 1. The absolute path of the directory
- * 2. A vector of the names of the subdirectories in the directory
- * 3. A vector of the names of the files in the directory
+ * Written by save_snapshot() and update_snapshot(). The file holds a
+ * header, one fixed-size record per entry and a string table with the
+ * names, all in native byte order:
  *
- * The function accepts a callback function, which will be called for each
- * directory visited. The callback function can be used to customize the
- * behavior of the directory traversal.
+ *     SnapshotHeader
+ *     SnapshotRecord[count]    breadth-first, entry 0 is the root
+ *     char names[names_size]   not NUL-terminated
  *
- * @param path The path to the directory to start the traversal from
- * @return A vector containing a tuple for each directory visited. Each tuple
- * contains three elements: the absolute path of the directory, a vector of the
- * names of the subdirectories in the directory, and a vector of the names of
- * the files in the directory.
+ * Breadth-first order keeps the children of a directory next to each
+ * other, sorted by name, so a directory record only needs the index of its
+ * first child and the number of children, and a path is resolved with one
+ * binary search per component. Opening a snapshot only maps and checks the
+ * file; nothing is copied.
  */
-inline std::vector<
-    std::tuple<std::string, std::vector<std::string>, std::vector<std::string>>>
-path_walk(const std::string &root_path) {
-  std::vector<std::tuple<std::string, std::vector<std::string>,
-                         std::vector<std::string>>>
-      result;
+class TreeSnapshot {
+ public:
+  /// Index returned by find() and parent() when there is no such entry.
+  static constexpr uint32_t npos = UINT32_MAX;
 
-  std::vector<std::string> subdir_list;
-  std::vector<std::string> file_list;
-  subdir_list.push_back(root_path);
+  struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t names_size;
+    int64_t created_ns;  ///< CLOCK_REALTIME_COARSE when the walk started
+  };
 
-  for (size_t i = 0; i < subdir_list.size(); i++) {
-    std::vector<std::string> dirnames;
-    std::vector<std::string> filenames;
+  struct SnapshotRecord {
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint32_t type;
+    uint64_t size;
+    int64_t mtime_ns;
+  };
 
-    std::string subdir = subdir_list[i];
+  static const char *magic() { return "FSUSNAP\x01"; }
+  static const uint32_t version = 1;
 
-    // Windows 未验证
-#ifdef _WIN32
-    std::string pattern = subdir + path_separator + "*.*";
-    WIN32_FIND_DATAA data;
-    HANDLE hFind;
-    if ((hFind = FindFirstFileA(pattern.c_str(), &data)) !=
-        INVALID_HANDLE_VALUE) {
-      do {
-        std::string filename = data.cFileName;
-        if (filename == "." || filename == "..") continue;
-
-        std::string filepath = subdir + path_separator + filename;
-        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-          subdir_list.push_back(filepath);
-        } else {
-          file_list.push_back(filepath);
-        }
-      } while (FindNextFileA(hFind, &data) != 0);
+  TreeSnapshot() = default;
+
+  explicit TreeSnapshot(const std::string &file) { open(file); }
 
-      FindClose(hFind);
+  /**
+   * @brief Map a snapshot file and check its structure.
+   *
+   * @return true on success; on failure error() holds the errno value
+   * (EINVAL for a file that is not a valid snapshot).
+   */
+  bool open(const std::string &file) {
+    close();
+    if (!file_.open(file, MappedFile::Populate)) {
+      error_ = file_.error();
+      return false;
     }
-#else
-    DIR *dirp = opendir(subdir.c_str());
-    if (dirp == NULL) {
-      continue;
+    if (!check()) {
+      file_.close();
+      error_ = EINVAL;
+      return false;
     }
+    error_ = 0;
+    return true;
+  }
 
-    struct dirent *dp;
-    struct stat statbuf;
-    while ((dp = readdir(dirp)) != NULL) {
-      if (std::string(dp->d_name) == "." || std::string(dp->d_name) == "..") {
-        continue;
-      }
+  void close() {
+    file_.close();
+    header_ = nullptr;
+    records_ = nullptr;
+    names_ = nullptr;
+  }
 
-      std::string filepath = subdir + path_separator + std::string(dp->d_name);
-      if (lstat(filepath.c_str(), &statbuf) == -1) {
-        continue;
-      }
+  bool is_open() const { return header_ != nullptr; }
 
-      if (S_ISDIR(statbuf.st_mode)) {
-        subdir_list.push_back(filepath);
-        dirnames.emplace_back(dp->d_name);
-      } else {
-        file_list.push_back(filepath);
-        filenames.emplace_back(dp->d_name);
-      }
-    }
+  /// errno value of the last failed open().
+  int error() const { return error_; }
 
-    closedir(dirp);
-#endif
+  /// Number of entries, including the root.
+  std::size_t size() const { return header_ ? header_->count : 0; }
 
-    result.push_back(std::make_tuple(subdir, dirnames, filenames));
+  /// When the snapshot was taken, as nanoseconds since the epoch.
+  int64_t created_ns() const { return header_->created_ns; }
+
+  /// The root directory as passed to save_snapshot().
+  std::string root() const { return name(0); }
+
+  std::string name(uint32_t index) const {
+    const SnapshotRecord &r = records_[index];
+    return std::string(names_ + r.name_offset, r.name_size);
   }
 
-  return result;
-}
+  uint32_t parent(uint32_t index) const { return records_[index].parent; }
 
-/**
- * @brief Recursively walk through a directory and execute the callback function
- * for each file encountered.
- *
- * @param path The path to the directory to walk through.
- * @param cb The callback function to execute for each file encountered. The
- * absolute path of the file is passed as the argument.
- */
-inline void walkdir(const std::string &path,
-                    const std::function<void(const std::string &)> &cb) {
-#ifdef _WIN32
-  std::string pattern = path + path_separator + "*";
-  WIN32_FIND_DATA data;
-  HANDLE handle = FindFirstFile(pattern.c_str(), &data);
+  IndexEntry entry(uint32_t index) const {
+    const SnapshotRecord &r = records_[index];
+    IndexEntry entry;
+    entry.size = r.size;
+    entry.mtime_ns = r.mtime_ns;
+    entry.type = static_cast<unsigned char>(r.type);
+    return entry;
+  }
 
-  if (handle != INVALID_HANDLE_VALUE) {
-    do {
-      std::string filename = data.cFileName;
-      if (filename != "." && filename != "..") {
-        std::string filepath = path + path_separator + filename;
-        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-          walkdir(filepath, cb);
-        } else {
-          cb(filepath);
-        }
-      }
-    } while (FindNextFile(handle, &data));
-    FindClose(handle);
+  /// Children of a directory occupy [first_child, first_child + child_count).
+  uint32_t first_child(uint32_t index) const {
+    return records_[index].first_child;
   }
-#else
-  DIR *dir = opendir(path.c_str());
-  if (dir) {
-    struct dirent *entry;
-    while ((entry = readdir(dir))) {
-      std::string filename = entry->d_name;
-      if (filename != "." && filename != "..") {
-        std::string filepath = path + path_separator + filename;
-        if (entry->d_type == DT_DIR) {
-          walkdir(filepath, cb);
-        } else {
-          cb(filepath);
-        }
+  uint32_t child_count(uint32_t index) const {
+    return records_[index].child_count;
+  }
+
+  /// Full path of an entry, starting with root().
+  std::string path(uint32_t index) const {
+    std::vector<uint32_t> chain;
+    std::size_t length = 0;
+    for (uint32_t i = index; i != npos; i = records_[i].parent) {
+      chain.push_back(i);
+      length += records_[i].name_size + 1;
+    }
+    std::string result;
+    result.reserve(length);
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      if (it != chain.rbegin()) {
+        result += path_separator;
       }
+      result.append(names_ + records_[*it].name_offset,
+                    records_[*it].name_size);
     }
-    closedir(dir);
+    return result;
   }
-#endif
-}
 
-/**
- * @brief 获取文件大小
- *
- * @param path 文件路径
- * @return std::size_t 文件大小（单位：字节）
- */
-inline std::size_t getsize(const std::string &path) {
-  std::size_t size = 0;
+  /// Index of the child of dir with the given name, or npos.
+  uint32_t find_child(uint32_t dir, const char *name, std::size_t size) const {
+    const SnapshotRecord *first = records_ + records_[dir].first_child;
+    const SnapshotRecord *last = first + records_[dir].child_count;
+    const SnapshotRecord *it = std::lower_bound(
+        first, last, 0, [&](const SnapshotRecord &r, int) {
+          return compare_name(r, name, size) < 0;
+        });
+    if (it == last || compare_name(*it, name, size) != 0) {
+      return npos;
+    }
+    return static_cast<uint32_t>(it - records_);
+  }
 
-#ifdef _WIN32
-  // Windows 平台下使用 GetFileSizeEx 获取文件大小
-  HANDLE hFile =
-      CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
-                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-  if (hFile != INVALID_HANDLE_VALUE) {
-    LARGE_INTEGER fileSize;
-    if (GetFileSizeEx(hFile, &fileSize)) {
-      size = static_cast<std::size_t>(fileSize.QuadPart);
+  /**
+   * @brief Resolve a path that starts with root().
+   *
+   * @return The index of the entry, or npos.
+   */
+  uint32_t find(const std::string &path) const {
+    if (!is_open()) {
+      return npos;
     }
-    CloseHandle(hFile);
+    std::string target = trim_separators(path);
+    const SnapshotRecord &root = records_[0];
+    if (target.compare(0, root.name_size, names_ + root.name_offset,
+                       root.name_size) != 0) {
+      return npos;
+    }
+    std::string::size_type pos = root.name_size;
+    if (pos < target.size() && target[pos] != path_separator &&
+        target[pos - 1] != path_separator) {
+      return npos;
+    }
+    uint32_t index = 0;
+    while (pos < target.size() && index != npos) {
+      pos = target.find_first_not_of(path_separator, pos);
+      std::string::size_type end = target.find(path_separator, pos);
+      if (end == std::string::npos) {
+        end = target.size();
+      }
+      index = find_child(index, target.data() + pos, end - pos);
+      pos = end;
+    }
+    return index;
   }
-#else
-  // Unix 平台下使用 stat 获取文件大小
-  struct stat st;
-  if (stat(path.c_str(), &st) == 0) {
-    size = static_cast<std::size_t>(st.st_size);
+
+  /**
+   * @brief All non-directory entries below a directory, in depth-first
+   * order.
+   *
+   * @param dir A directory in the snapshot, spelled starting with root().
+   * @param filter If given, only paths for which it returns true are listed.
+   */
+  std::vector<std::string> files(
+      const std::string &dir,
+      const std::function<bool(const std::string &)> &filter = nullptr) const {
+    std::vector<std::string> result;
+    uint32_t start = find(dir);
+    if (start == npos) {
+      return result;
+    }
+    struct Walker {
+      const TreeSnapshot &snapshot;
+      const std::function<bool(const std::string &)> &filter;
+      std::vector<std::string> &result;
+      std::string path;
+
+      void walk(uint32_t dir) {
+        const SnapshotRecord &r = snapshot.records_[dir];
+        for (uint32_t i = r.first_child; i < r.first_child + r.child_count; ++i) {
+          const SnapshotRecord &child = snapshot.records_[i];
+          std::string::size_type length = path.size();
+          path += path_separator;
+          path.append(snapshot.names_ + child.name_offset, child.name_size);
+          if (child.type == DT_DIR) {
+            walk(i);
+          } else if (!filter || filter(path)) {
+            result.push_back(path);
+          }
+          path.resize(length);
+        }
+      }
+    };
+    Walker walker = {*this, filter, result, path(start)};
+    walker.walk(start);
+    return result;
   }
-#endif
 
-  return size;
-}
+  std::vector<std::string> images(const std::string &dir) const {
+    return files(dir, is_image);
+  }
 
-/// 确保文件父目录存在
-inline std::string valid_filepath(std::string const &fpath) {
-  makedirs(dirname(fpath));
-  return fpath;
-}
+  std::vector<std::string> videos(const std::string &dir) const {
+    return files(dir, is_video);
+  }
 
-inline std::string get_now_datetime_path() {
-  auto t = std::time(nullptr);
-  auto tm = *std::localtime(&t);
+ private:
+  int compare_name(const SnapshotRecord &r, const char *name,
+                   std::size_t size) const {
+    int result = std::memcmp(names_ + r.name_offset, name,
+                             std::min<std::size_t>(r.name_size, size));
+    if (result != 0) {
+      return result;
+    }
+    return r.name_size < size ? -1 : (r.name_size > size ? 1 : 0);
+  }
+
+  bool check() {
+    if (file_.size() < sizeof(SnapshotHeader)) {
+      return false;
+    }
+    const SnapshotHeader *header =
+        reinterpret_cast<const SnapshotHeader *>(file_.data());
+    if (std::memcmp(header->magic, magic(), sizeof(header->magic)) != 0 ||
+        header->version != version || header->count == 0 ||
+        file_.size() != sizeof(SnapshotHeader) +
+                            uint64_t(header->count) * sizeof(SnapshotRecord) +
+                            header->names_size) {
+      return false;
+    }
+    const SnapshotRecord *records = reinterpret_cast<const SnapshotRecord *>(
+        file_.data() + sizeof(SnapshotHeader));
+    // 一次性检查所有下标，之后的访问无需再做边界检查
+    for (uint32_t i = 0; i < header->count; ++i) {
+      const SnapshotRecord &r = records[i];
+      if ((i == 0 ? r.parent != npos : r.parent >= i) ||
+          uint64_t(r.name_offset) + r.name_size > header->names_size ||
+          uint64_t(r.first_child) + r.child_count > header->count ||
+          (r.child_count > 0 && r.first_child <= i)) {
+        return false;
+      }
+    }
+    header_ = header;
+    records_ = records;
+    names_ = file_.data() + sizeof(SnapshotHeader) +
+             std::size_t(header->count) * sizeof(SnapshotRecord);
+    return true;
+  }
 
-  std::ostringstream oss;
-  std::string fmt = std::string("%Y-%m-%d") + path_separator + "%H-%M-%S";
-  oss << std::put_time(&tm, fmt.c_str());
+  MappedFile file_;
+  const SnapshotHeader *header_ = nullptr;
+  const SnapshotRecord *records_ = nullptr;
+  const char *names_ = nullptr;
+  int error_ = 0;
+};
 
-  return oss.str();
-}
+/// What save_snapshot() and update_snapshot() did.
+struct SnapshotStats {
+  std::size_t entries = 0;    ///< Entries written
+  std::size_t dirs = 0;       ///< Directories visited
+  std::size_t rescanned = 0;  ///< Directories that were listed from disk
+};
 
 /**
- * @brief Determine if a file is a image file by its extension.
+ * @brief Walk a tree and write it to a snapshot file, see TreeSnapshot.
  *
- * @param path The path to the file.
- * @return true if the file is a image file, false otherwise.
+ * If previous is given, a directory whose mtime still matches the one in
+ * previous is not listed again: its children are copied from previous and
+ * only its subdirectories are lstat()ed. A directory modified in the same
+ * clock tick as the previous snapshot was taken is always listed, since a
+ * later change would not move its mtime.
+ *
+ * The file is written to a temporary name and renamed into place, so
+ * readers that still map the old snapshot are not affected.
+ *
+ * @return 0 on success, otherwise an errno value.
  */
-inline bool is_image(const std::string &path) {
-  static const std::set<std::string> image_exts = {
-      "bmp", "gif", "jpeg", "jpg", "png", "svg", "tif", "tiff", "webp"};
+inline int write_snapshot(const std::string &root, const std::string &file,
+                          const TreeSnapshot *previous = nullptr,
+                          SnapshotStats *stats = nullptr) {
+  typedef TreeSnapshot::SnapshotRecord Record;
+  const uint32_t npos = TreeSnapshot::npos;
+  std::string root_path = trim_separators(root);
+  struct stat st;
+  if (lstat(root_path.c_str(), &st) != 0) {
+    return errno;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return ENOTDIR;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
 
-  // Get the file extension
-  std::string ext = get_file_ext(path);
+  std::vector<Record> records;
+  std::string names;
+  SnapshotStats local_stats;
+  SnapshotStats &result = stats ? *stats : local_stats;
+  result = SnapshotStats();
 
-  // Check if the file extension is an image format
-  return image_exts.count(ext) > 0;
-}
+  auto add_record = [&](uint32_t parent, const char *name, std::size_t size,
+                        const IndexEntry &entry) {
+    Record r = {};
+    r.parent = parent;
+    r.name_offset = static_cast<uint32_t>(names.size());
+    r.name_size = static_cast<uint32_t>(size);
+    r.type = entry.type;
+    r.size = entry.size;
+    r.mtime_ns = entry.mtime_ns;
+    names.append(name, size);
+    records.push_back(r);
+  };
 
-/**
- * @brief Determine if a file is a video file by its extension.
- *
- * @param path The path to the file.
- * @return true if the file is a video file, false otherwise.
- */
-inline bool is_video(const std::string &path) {
-  static const std::set<std::string> video_exts = {
-      "avi", "mp4", "mkv", "mov", "wmv", "flv", "f4v",  "rmvb", "rm",
-      "3gp", "dat", "ts",  "mts", "vob", "mpg", "mpeg", "m4v",  "webm"};
+  struct Child {
+    std::string name;
+    IndexEntry entry;
+    uint32_t previous;
+  };
+  struct Pending {
+    uint32_t index;
+    std::string path;
+    uint32_t previous;
+  };
+  std::deque<Pending> queue;
+  std::vector<Child> children;
+  add_record(npos, root_path.data(), root_path.size(), IndexEntry());
+  bool same_root = previous && previous->is_open() && previous->root() == root_path;
+  queue.push_back(Pending{0, root_path, same_root ? 0 : npos});
 
-  // Get the file extension
-  std::string ext = get_file_ext(path);
+  while (!queue.empty()) {
+    Pending dir = std::move(queue.front());
+    queue.pop_front();
+    if (lstat(dir.path.c_str(), &st) != 0) {
+      continue;
+    }
+    IndexEntry current = IndexEntry::from_stat(st);
+    Record &record = records[dir.index];
+    record.type = current.type;
+    record.size = current.size;
+    record.mtime_ns = current.mtime_ns;
+    if (!current.is_dir()) {
+      continue;
+    }
+    ++result.dirs;
 
-  // Check if the file extension is a video format
-  return video_exts.count(ext) > 0;
-}
+    children.clear();
+    if (dir.previous != npos &&
+        previous->entry(dir.previous).is_dir() &&
+        previous->entry(dir.previous).mtime_ns == current.mtime_ns &&
+        current.mtime_ns < previous->created_ns()) {
+      // 目录未变化，直接沿用上一份快照中的子项
+      uint32_t first = previous->first_child(dir.previous);
+      for (uint32_t i = first; i < first + previous->child_count(dir.previous);
+           ++i) {
+        children.push_back(Child{previous->name(i), previous->entry(i), i});
+      }
+    } else {
+      ++result.rescanned;
+      DirReader reader(dir.path);
+      DirReader::Entry e;
+      while (reader.next(e)) {
+        if (fstatat(reader.fd(), e.name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+          continue;
+        }
+        uint32_t old = dir.previous == npos
+                           ? npos
+                           : previous->find_child(dir.previous, e.name,
+                                                  std::strlen(e.name));
+        children.push_back(Child{e.name, IndexEntry::from_stat(st), old});
+      }
+      std::sort(children.begin(), children.end(),
+                [](const Child &a, const Child &b) { return a.name < b.name; });
+    }
 
-///  判断是否为在线视频
-inline bool is_online_video(const std::string &url) {
-  static const std::vector<std::string> remote_protocols = {
-      "http://", "https://", "ftp://", "sftp://", "rtsp://", "rtmp://"};
-  return std::any_of(
-      remote_protocols.begin(), remote_protocols.end(),
-      [&](const std::string &protocol) { return url.find(protocol) == 0; });
+    if (records.size() + children.size() >= npos ||
+        names.size() > UINT32_MAX) {
+      return EOVERFLOW;
+    }
+    records[dir.index].first_child = static_cast<uint32_t>(records.size());
+    records[dir.index].child_count = static_cast<uint32_t>(children.size());
+    for (const Child &child : children) {
+      uint32_t index = static_cast<uint32_t>(records.size());
+      add_record(dir.index, child.name.data(), child.name.size(), child.entry);
+      if (child.entry.is_dir()) {
+        queue.push_back(Pending{index, dir.path + path_separator + child.name,
+                                child.previous});
+      }
+    }
+  }
+  if (names.size() > UINT32_MAX) {
+    return EOVERFLOW;
+  }
+  result.entries = records.size();
+
+  TreeSnapshot::SnapshotHeader header = {};
+  std::memcpy(header.magic, TreeSnapshot::magic(), sizeof(header.magic));
+  header.version = TreeSnapshot::version;
+  header.count = static_cast<uint32_t>(records.size());
+  header.names_size = names.size();
+  header.created_ns = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+
+  // 临时文件名唯一且用 O_EXCL 创建，并发更新同一快照时互不覆盖
+  static std::atomic<uint64_t> counter{0};
+  std::string tmp;
+  int fd;
+  do {
+    tmp = file + ".tmp" + std::to_string(getpid()) + "." +
+          std::to_string(counter++);
+    fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  } while (fd < 0 && errno == EEXIST);
+  if (fd < 0) {
+    return errno;
+  }
+  int error = write_fd(fd, &header, sizeof(header));
+  if (error == 0) {
+    error = write_fd(fd, records.data(), records.size() * sizeof(Record));
+  }
+  if (error == 0) {
+    error = write_fd(fd, names.data(), names.size());
+  }
+  if (::close(fd) != 0 && error == 0) {
+    error = errno;
+  }
+  if (error == 0 && rename(tmp.c_str(), file.c_str()) != 0) {
+    error = errno;
+  }
+  if (error != 0) {
+    unlink(tmp.c_str());
+  }
+  return error;
 }
 
 /**
- * @brief Lists all image files in the specified directory.
- *
- * This function returns a vector of strings containing the names of all image
- * files (i.e., files with extensions .jpg, .jpeg, .png, .bmp, .gif) in the
- * specified directory.
- *
- * @param path The path to the directory to search for image files. Defaults to
- * the current directory.
+ * @brief Walk a tree and write a new snapshot file.
  *
- * @return A vector of strings containing the names of all image files in the
- * specified directory.
+ * @return 0 on success, otherwise an errno value.
  */
-inline std::vector<std::string> list_images(const std::string &path = ".") {
-  return list_dir(path, is_image);
+inline int save_snapshot(const std::string &root, const std::string &file,
+                         SnapshotStats *stats = nullptr) {
+  return write_snapshot(root, file, nullptr, stats);
 }
 
 /**
- * @brief Lists all video files in the specified directory.
- *
- * This function returns a vector of strings containing the names of all video
- * files (i.e., files with extensions .avi, .mp4, .mkv, .mov, .wmv, .flv, .f4v,
- * .rmvb, .rm, .3gp, .dat, .ts, .mts, .vob, .mpg, .mpeg, .m4v, .webm) in the
- * specified directory.
+ * @brief Bring an existing snapshot file up to date.
  *
- * @param path The path to the directory to search for video files. Defaults to
- * the current directory.
+ * Only directories whose mtime changed since the snapshot was taken are
+ * listed again; every other directory costs a single lstat(). Files that
+ * were modified in place do not change the mtime of their directory, so
+ * their size and mtime in the snapshot may stay stale. Falls back to a full
+ * walk when the file is missing or invalid.
  *
- * @return A vector of strings containing the names of all video files in the
- * specified directory.
+ * @param root The tree the snapshot describes.
+ * @param file The snapshot file, replaced on success.
+ * @return 0 on success, otherwise an errno value.
  */
-inline std::vector<std::string> list_videos(const std::string &path = ".") {
-  return list_dir(path, is_video);
-}
-
-// ==============================================================================================
-//                                         文件读写
-// ==============================================================================================
-
-/// 读取整个文件内容到string
-inline void read_file_to_string(const std::string &infile,
-                                std::string &outstr) {
-  std::ifstream in(infile, std::ios::in);
-  if (!in.is_open()) {
-    std::cerr << "open file " << infile << " failed!" << std::endl;
-    return;
-  }
-  std::istreambuf_iterator<char> beg(in), end;
-  outstr.assign(beg, end);
-  in.close();
-}
-
-/// 读取整个文件内容 (说明：由于RVO的存在，此函数性能与 read_file_to_string
-/// 差不多，而且更简洁，因此更推荐)
-inline std::string read_file(const std::string &infile) {
-  std::string s;
-  read_file_to_string(infile, s);
-  return s;  // RVO
+inline int update_snapshot(const std::string &root, const std::string &file,
+                           SnapshotStats *stats = nullptr) {
+  TreeSnapshot previous(file);
+  return write_snapshot(root, file, previous.is_open() ? &previous : nullptr,
+                        stats);
 }
+#endif
 
 }  // namespace
@@ -0,0 +1,713 @@
+/// fs_utils 性能测试
+///
+/// 用法: cpp_utils_bench [目录]
+/// 不指定目录时会在当前目录下生成一个临时目录树进行测试。
+
+#include <chrono>
+
+#include "fs_utils.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+/// 生成一个 fanout^depth 个目录、每个目录 files 个文件的目录树
+void make_bench_tree(const std::string &dir, int depth, int fanout,
+                     int files) {
+  makedirs(dir);
+  for (int i = 0; i < files; ++i) {
+    std::ofstream(path_join(dir, "file" + std::to_string(i) + ".jpg"));
+  }
+  if (depth == 0) {
+    return;
+  }
+  for (int i = 0; i < fanout; ++i) {
+    make_bench_tree(path_join(dir, "dir" + std::to_string(i)), depth - 1,
+                    fanout, files);
+  }
+}
+
+void bench_path_walk(const std::string &root) {
+  auto start = Clock::now();
+  auto serial = path_walk(root);
+  std::size_t files = 0;
+  for (const auto &item : serial) {
+    files += std::get<2>(item).size();
+  }
+  double base = elapsed_ms(start);
+  std::printf("path_walk: %zu dirs, %zu files\n", serial.size(), files);
+  std::printf("  %-24s %10.2f ms\n", "serial", base);
+
+  start = Clock::now();
+  for (auto &item : DirWalker(root)) {
+    (void)item;
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "DirWalker", ms, base / ms);
+
+  start = Clock::now();
+  PathTree tree = path_walk_tree(root);
+  ms = elapsed_ms(start);
+  std::size_t walk_bytes = 0;
+  for (const auto &item : serial) {
+    walk_bytes += sizeof(item) + std::get<0>(item).capacity();
+    for (const auto &name : std::get<1>(item)) {
+      walk_bytes += sizeof(name) + name.capacity();
+    }
+    for (const auto &name : std::get<2>(item)) {
+      walk_bytes += sizeof(name) + name.capacity();
+    }
+  }
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu KiB vs %zu KiB)\n",
+              "path_walk_tree", ms, base / ms, tree.memory_usage() / 1024,
+              walk_bytes / 1024);
+
+  std::size_t max_threads =
+      std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+    for (bool ordered : {true, false}) {
+      start = Clock::now();
+      auto result = path_walk_parallel(root, threads, ordered);
+      double ms = elapsed_ms(start);
+      std::string name = "parallel x" + std::to_string(threads) +
+                         (ordered ? " ordered" : " unordered");
+      std::printf("  %-24s %10.2f ms  (%.2fx)\n", name.c_str(), ms,
+                  base / ms);
+    }
+  }
+}
+
+void bench_walkdir(const std::string &root) {
+  std::size_t files = 0;
+  auto start = Clock::now();
+  walkdir(root, [&](const std::string &) { ++files; });
+  std::printf("walkdir: %zu files\n", files);
+  std::printf("  %-24s %10.2f ms\n", "serial", elapsed_ms(start));
+}
+
+void bench_remove(const std::string &root) {
+  std::printf("remove tree\n");
+  auto start = Clock::now();
+  remove_path(root);
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "remove_path", base);
+
+  std::size_t max_threads =
+      std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+    make_bench_tree(root, 4, 8, 20);
+    RemoveOptions options;
+    options.num_threads = threads;
+    start = Clock::now();
+    remove_tree(root, options);
+    double ms = elapsed_ms(start);
+    std::string name = "remove_tree x" + std::to_string(threads);
+    std::printf("  %-24s %10.2f ms  (%.2fx)\n", name.c_str(), ms,
+                base / ms);
+  }
+}
+
+/// 生成 count 个 size 字节的小文件
+std::vector<std::string> make_small_files(const std::string &dir, int count,
+                                          std::size_t size) {
+  makedirs(dir);
+  std::vector<std::string> paths;
+  std::string content(size, 'x');
+  for (int i = 0; i < count; ++i) {
+    paths.push_back(path_join(dir, "file" + std::to_string(i) + ".json"));
+    std::ofstream(paths.back(), std::ios::binary) << content;
+  }
+  return paths;
+}
+
+void bench_read_files(const std::vector<std::string> &paths) {
+  std::printf("read %zu small files\n", paths.size());
+  std::size_t bytes = 0;
+  auto start = Clock::now();
+  for (const auto &path : paths) {
+    // read_file 之前的实现
+    std::ifstream in(path, std::ios::in);
+    std::string s{std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>()};
+    bytes += s.size();
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "istreambuf_iterator", base);
+
+  start = Clock::now();
+  for (const auto &path : paths) {
+    bytes += read_file(path).size();
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "read_file", ms, base / ms);
+
+  std::string buffer;
+  start = Clock::now();
+  for (const auto &path : paths) {
+    read_file_into(path, buffer);
+    bytes += buffer.size();
+  }
+  ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "read_file_into", ms, base / ms);
+
+  // 回退实现会在多个线程中调用回调
+  std::atomic<std::size_t> batch_bytes{0};
+  for (bool use_io_uring : {true, false}) {
+    for (unsigned depth : {1u, 16u, 64u}) {
+      BatchReadOptions options;
+      options.queue_depth = depth;
+      options.use_io_uring = use_io_uring;
+      start = Clock::now();
+      read_files_batch(
+          paths,
+          [&](std::size_t, int, std::string &data) {
+            batch_bytes += data.size();
+          },
+          options);
+      ms = elapsed_ms(start);
+      std::string name =
+          std::string(use_io_uring ? "batch io_uring" : "batch pread") +
+          " qd" + std::to_string(depth);
+      std::printf("  %-24s %10.2f ms  (%.2fx)\n", name.c_str(), ms,
+                  base / ms);
+    }
+  }
+}
+
+void bench_walk_and_read(const std::string &root) {
+  std::printf("walk and read %s\n", root.c_str());
+  std::size_t bytes = 0;
+  auto start = Clock::now();
+  walkdir(root, [&](const std::string &path) {
+    bytes += read_file(path).size();
+  });
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "walkdir + read_file", base);
+
+  start = Clock::now();
+  walk_and_read(root, [&](const std::string &, int, std::string &data) {
+    bytes += data.size();
+  });
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "walk_and_read", ms, base / ms);
+}
+
+void bench_valid_filepath(const std::string &root) {
+  const int count = 50000;
+  std::vector<std::string> paths;
+  for (int i = 0; i < count; ++i) {
+    paths.push_back(path_join(root, "cam" + std::to_string(i % 100), "2024",
+                              std::to_string(i) + ".jpg"));
+  }
+  std::printf("valid_filepath for %d files in 100 dirs\n", count);
+  auto start = Clock::now();
+  for (const auto &path : paths) {
+    makedirs(dirname(path));
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "makedirs", base);
+
+  dir_cache().clear();
+  start = Clock::now();
+  for (const auto &path : paths) {
+    valid_filepath(path);
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "valid_filepath", ms,
+              base / ms);
+  remove_path(root);
+}
+
+void bench_stat_cache(const std::string &root) {
+  std::vector<std::string> paths;
+  walkdir(root, [&](const std::string &path) { paths.push_back(path); });
+  const int rounds = 5;
+  std::printf("is_file x%d over %zu files\n", rounds, paths.size());
+  std::size_t found = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < rounds; ++i) {
+    for (const auto &path : paths) {
+      found += is_file(path);
+    }
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "stat", base);
+
+  auto cache = enable_stat_cache();
+  start = Clock::now();
+  for (int i = 0; i < rounds; ++i) {
+    for (const auto &path : paths) {
+      found += is_file(path);
+    }
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %llu hits)\n", "StatCache", ms,
+              base / ms, static_cast<unsigned long long>(cache->hits()));
+  disable_stat_cache();
+}
+
+void bench_directory_index(const std::string &root) {
+  std::printf("list images under %s\n", root.c_str());
+  auto start = Clock::now();
+  std::size_t images = 0;
+  walkdir(root, [&](const std::string &path) { images += is_image(path); });
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu images)\n", "walkdir", base, images);
+
+  start = Clock::now();
+  DirectoryIndex index(root);
+  std::printf("  %-24s %10.2f ms\n", "DirectoryIndex build", elapsed_ms(start));
+  start = Clock::now();
+  images = index.images(root).size();
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu images)\n", "DirectoryIndex query",
+              ms, base / ms, images);
+}
+
+void bench_snapshot(const std::string &root) {
+  const std::string file = "bench_snapshot.bin";
+  std::printf("snapshot of %s\n", root.c_str());
+  auto start = Clock::now();
+  std::size_t images = 0;
+  walkdir(root, [&](const std::string &path) { images += is_image(path); });
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu images)\n", "walkdir", base, images);
+
+  SnapshotStats stats;
+  start = Clock::now();
+  save_snapshot(root, file, &stats);
+  std::printf("  %-24s %10.2f ms  (%zu entries)\n", "save_snapshot",
+              elapsed_ms(start), stats.entries);
+
+  start = Clock::now();
+  TreeSnapshot snapshot(file);
+  images = snapshot.images(root).size();
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu images)\n", "open + images", ms,
+              base / ms, images);
+
+  snapshot.close();
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  start = Clock::now();
+  update_snapshot(root, file, &stats);
+  ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu of %zu dirs listed)\n",
+              "update_snapshot", ms, stats.rescanned, stats.dirs);
+  remove_path(file);
+}
+
+void bench_classify() {
+  const char *exts[] = {"jpg", "PNG", "mp4", "txt", "json", "tar.gz", "", "webp"};
+  std::vector<std::string> names;
+  for (int i = 0; i < 1000000; ++i) {
+    names.push_back("/data/cam" + std::to_string(i % 100) + "/frame" +
+                    std::to_string(i) + "." + exts[i % 8]);
+  }
+  std::printf("classify %zu names\n", names.size());
+  // is_image 之前的实现
+  static const std::set<std::string> image_exts = {
+      "bmp", "gif", "jpeg", "jpg", "png", "svg", "tif", "tiff", "webp"};
+  std::size_t images = 0;
+  auto start = Clock::now();
+  for (const auto &name : names) {
+    images += image_exts.count(get_file_ext(name));
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu images)\n", "std::set", base, images);
+
+  images = 0;
+  start = Clock::now();
+  for (const auto &name : names) {
+    images += is_image(name);
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu images)\n", "is_image", ms,
+              base / ms, images);
+}
+
+void bench_sniff(const std::vector<std::string> &paths) {
+  std::printf("sniff %zu files\n", paths.size());
+  std::size_t images = 0;
+  std::string buffer;
+  auto start = Clock::now();
+  for (const auto &path : paths) {
+    read_file_into(path, buffer);
+    images += sniff_file_type(buffer.data(), buffer.size()) ==
+              FileCategory::Image;
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu images)\n", "read_file_into", base,
+              images);
+
+  start = Clock::now();
+  std::vector<FileCategory> categories = sniff_files(paths);
+  double ms = elapsed_ms(start);
+  images = std::count(categories.begin(), categories.end(),
+                      FileCategory::Image);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu images)\n", "sniff_files", ms,
+              base / ms, images);
+}
+
+void bench_path_view() {
+  std::vector<std::string> paths;
+  for (int i = 0; i < 1000000; ++i) {
+    paths.push_back("/data/cam" + std::to_string(i % 100) + "/2024/frame" +
+                    std::to_string(i) + ".jpg");
+  }
+  std::printf("split %zu paths\n", paths.size());
+  std::size_t total = 0;
+  auto start = Clock::now();
+  for (const auto &path : paths) {
+    total += dirname(path).size() + basename(path).size() +
+             get_file_ext(path).size() + remove_file_ext(path).size();
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "std::string", base);
+
+  start = Clock::now();
+  for (const auto &path : paths) {
+    PathView view(path);
+    total += view.dirname().size() + view.basename().size() +
+             view.ext().size() + view.stem().size();
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu)\n", "PathView", ms, base / ms,
+              total);
+}
+
+void bench_normpath() {
+  std::vector<std::string> paths;
+  for (int i = 0; i < 200000; ++i) {
+    paths.push_back("./data//cam" + std::to_string(i % 100) +
+                    "/./2024/../2025/frames/./" + std::to_string(i) + ".jpg");
+  }
+  std::printf("normpath %zu paths\n", paths.size());
+  std::size_t total = 0;
+  auto start = Clock::now();
+  for (const auto &path : paths) {
+    // normpath 之前的实现
+    std::vector<std::string> parts;
+    std::stringstream ss(path);
+    std::string part;
+    while (std::getline(ss, part, path_separator)) {
+      if (part == "" || part == ".") {
+        continue;
+      }
+      if (part == ".." && !parts.empty() && parts.back() != "..") {
+        parts.pop_back();
+      } else {
+        parts.push_back(part);
+      }
+    }
+    std::string normalized;
+    for (const auto &part : parts) {
+      normalized += part + path_separator;
+    }
+    total += normalized.size();
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "stringstream", base);
+
+  start = Clock::now();
+  for (const auto &path : paths) {
+    total += normpath(path).size();
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "normpath", ms, base / ms);
+
+  start = Clock::now();
+  for (auto &path : paths) {
+    normpath_inplace(path);
+    total += path.size();
+  }
+  ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu)\n", "normpath_inplace", ms,
+              base / ms, total);
+}
+
+void bench_glob(const std::string &root) {
+  GlobPattern pattern("dir1/**/dir[23]/file1?.jpg");
+  std::printf("glob %s\n", pattern.pattern().c_str());
+  std::size_t files = 0;
+  auto start = Clock::now();
+  walkdir(root, [&](const std::string &path) {
+    files += pattern.match(PathView(path).substr(root.size() + 1));
+  });
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu files)\n", "walkdir + filter", base,
+              files);
+
+  files = 0;
+  start = Clock::now();
+  walkdir(root, pattern, [&](const std::string &) { ++files; });
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu files)\n", "walkdir pushdown",
+              ms, base / ms, files);
+}
+
+void bench_tree_usage(const std::string &root) {
+  std::printf("tree usage %s\n", root.c_str());
+  uint64_t bytes = 0;
+  auto start = Clock::now();
+  walkdir(root, [&](const std::string &path) { bytes += getsize(path); });
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "walkdir + getsize", base);
+
+  for (std::size_t threads : {1, 0}) {
+    TreeUsageOptions options;
+    options.num_threads = threads;
+    start = Clock::now();
+    TreeUsage usage = tree_usage(root, options);
+    double ms = elapsed_ms(start);
+    std::string name = threads == 1 ? "tree_usage x1" : "tree_usage";
+    std::printf("  %-24s %10.2f ms  (%.2fx, %llu files)\n", name.c_str(), ms,
+                base / ms, static_cast<unsigned long long>(usage.files));
+  }
+}
+
+void bench_duplicates(const std::string &root) {
+  std::printf("find duplicates in %s\n", root.c_str());
+  std::size_t groups = 0;
+  auto start = Clock::now();
+  // 逐个读取并哈希所有文件
+  std::map<std::pair<uint64_t, uint64_t>, std::size_t> counts;
+  std::string buffer;
+  walkdir(root, [&](const std::string &path) {
+    read_file_into(path, buffer);
+    ++counts[{buffer.size(), xxh64(buffer.data(), buffer.size())}];
+  });
+  for (const auto &item : counts) {
+    groups += item.second > 1;
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu groups)\n", "walkdir + read_file", base,
+              groups);
+
+  start = Clock::now();
+  DuplicateReport report = find_duplicates(root);
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu groups, %llu full reads)\n",
+              "find_duplicates", ms, base / ms, report.groups.size(),
+              static_cast<unsigned long long>(report.full_hashed));
+}
+
+void bench_copy(const std::string &dir) {
+  std::printf("copy %s\n", dir.c_str());
+  const std::string dst = "bench_copy";
+  auto start = Clock::now();
+  // 通过 read_file 和 ofstream 复制
+  walkdir(dir, [&](const std::string &path) {
+    std::string to = path_join(dst, path.substr(dir.size() + 1));
+    makedirs_cached(dirname(to));
+    std::ofstream(to, std::ios::binary) << read_file(path);
+  });
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "read_file + ofstream", base);
+  remove_path(dst);
+
+  for (std::size_t threads : {1, 0}) {
+    CopyOptions options;
+    options.num_threads = threads;
+    start = Clock::now();
+    CopyStats stats = copy_tree(dir, dst, options);
+    double ms = elapsed_ms(start);
+    std::string name = threads == 1 ? "copy_tree x1" : "copy_tree";
+    std::printf("  %-24s %10.2f ms  (%.2fx, %zu files)\n", name.c_str(), ms,
+                base / ms, stats.files);
+    if (threads == 0) {
+      options.skip_unchanged = true;
+      start = Clock::now();
+      stats = copy_tree(dir, dst, options);
+      ms = elapsed_ms(start);
+      std::printf("  %-24s %10.2f ms  (%.2fx, %zu skipped)\n",
+                  "copy_tree incremental", ms, base / ms, stats.skipped);
+    }
+    remove_path(dst);
+  }
+}
+
+void bench_write_files(const std::string &dir) {
+  const int count = 2000;
+  std::string content(4096, 'x');
+  // 每种写法都写入新建的目录
+  auto name = [&](int i) {
+    if (i == 0) {
+      remove_path(dir);
+      makedirs(dir);
+    }
+    return path_join(dir, "file" + std::to_string(i) + ".json");
+  };
+  std::printf("write %d files\n", count);
+  auto start = Clock::now();
+  for (int i = 0; i < count; ++i) {
+    std::ofstream(name(i), std::ios::binary) << content;
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "ofstream", base);
+
+  start = Clock::now();
+  for (int i = 0; i < count; ++i) {
+    write_file(name(i), content);
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "write_file", ms, base / ms);
+
+  start = Clock::now();
+  for (int i = 0; i < count; ++i) {
+    write_file_atomic(name(i), content);
+  }
+  double sync_base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "write_file_atomic sync", sync_base);
+
+  for (SyncMethod method : {SyncMethod::Fdatasync, SyncMethod::Syncfs}) {
+    WriteBatchOptions options;
+    options.method = method;
+    start = Clock::now();
+    {
+      WriteBatch batch(options);
+      for (int i = 0; i < count; ++i) {
+        batch.write(name(i), content);
+      }
+    }
+    ms = elapsed_ms(start);
+    std::printf("  %-24s %10.2f ms  (%.2fx)\n",
+                method == SyncMethod::Syncfs ? "WriteBatch syncfs"
+                                             : "WriteBatch fdatasync",
+                ms, sync_base / ms);
+  }
+  remove_path(dir);
+}
+
+void bench_output_layout(const std::string &root) {
+  const int count = 200000;
+  std::printf("output paths for %d frames\n", count);
+  std::size_t total = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < count; ++i) {
+    // get_now_datetime_path 之前的实现
+    std::time_t t = std::time(nullptr);
+    std::tm tm = *std::localtime(&t);
+    std::ostringstream oss;
+    std::string fmt = std::string("%Y-%m-%d") + path_separator + "%H-%M-%S";
+    oss << std::put_time(&tm, fmt.c_str());
+    total += valid_filepath(path_join(root, oss.str(),
+                                      "frame" + std::to_string(i) + ".jpg"))
+                 .size();
+  }
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "put_time + valid_filepath", base);
+
+  start = Clock::now();
+  for (int i = 0; i < count; ++i) {
+    total += valid_filepath(path_join(root, get_now_datetime_path(),
+                                      "frame" + std::to_string(i) + ".jpg"))
+                 .size();
+  }
+  double ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx)\n", "get_now_datetime_path", ms,
+              base / ms);
+
+  OutputLayout layout(root);
+  std::string path;
+  start = Clock::now();
+  for (int i = 0; i < count; ++i) {
+    layout.path("frame" + std::to_string(i) + ".jpg", path);
+    total += path.size();
+  }
+  ms = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%.2fx, %zu)\n", "OutputLayout", ms,
+              base / ms, total);
+  remove_path(root);
+}
+
+void bench_list_dir(const std::string &dir) {
+  std::printf("list_dir %s\n", dir.c_str());
+  auto start = Clock::now();
+  std::size_t files = list_dir(dir).size();
+  double base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms  (%zu files)\n", "versionsort", base, files);
+
+  for (ListOrder order : {ListOrder::Unordered, ListOrder::Natural}) {
+    start = Clock::now();
+    files = list_dir(dir, order).size();
+    double ms = elapsed_ms(start);
+    std::printf("  %-24s %10.2f ms  (%.2fx, %zu files)\n",
+                order == ListOrder::Natural ? "natural" : "unordered", ms,
+                base / ms, files);
+  }
+
+  std::vector<std::string> names;
+  for (int i = 0; i < 1000000; ++i) {
+    names.push_back("frame" + std::to_string((i * 7919ll) % 1000000) +
+                    ".jpg");
+  }
+  std::printf("sort %zu names\n", names.size());
+  std::vector<std::string> copy = names;
+  start = Clock::now();
+  std::sort(copy.begin(), copy.end(),
+            [](const std::string &a, const std::string &b) {
+              return strverscmp(a.c_str(), b.c_str()) < 0;
+            });
+  base = elapsed_ms(start);
+  std::printf("  %-24s %10.2f ms\n", "strverscmp", base);
+
+  for (std::size_t threads : {1, 0}) {
+    copy = names;
+    start = Clock::now();
+    sort_natural(copy, threads);
+    double ms = elapsed_ms(start);
+    std::printf("  %-24s %10.2f ms  (%.2fx)\n",
+                threads == 1 ? "sort_natural x1" : "sort_natural", ms,
+                base / ms);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string root;
+  bool generated = argc < 2;
+  if (generated) {
+    root = "bench_tree";
+    remove_path(root);
+    std::printf("generating %s ...\n", root.c_str());
+    make_bench_tree(root, 4, 8, 20);
+  } else {
+    root = argv[1];
+  }
+
+  bench_path_walk(root);
+  bench_walkdir(root);
+  bench_glob(root);
+  bench_tree_usage(root);
+  bench_stat_cache(root);
+  bench_directory_index(root);
+  bench_snapshot(root);
+
+  if (generated) {
+    bench_remove(root);
+  }
+
+  std::string small_dir = "bench_small_files";
+  std::vector<std::string> small_files = make_small_files(small_dir, 20000, 4096);
+  bench_read_files(small_files);
+  bench_sniff(small_files);
+  bench_walk_and_read(small_dir);
+  bench_duplicates(small_dir);
+  bench_copy(small_dir);
+  bench_list_dir(small_dir);
+  remove_path(small_dir);
+
+  bench_write_files("bench_write");
+  bench_valid_filepath("bench_output");
+  bench_output_layout("bench_output");
+  bench_classify();
+  bench_path_view();
+  bench_normpath();
+  return 0;
+}
@@ -1,6 +1,13 @@
 #include "gtest/gtest.h"
 
-#include "fs_utils.h"
+#include "fs_utils.hpp"
+
+// 定义在 shared_state_test.cpp 中
+bool dir_cached_in_other_tu(const std::string &path);
+FileCategory classify_file_in_other_tu(const std::string &name);
+#ifndef _WIN32
+bool stat_cache_enabled_in_other_tu();
+#endif
 
 TEST(fs_utils, path_join) {
 // 非 Windows 系统下的测试用例
@@ -22,6 +29,10 @@ TEST(fs_utils, path_join) {
   EXPECT_EQ(path_join("/", "foo"), "/foo");
   EXPECT_EQ(path_join("foo", ""), "foo/");
   EXPECT_EQ(path_join("", ""), "");
+  std::string dir = "/data";
+  EXPECT_EQ(path_join(dir, PathView("a/b/c").basename(), std::string("d")),
+            "/data/c/d");
+  EXPECT_EQ(path_join({dir, "x"}), "/data/x");
 #endif
 
 // Windows 系统下的测试用例 (未测试)
@@ -69,6 +80,43 @@ TEST(fs_utils, MultiLevelDirTest) {
   ASSERT_TRUE(is_dir(dir_name));
   remove_path(dir_name);
   ASSERT_FALSE(path_exists(dir_name));
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, makedirs_cached) {
+#ifdef _WIN32
+  const std::string dir_name = "test_dir\\a\\b";
+#else
+  const std::string dir_name = "test_dir/a//b/";
+#endif
+  dir_cache().clear();
+  ASSERT_TRUE(makedirs_cached(dir_name));
+  EXPECT_TRUE(is_dir(dir_name));
+  EXPECT_TRUE(dir_cache().contains(dir_name));
+  // 缓存在整个进程内共享，其他翻译单元看到同一份
+  EXPECT_TRUE(dir_cached_in_other_tu(dir_name));
+  EXPECT_TRUE(makedirs_cached(dir_name));
+  EXPECT_EQ(dir_cache().size(), 1u);
+
+  // 删除目录后缓存失效，需要重新创建
+  remove_path("test_dir");
+  EXPECT_FALSE(dir_cache().contains(dir_name));
+  EXPECT_FALSE(dir_cached_in_other_tu(dir_name));
+  std::string file = valid_filepath(path_join("test_dir", "c", "file.txt"));
+  EXPECT_TRUE(is_dir(dirname(file)));
+  EXPECT_TRUE(dir_cache().contains(dirname(file)));
+
+  std::ofstream("test_dir/not_a_dir");
+  EXPECT_FALSE(makedirs("test_dir/not_a_dir/sub"));
+  EXPECT_FALSE(makedirs(""));
+  // 同名普通文件不能当作目录缓存；删除文件不影响已缓存的目录
+  EXPECT_FALSE(makedirs_cached("test_dir/not_a_dir"));
+  EXPECT_FALSE(dir_cache().contains("test_dir/not_a_dir"));
+  EXPECT_TRUE(remove_path("test_dir/not_a_dir"));
+  EXPECT_TRUE(dir_cache().contains(dirname(file)));
+
+  remove_path("test_dir");
+  EXPECT_EQ(dir_cache().size(), 0u);
 }
 
 TEST(fs_utils, is_file) {
@@ -88,6 +136,74 @@ TEST(fs_utils, is_file) {
 #endif
 }
 
+#ifndef _WIN32
+TEST(fs_utils, StatCache) {
+  makedirs("test_dir");
+  auto cache = enable_stat_cache();
+  EXPECT_TRUE(stat_cache_enabled_in_other_tu());
+  EXPECT_FALSE(is_file("test_dir/file.txt"));
+  EXPECT_FALSE(path_exists("test_dir/file.txt"));
+  EXPECT_EQ(cache->misses(), 1u);
+  EXPECT_EQ(cache->hits(), 1u);
+  EXPECT_TRUE(is_dir("test_dir"));
+
+  // 文件变化通过 inotify 使缓存失效
+  std::ofstream("test_dir/file.txt") << "12345";
+  auto wait_for = [](const std::function<bool()> &cond) {
+    for (int i = 0; i < 200 && !cond(); ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return cond();
+  };
+  if (cache->watching()) {
+    EXPECT_TRUE(wait_for([] { return is_file("test_dir/file.txt"); }));
+    EXPECT_TRUE(wait_for([] { return getsize("test_dir/file.txt") == 5; }));
+    uint64_t hits = cache->hits();
+    EXPECT_EQ(getsize("test_dir/file.txt"), 5u);
+    EXPECT_EQ(cache->hits(), hits + 1);
+    remove_path("test_dir/file.txt");
+    EXPECT_TRUE(wait_for([] { return !path_exists("test_dir/file.txt"); }));
+
+    // 最后一个缓存的文件名失效后，监视随之移除
+    StatCache local;
+    struct stat st;
+    local.stat("test_dir/a", st);
+    local.stat("test_dir/b", st);
+    EXPECT_EQ(local.watch_count(), 1u);
+    local.invalidate("test_dir/a");
+    EXPECT_EQ(local.watch_count(), 1u);
+    local.invalidate("test_dir/b");
+    EXPECT_EQ(local.watch_count(), 0u);
+
+    // 缓存已满时先清空再加监视，新条目仍能被 inotify 失效
+    StatCache small(std::chrono::milliseconds(5000), true, 2);
+    EXPECT_EQ(small.stat("test_dir/a", st), ENOENT);
+    EXPECT_EQ(small.stat("test_dir/b", st), ENOENT);
+    EXPECT_EQ(small.stat("test_dir/c", st), ENOENT);
+    EXPECT_EQ(small.watch_count(), 1u);
+    std::ofstream("test_dir/c");
+    EXPECT_TRUE(wait_for([&] { return small.stat("test_dir/c", st) == 0; }));
+    remove_path("test_dir/c");
+  }
+
+  // 仅依赖 TTL
+  cache = enable_stat_cache(std::chrono::milliseconds(50), false);
+  EXPECT_FALSE(cache->watching());
+  EXPECT_FALSE(is_file("test_dir/file2.txt"));
+  std::ofstream("test_dir/file2.txt");
+  EXPECT_FALSE(is_file("test_dir/file2.txt"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(60));
+  EXPECT_TRUE(is_file("test_dir/file2.txt"));
+  cache->invalidate("test_dir/file2.txt");
+  remove_path("test_dir/file2.txt");
+  EXPECT_FALSE(is_file("test_dir/file2.txt"));
+
+  disable_stat_cache();
+  EXPECT_EQ(stat_cache(), nullptr);
+  remove_path("test_dir");
+}
+#endif
+
 TEST(fs_utils, list_dir) {
   // Create a temporary directory
   std::string dir_path = "test_dir";
@@ -116,6 +232,62 @@ TEST(fs_utils, list_dir) {
   remove_path(dir_path);
 }
 
+TEST(fs_utils, list_dir_order) {
+  makedirs("test_dir/sub");
+  std::vector<std::string> names = {"frame1.jpg",  "frame2.jpg", "frame10.jpg",
+                                    "frame9.txt",  "frame100.jpg", "a.jpg",
+                                    "b10c2.jpg",   "b10c10.jpg", "b9.jpg",
+                                    "2024.jpg",    "0.jpg"};
+  for (const auto &name : names) {
+    std::ofstream(path_join("test_dir", name));
+  }
+
+  std::vector<std::string> version = list_dir("test_dir");
+  ASSERT_EQ(version.size(), names.size());
+  EXPECT_EQ(list_dir("test_dir", ListOrder::Natural), version);
+  std::vector<std::string> unordered =
+      list_dir("test_dir", ListOrder::Unordered);
+  EXPECT_EQ(std::set<std::string>(unordered.begin(), unordered.end()),
+            std::set<std::string>(names.begin(), names.end()));
+  std::vector<std::string> jpgs =
+      list_dir("test_dir", {"jpg"}, ListOrder::Natural);
+  EXPECT_EQ(jpgs.size(), names.size() - 1);
+  EXPECT_EQ(jpgs.front(), "0.jpg");
+  EXPECT_EQ(jpgs.back(), "frame100.jpg");
+  remove_path("test_dir");
+
+  // 大列表的并行排序与 strverscmp 顺序一致
+  std::vector<std::string> many;
+  for (int i = 0; i < 100000; ++i) {
+    many.push_back("cam" + std::to_string(i % 7) + "_" +
+                   std::to_string((i * 7919) % 100000) + ".jpg");
+  }
+  std::vector<std::string> expected = many;
+  std::sort(expected.begin(), expected.end(),
+            [](const std::string &a, const std::string &b) {
+              return strverscmp(a.c_str(), b.c_str()) < 0;
+            });
+  sort_natural(many, 4);
+  EXPECT_EQ(many, expected);
+
+  std::string a, b;
+  natural_sort_key("x007", a);
+  natural_sort_key("x7", b);
+  EXPECT_EQ(a, b);
+
+  std::vector<int> numbers;
+  for (int i = 0; i < 1000; ++i) {
+    numbers.push_back((i * 7919) % 1013);
+  }
+  std::vector<int> sorted = numbers;
+  std::sort(sorted.begin(), sorted.end());
+  for (std::size_t threads : {1, 3, 8}) {
+    std::vector<int> copy = numbers;
+    parallel_sort(copy.begin(), copy.end(), std::less<int>(), threads, 10);
+    EXPECT_EQ(copy, sorted);
+  }
+}
+
 TEST(fs_utils, normpath) {
 #ifndef _WIN32
   // Test empty path
@@ -141,6 +313,24 @@ TEST(fs_utils, normpath) {
   // Test path with mixed dots and double dots
   EXPECT_EQ(normpath("./foo/../bar/./baz/../qux"), "bar/qux");
 
+  // Test absolute paths and up-level references that cannot be collapsed
+  EXPECT_EQ(normpath("/"), "/");
+  EXPECT_EQ(normpath("//foo///bar//"), "/foo/bar");
+  EXPECT_EQ(normpath("/foo/../.."), "/..");
+  EXPECT_EQ(normpath("../foo/../../bar"), "../../bar");
+  EXPECT_EQ(normpath("foo/bar/../../baz/."), "baz");
+  EXPECT_EQ(normpath(std::string("a/./b/../c")), "a/c");
+  EXPECT_EQ(normpath(PathView("x/y/z").dirname()), "x/y");
+
+  std::string path = "/data//cam1/./frames/../video.mp4";
+  const char *data = path.data();
+  normpath_inplace(path);
+  EXPECT_EQ(path, "/data/cam1/video.mp4");
+  EXPECT_EQ(path.data(), data);
+  path = ".";
+  normpath_inplace(path);
+  EXPECT_EQ(path, ".");
+
   // Test path with backslashes on Windows
 #else
   EXPECT_EQ(normpath("foo\\bar\\baz"), "foo\\bar\\baz");
@@ -280,6 +470,64 @@ TEST(fs_utils, remove_file_ext) {
   EXPECT_EQ(remove_file_ext("doc.docx"), "doc");
 }
 
+TEST(fs_utils, PathView) {
+  std::string path = "/data/cam1/frame.0001.JPG";
+  PathView view(path);
+  // 结果都指向原字符串
+  EXPECT_EQ(view.basename().data(), path.data() + 11);
+  EXPECT_EQ(view.basename(), "frame.0001.JPG");
+  EXPECT_EQ(view.dirname(), "/data/cam1");
+  EXPECT_EQ(view.ext(), "JPG");
+  EXPECT_EQ(view.stem(), "/data/cam1/frame.0001");
+  EXPECT_EQ(view.split().first, "/data/cam1");
+  EXPECT_EQ(view.split().second, "frame.0001.JPG");
+  EXPECT_EQ(view.splitext().second, ".JPG");
+  EXPECT_EQ(view.basename().dirname(), ".");
+  EXPECT_EQ(PathView("/").dirname(), "/");
+  EXPECT_EQ(PathView("/").basename(), "/");
+  EXPECT_EQ(PathView("/usr").dirname(), "/");
+  EXPECT_EQ(PathView(".bashrc").ext(), "");
+  EXPECT_TRUE(PathView().empty());
+  EXPECT_EQ(view.substr(1, 4).str(), "data");
+  EXPECT_EQ(view.substr(100), "");
+
+  std::ostringstream oss;
+  oss << view.basename();
+  EXPECT_EQ(oss.str(), "frame.0001.JPG");
+#if __cplusplus >= 201703L
+  std::string_view sv = view.dirname();
+  EXPECT_EQ(sv, "/data/cam1");
+  EXPECT_EQ(PathView(sv).basename(), "cam1");
+#endif
+}
+
+using WalkResult = std::vector<
+    std::tuple<std::string, std::vector<std::string>, std::vector<std::string>>>;
+
+// readdir 返回的顺序与文件系统有关，比较前统一排序
+static WalkResult sorted_walk(WalkResult walk) {
+  for (auto &item : walk) {
+    std::sort(std::get<1>(item).begin(), std::get<1>(item).end());
+    std::sort(std::get<2>(item).begin(), std::get<2>(item).end());
+  }
+  std::sort(walk.begin(), walk.end());
+  return walk;
+}
+
+// 构建 path_walk 系列测试使用的目录树
+static void make_walk_tree(const WalkResult &tree) {
+  for (auto const &iter : tree) {
+    auto const &dir = std::get<0>(iter);
+    makedirs(dir);
+    for (auto const &subdir : std::get<1>(iter)) {
+      makedirs(path_join(dir, subdir));
+    }
+    for (auto const &file : std::get<2>(iter)) {
+      std::ofstream(path_join(dir, file));
+    }
+  }
+}
+
 TEST(fs_utils, path_walk) {
   std::vector<std::tuple<std::string, std::vector<std::string>,
                          std::vector<std::string>>> const expected{
@@ -304,7 +552,7 @@ TEST(fs_utils, path_walk) {
 
   auto result = path_walk("test_dir");
 
-  EXPECT_EQ(result, expected);
+  EXPECT_EQ(sorted_walk(result), sorted_walk(expected));
 
   walkdir("test_dir",
           [](std::string const &path) { std::cout << path << std::endl; });
@@ -313,8 +561,736 @@ TEST(fs_utils, path_walk) {
   remove_path("test_dir");
 }
 
+TEST(fs_utils, path_walk_parallel) {
+  WalkResult const tree{
+      {"test_dir", {"sub3", "sub1"}, {"file.txt"}},
+      {"test_dir/sub3", {}, {"file4.txt"}},
+      {"test_dir/sub1", {"sub2"}, {"file2.txt"}},
+      {"test_dir/sub1/sub2", {}, {"file3.txt"}},
+  };
+  make_walk_tree(tree);
+
+  auto serial = path_walk("test_dir");
+  for (std::size_t threads : {1, 2, 4}) {
+    EXPECT_EQ(path_walk_parallel("test_dir", threads), serial);
+    EXPECT_EQ(sorted_walk(path_walk_parallel("test_dir", threads, false)),
+              sorted_walk(serial));
+  }
+  EXPECT_TRUE(path_walk_parallel("non_existing_dir", 2).empty());
+
+  std::vector<std::string> expected_files;
+  walkdir("test_dir", [&](std::string const &path) {
+    expected_files.push_back(path);
+  });
+  std::mutex mtx;
+  std::vector<std::string> files;
+  walkdir_parallel(
+      "test_dir",
+      [&](std::string const &path) {
+        std::lock_guard<std::mutex> lock(mtx);
+        files.push_back(path);
+      },
+      4);
+  std::sort(expected_files.begin(), expected_files.end());
+  std::sort(files.begin(), files.end());
+  EXPECT_EQ(files, expected_files);
+
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, StringArena) {
+  StringArena arena;
+  EXPECT_TRUE(arena.empty());
+  EXPECT_EQ(arena.add("foo"), 0u);
+  EXPECT_EQ(arena.add(""), 1u);
+  EXPECT_EQ(arena.add(std::string("bar.txt")), 2u);
+  ASSERT_EQ(arena.size(), 3u);
+  EXPECT_EQ(arena[0], "foo");
+  EXPECT_EQ(arena[1], "");
+  EXPECT_EQ(arena[2], "bar.txt");
+  EXPECT_STREQ(arena[0].data(), "foo");
+  arena.clear();
+  EXPECT_TRUE(arena.empty());
+}
+
+#ifndef _WIN32
+TEST(fs_utils, path_walk_tree) {
+  WalkResult const tree{
+      {"test_dir", {"sub3", "sub1"}, {"file.txt"}},
+      {"test_dir/sub3", {}, {"file4.txt"}},
+      {"test_dir/sub1", {"sub2"}, {"file2.txt"}},
+      {"test_dir/sub1/sub2", {}, {"file3.txt"}},
+  };
+  make_walk_tree(tree);
+
+  PathTree result = path_walk_tree("test_dir");
+  ASSERT_EQ(result.size(), 8u);
+  EXPECT_EQ(result.path(0), "test_dir");
+  EXPECT_EQ(result.parent(0), PathTree::none);
+  std::vector<std::string> dirs;
+  std::vector<std::string> files;
+  for (PathTree::Id id = 1; id < result.size(); ++id) {
+    std::string path = result.path(id);
+    EXPECT_EQ(result.name(id), basename(path));
+    EXPECT_EQ(result.path(result.parent(id)), dirname(path));
+    (result.is_dir(id) ? dirs : files).push_back(path);
+  }
+  std::sort(dirs.begin(), dirs.end());
+  std::sort(files.begin(), files.end());
+  EXPECT_EQ(dirs, std::vector<std::string>({"test_dir/sub1",
+                                            "test_dir/sub1/sub2",
+                                            "test_dir/sub3"}));
+  EXPECT_EQ(files, std::vector<std::string>({"test_dir/file.txt",
+                                             "test_dir/sub1/file2.txt",
+                                             "test_dir/sub1/sub2/file3.txt",
+                                             "test_dir/sub3/file4.txt"}));
+  std::string out = "prefix:";
+  result.append_path(1, out);
+  EXPECT_EQ(out, "prefix:" + result.path(1));
+  EXPECT_EQ(path_walk_tree("non_existing_dir").size(), 1u);
+  remove_path("test_dir");
+
+  makedirs("test_dir");
+  for (const char *name : {"img10.jpg", "img2.jpg", "img1.jpg", "a.txt"}) {
+    std::ofstream(path_join("test_dir", name));
+  }
+  makedirs("test_dir/img3.jpg");
+  StringArena names = list_dir_arena("test_dir");
+  std::vector<std::string> listed = list_dir("test_dir");
+  ASSERT_EQ(names.size(), listed.size());
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    EXPECT_EQ(names[i], listed[i]);
+  }
+  names = list_dir_arena("test_dir", [](PathView name) {
+    return name.ext() == "jpg";
+  });
+  ASSERT_EQ(names.size(), 3u);
+  EXPECT_EQ(names[0], "img1.jpg");
+  EXPECT_EQ(names[2], "img10.jpg");
+  remove_path("test_dir");
+}
+
+#endif
+
+TEST(fs_utils, GlobPattern) {
+  EXPECT_TRUE(GlobPattern::match_name("*.jpg", "a.jpg"));
+  EXPECT_TRUE(GlobPattern::match_name("*.jpg", ".jpg"));
+  EXPECT_FALSE(GlobPattern::match_name("*.jpg", "a.jpeg"));
+  EXPECT_TRUE(GlobPattern::match_name("cam?", "cam1"));
+  EXPECT_FALSE(GlobPattern::match_name("cam?", "cam12"));
+  EXPECT_TRUE(GlobPattern::match_name("a*b*c", "aXbYbZc"));
+  EXPECT_TRUE(GlobPattern::match_name("[a-c]x[!0-9]", "bxy"));
+  EXPECT_FALSE(GlobPattern::match_name("[a-c]x[!0-9]", "bx1"));
+  EXPECT_TRUE(GlobPattern::match_name("[]]", "]"));
+  EXPECT_TRUE(GlobPattern::match_name("[abc", "[abc"));
+  EXPECT_TRUE(GlobPattern::match_name("\\*", "*"));
+  EXPECT_FALSE(GlobPattern::match_name("\\*", "a"));
+
+  GlobPattern pattern("data/**/2024-*/cam?/*.{jpg,png}");
+  EXPECT_TRUE(pattern.match("data/2024-01/cam1/a.jpg"));
+  EXPECT_TRUE(pattern.match("data/x/y/2024-12/cam2/b.png"));
+  EXPECT_TRUE(pattern.match("./data/2024-01//cam1/a.jpg"));
+  EXPECT_FALSE(pattern.match("data/2024-01/cam1/a.txt"));
+  EXPECT_FALSE(pattern.match("data/2023-01/cam1/a.jpg"));
+  EXPECT_FALSE(pattern.match("other/2024-01/cam1/a.jpg"));
+  EXPECT_FALSE(pattern.match("data/2024-01/cam1"));
+
+  EXPECT_TRUE(GlobPattern("**").match("a/b/c"));
+  EXPECT_TRUE(GlobPattern("a/**").match("a/b"));
+  EXPECT_TRUE(GlobPattern("{a/b,c}/d").match("a/b/d"));
+  EXPECT_TRUE(GlobPattern("{a/b,c}/d").match("c/d"));
+  EXPECT_TRUE(GlobPattern("x{1,{2,3}}").match("x3"));
+  EXPECT_TRUE(GlobPattern("{a}").match("{a}"));
+  EXPECT_EQ(GlobPattern("*.txt").pattern(), "*.txt");
+}
+
+#ifndef _WIN32
+TEST(fs_utils, glob_walk) {
+  for (const char *dir :
+       {"test_dir/data/2024-01/cam1", "test_dir/data/2024-01/cam22",
+        "test_dir/data/x/2024-02/cam2", "test_dir/data/2023-01/cam1",
+        "test_dir/other/2024-01/cam1"}) {
+    makedirs(dir);
+    std::ofstream(path_join(dir, "a.jpg"));
+    std::ofstream(path_join(dir, "b.txt"));
+  }
+
+  GlobPattern pattern("data/**/2024-*/cam?/*.jpg");
+  std::vector<std::string> files;
+  walkdir("test_dir", pattern,
+          [&](const std::string &path) { files.push_back(path); });
+  std::sort(files.begin(), files.end());
+  EXPECT_EQ(files, std::vector<std::string>(
+                       {"test_dir/data/2024-01/cam1/a.jpg",
+                        "test_dir/data/x/2024-02/cam2/a.jpg"}));
+
+  // data 以外的目录都不应被打开
+  std::set<std::string> opened;
+  auto record = [&](const WalkEntry &entry) { opened.insert(entry.path()); };
+  auto ignore = [](const WalkEntry &) { return WalkAction::Continue; };
+  glob_walk("test_dir", pattern, ignore, record);
+  EXPECT_EQ(opened.size(), 9u);
+  EXPECT_EQ(opened.count("test_dir/other"), 0u);
+
+  // 没有 ** 时只打开匹配的目录
+  opened.clear();
+  glob_walk("test_dir", GlobPattern("data/2024-*/cam?/*.jpg"), ignore, record);
+  EXPECT_EQ(opened, std::set<std::string>({"test_dir/data",
+                                           "test_dir/data/2024-01",
+                                           "test_dir/data/2024-01/cam1"}));
+
+  // 全部为固定名称时直接查找，不列目录
+  opened.clear();
+  files.clear();
+  glob_walk(
+      "test_dir", GlobPattern("data/2024-01/cam1/{a.jpg,missing.jpg}"),
+      [&](const WalkEntry &entry) {
+        files.push_back(entry.path());
+        return WalkAction::Continue;
+      },
+      [&](const WalkEntry &entry) { opened.insert(entry.path()); });
+  EXPECT_EQ(files, std::vector<std::string>(
+                       {"test_dir/data/2024-01/cam1/a.jpg"}));
+  EXPECT_EQ(opened.size(), 3u);
+
+  auto walk = path_walk("test_dir", GlobPattern("data/*/cam1/*.txt"));
+  EXPECT_EQ(sorted_walk(walk),
+            sorted_walk(WalkResult{
+                {"test_dir", {"data"}, {}},
+                {"test_dir/data", {"2024-01", "x", "2023-01"}, {}},
+                {"test_dir/data/2024-01", {"cam1"}, {}},
+                {"test_dir/data/2024-01/cam1", {}, {"b.txt"}},
+                {"test_dir/data/x", {}, {}},
+                {"test_dir/data/2023-01", {"cam1"}, {}},
+                {"test_dir/data/2023-01/cam1", {}, {"b.txt"}},
+            }));
+  EXPECT_TRUE(path_walk("non_existing_dir", GlobPattern("*")).empty());
+
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, tree_usage) {
+  makedirs("test_dir/a/b");
+  std::ofstream("test_dir/x.JPG") << std::string(1000, 'x');
+  std::ofstream("test_dir/a/y.jpg") << std::string(3000, 'y');
+  std::ofstream("test_dir/a/b/z.longextension") << std::string(10, 'z');
+  std::ofstream("test_dir/a/b/README");
+  ASSERT_EQ(link("test_dir/a/y.jpg", "test_dir/a/b/y_link.jpg"), 0);
+  ASSERT_EQ(symlink("x.JPG", "test_dir/link"), 0);
+
+  for (std::size_t threads : {1, 4}) {
+    TreeUsageOptions options;
+    options.num_threads = threads;
+    TreeUsage usage = tree_usage("test_dir", options);
+    EXPECT_EQ(usage.files, 4u);
+    EXPECT_EQ(usage.dirs, 3u);
+    EXPECT_EQ(usage.others, 1u);
+    EXPECT_EQ(usage.hard_links, 1u);
+    EXPECT_EQ(usage.failed, 0u);
+    EXPECT_GE(usage.apparent_bytes, 4010u);
+    EXPECT_GT(usage.allocated_bytes, 0u);
+    ASSERT_EQ(usage.by_ext.size(), 3u);
+    EXPECT_EQ(usage.by_ext["jpg"].files, 2u);
+    EXPECT_EQ(usage.by_ext["jpg"].apparent_bytes, 4000u);
+    EXPECT_EQ(usage.by_ext["longextension"].apparent_bytes, 10u);
+    EXPECT_EQ(usage.by_ext[""].files, 1u);
+  }
+
+  TreeUsageOptions options;
+  options.dedupe_hard_links = false;
+  options.by_extension = false;
+  TreeUsage usage = tree_usage("test_dir", options);
+  EXPECT_EQ(usage.files, 5u);
+  EXPECT_EQ(usage.hard_links, 0u);
+  EXPECT_TRUE(usage.by_ext.empty());
+
+  usage = tree_usage("test_dir/x.JPG");
+  EXPECT_EQ(usage.files, 1u);
+  EXPECT_EQ(usage.apparent_bytes, 1000u);
+  usage = tree_usage("non_existing_dir");
+  EXPECT_EQ(usage.failed, 1u);
+  EXPECT_EQ(usage.first_error, ENOENT);
+
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, xxh64) {
+  EXPECT_EQ(xxh64("", 0), 0xEF46DB3751D8E999ull);
+  EXPECT_EQ(xxh64("a", 1), 0xD24EC4F1A98C6E5Bull);
+  std::string data;
+  for (int i = 0; i < 1000; ++i) {
+    data += static_cast<char>(i * 31);
+  }
+  // 分块更新与一次性计算结果一致
+  for (std::size_t chunk : {1, 7, 32, 100}) {
+    Xxh64 hasher(42);
+    for (std::size_t i = 0; i < data.size(); i += chunk) {
+      hasher.update(data.data() + i, std::min(chunk, data.size() - i));
+    }
+    EXPECT_EQ(hasher.digest(), xxh64(data.data(), data.size(), 42));
+  }
+  EXPECT_NE(xxh64(data.data(), data.size()), xxh64(data.data(), 999));
+
+  makedirs("test_dir");
+  std::ofstream("test_dir/data.bin", std::ios::binary) << data;
+  uint64_t hash = 0;
+  EXPECT_EQ(hash_file("test_dir/data.bin", hash), 0);
+  EXPECT_EQ(hash, xxh64(data.data(), data.size()));
+  EXPECT_EQ(hash_file("test_dir/missing", hash), ENOENT);
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, find_duplicates) {
+  makedirs("test_dir/a/b");
+  std::string big(300000, 'x');
+  std::string big_middle = big;
+  big_middle[150000] = 'y';  // 头尾相同，只有完整哈希能区分
+  std::ofstream("test_dir/big1", std::ios::binary) << big;
+  std::ofstream("test_dir/a/big2", std::ios::binary) << big;
+  std::ofstream("test_dir/a/b/big3", std::ios::binary) << big_middle;
+  std::ofstream("test_dir/small1") << "hello";
+  std::ofstream("test_dir/a/b/small2") << "hello";
+  std::ofstream("test_dir/a/small3") << "world";
+  std::ofstream("test_dir/unique") << "unique size";
+  std::ofstream("test_dir/empty1");
+  std::ofstream("test_dir/empty2");
+  ASSERT_EQ(link("test_dir/small1", "test_dir/a/small_link"), 0);
+
+  for (std::size_t partial : {0, 1024, 64 * 1024}) {
+    DuplicateOptions options;
+    options.num_threads = 4;
+    options.partial_size = partial;
+    DuplicateReport report = find_duplicates("test_dir", options);
+    EXPECT_EQ(report.files, 8u);
+    EXPECT_EQ(report.size_matches, 6u);
+    EXPECT_EQ(report.failed, 0u);
+    ASSERT_EQ(report.groups.size(), 2u);
+    EXPECT_EQ(report.groups[0].size, big.size());
+    EXPECT_EQ(report.groups[0].hash, xxh64(big.data(), big.size()));
+    std::set<std::string> paths(report.groups[0].paths.begin(),
+                                report.groups[0].paths.end());
+    EXPECT_EQ(paths, std::set<std::string>({"test_dir/big1", "test_dir/a/big2"}));
+    EXPECT_EQ(report.groups[1].size, 5u);
+    ASSERT_EQ(report.groups[1].paths.size(), 2u);
+  }
+
+  DuplicateOptions options;
+  options.min_size = 0;
+  DuplicateReport report = find_duplicates("test_dir", options);
+  ASSERT_EQ(report.groups.size(), 3u);
+  EXPECT_EQ(report.groups[2].size, 0u);
+
+  EXPECT_TRUE(find_duplicates("non_existing_dir").groups.empty());
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, copy_tree) {
+  makedirs("test_dir/src/a/b");
+  makedirs("test_dir/src/empty");
+  std::string big(3 * 1024 * 1024 + 17, 'x');
+  std::ofstream("test_dir/src/big.bin", std::ios::binary) << big;
+  std::ofstream("test_dir/src/a/small.txt") << "hello";
+  std::ofstream("test_dir/src/a/b/zero");
+  ASSERT_EQ(chmod("test_dir/src/a/small.txt", 0640), 0);
+  ASSERT_EQ(symlink("a/small.txt", "test_dir/src/link"), 0);
+
+  CopyOptions options;
+  options.num_threads = 4;
+  CopyStats stats = copy_tree("test_dir/src", "test_dir/dst", options);
+  EXPECT_EQ(stats.files, 3u);
+  EXPECT_EQ(stats.dirs, 4u);
+  EXPECT_EQ(stats.symlinks, 1u);
+  EXPECT_EQ(stats.skipped, 0u);
+  EXPECT_EQ(stats.failed, 0u);
+  EXPECT_EQ(stats.bytes, big.size() + 5);
+  EXPECT_EQ(read_file("test_dir/dst/big.bin"), big);
+  EXPECT_EQ(read_file("test_dir/dst/a/small.txt"), "hello");
+  EXPECT_TRUE(is_file("test_dir/dst/a/b/zero"));
+  EXPECT_TRUE(is_dir("test_dir/dst/empty"));
+  char target[64] = {};
+  ASSERT_GT(readlink("test_dir/dst/link", target, sizeof(target) - 1), 0);
+  EXPECT_STREQ(target, "a/small.txt");
+
+  struct stat src_st, dst_st;
+  ASSERT_EQ(stat("test_dir/src/a/small.txt", &src_st), 0);
+  ASSERT_EQ(stat("test_dir/dst/a/small.txt", &dst_st), 0);
+  EXPECT_EQ(dst_st.st_mode & 07777, 0640u);
+  EXPECT_EQ(dst_st.st_mtim.tv_sec, src_st.st_mtim.tv_sec);
+  EXPECT_EQ(dst_st.st_mtim.tv_nsec, src_st.st_mtim.tv_nsec);
+
+  // 增量复制只复制大小或修改时间变化的文件
+  std::ofstream("test_dir/src/a/small.txt") << "world";
+  options.skip_unchanged = true;
+  stats = copy_tree("test_dir/src", "test_dir/dst", options);
+  EXPECT_EQ(stats.files, 1u);
+  EXPECT_EQ(stats.skipped, 2u);
+  EXPECT_EQ(stats.failed, 0u);
+  EXPECT_EQ(read_file("test_dir/dst/a/small.txt"), "world");
+
+  CopyMethod method;
+  options.reflink = false;
+  EXPECT_EQ(copy_file("test_dir/src/big.bin", "test_dir/copy.bin", options,
+                      &method),
+            0);
+  EXPECT_NE(method, CopyMethod::None);
+  EXPECT_NE(method, CopyMethod::Reflink);
+  EXPECT_EQ(read_file("test_dir/copy.bin"), big);
+  EXPECT_EQ(copy_file("test_dir/missing", "test_dir/copy.bin"), ENOENT);
+  EXPECT_EQ(copy_file("test_dir/src", "test_dir/copy.bin"), EINVAL);
+  // sysfs 文件上 copy_file_range() 在偏移 0 处返回 0，应换用其他方式
+  const std::string sysfs_file = "/sys/devices/system/cpu/online";
+  if (is_file(sysfs_file)) {
+    EXPECT_EQ(copy_file(sysfs_file, "test_dir/online", options, &method), 0);
+    EXPECT_NE(method, CopyMethod::CopyFileRange);
+    EXPECT_FALSE(read_file("test_dir/online").empty());
+  }
+  stats = copy_tree("test_dir/missing", "test_dir/dst2");
+  EXPECT_EQ(stats.failed, 1u);
+  EXPECT_EQ(stats.first_error, ENOENT);
+
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, write_file) {
+  makedirs("test_dir");
+  std::string data(200000, 'a');
+  EXPECT_EQ(write_file("test_dir/plain.txt", data), 0);
+  EXPECT_EQ(read_file("test_dir/plain.txt"), data);
+  EXPECT_EQ(write_file("test_dir/plain.txt", std::string("short")), 0);
+  EXPECT_EQ(read_file("test_dir/plain.txt"), "short");
+
+  EXPECT_EQ(write_file_atomic("test_dir/atomic.txt", std::string("v1")), 0);
+  EXPECT_EQ(read_file("test_dir/atomic.txt"), "v1");
+  EXPECT_EQ(write_file_atomic("test_dir/atomic.txt", data, false), 0);
+  EXPECT_EQ(read_file("test_dir/atomic.txt"), data);
+  EXPECT_EQ(write_file("test_dir/missing/x.txt", data), ENOENT);
+
+  // 调用方提供的小缓冲区，混合大小写入
+  char buffer[16];
+  WriteOptions options;
+  options.atomic = true;
+  options.buffer = buffer;
+  options.buffer_size = sizeof(buffer);
+  std::string expected;
+  {
+    FileWriter writer("test_dir/atomic.txt", options);
+    ASSERT_TRUE(writer.is_open());
+    for (int i = 0; i < 100; ++i) {
+      std::string part(static_cast<std::size_t>(i % 37), 'a' + i % 26);
+      EXPECT_EQ(writer.write(part), 0);
+      expected += part;
+    }
+    // 未提交时原文件保持不变
+    EXPECT_EQ(read_file("test_dir/atomic.txt"), data);
+    FileWriter moved = std::move(writer);
+    EXPECT_EQ(moved.commit(), 0);
+  }
+  EXPECT_EQ(read_file("test_dir/atomic.txt"), expected);
+  {
+    FileWriter writer("test_dir/atomic.txt", options);
+    writer.write(std::string("discarded"));
+  }
+  EXPECT_EQ(read_file("test_dir/atomic.txt"), expected);
+  // 不留下临时文件
+  EXPECT_EQ(list_dir("test_dir").size(), 2u);
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, WriteBatch) {
+  for (SyncMethod method : {SyncMethod::Fdatasync, SyncMethod::Syncfs}) {
+    remove_path("test_dir");
+    makedirs("test_dir/a");
+    makedirs("test_dir/b");
+    std::ofstream("test_dir/a/file18.txt") << "old";
+    WriteBatchOptions options;
+    options.method = method;
+    options.max_pending = 8;
+    options.num_threads = 2;
+    WriteBatch batch(options);
+    for (int i = 0; i < 20; ++i) {
+      std::string dir = i % 2 == 0 ? "test_dir/a" : "test_dir/b";
+      EXPECT_EQ(batch.write(path_join(dir, "file" + std::to_string(i) + ".txt"),
+                            std::to_string(i)),
+                0);
+      EXPECT_LT(batch.pending(), 8u);
+    }
+    EXPECT_EQ(read_file("test_dir/a/file18.txt"), "old");
+    EXPECT_EQ(batch.commit(), 0);
+    EXPECT_EQ(batch.pending(), 0u);
+    for (int i = 0; i < 20; ++i) {
+      std::string dir = i % 2 == 0 ? "test_dir/a" : "test_dir/b";
+      EXPECT_EQ(read_file(path_join(dir, "file" + std::to_string(i) + ".txt")),
+                std::to_string(i));
+    }
+    EXPECT_EQ(list_dir("test_dir/a").size() + list_dir("test_dir/b").size(),
+              20u);
+    EXPECT_EQ(batch.write("test_dir/missing/x.txt", std::string("x")),
+              ENOENT);
+  }
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, DirReader) {
+  makedirs("test_dir/sub");
+  std::set<std::string> expected_files;
+  for (int i = 0; i < 200; ++i) {
+    std::string name = "file" + std::to_string(i) + ".txt";
+    std::ofstream(path_join("test_dir", name));
+    expected_files.insert(name);
+  }
+  ASSERT_EQ(symlink("sub", "test_dir/link"), 0);
+  expected_files.insert("link");
+
+  // 缓冲区很小时需要多次 getdents64 调用
+  for (std::size_t buffer_size : {0, 4096, 1 << 20}) {
+    DirReader reader("test_dir", buffer_size);
+    ASSERT_TRUE(reader.is_open());
+    std::set<std::string> files;
+    std::set<std::string> dirs;
+    DirReader::Entry entry;
+    while (reader.next(entry)) {
+      if (reader.type_of(entry) == DT_DIR) {
+        dirs.insert(entry.name);
+      } else {
+        files.insert(entry.name);
+      }
+    }
+    EXPECT_EQ(reader.error(), 0);
+    EXPECT_EQ(files, expected_files);
+    EXPECT_EQ(dirs, std::set<std::string>{"sub"});
+  }
+
+  DirReader missing("non_existing_dir");
+  EXPECT_FALSE(missing.is_open());
+  EXPECT_EQ(missing.error(), ENOENT);
+
+  // 符号链接不会被当作目录遍历
+  auto result = path_walk("test_dir");
+  ASSERT_EQ(result.size(), 2u);
+  EXPECT_EQ(std::get<1>(result[0]), std::vector<std::string>{"sub"});
+  EXPECT_EQ(std::get<2>(result[0]).size(), expected_files.size());
+
+  remove_path("test_dir");
+}
+#endif
+
+TEST(fs_utils, DirWalker) {
+  WalkResult const tree{
+      {"test_dir", {"sub3", "sub1"}, {"file.txt"}},
+      {"test_dir/sub3", {}, {"file4.txt"}},
+      {"test_dir/sub1", {"sub2"}, {"file2.txt"}},
+      {"test_dir/sub1/sub2", {}, {"file3.txt"}},
+  };
+  make_walk_tree(tree);
+
+  WalkResult result;
+  for (auto &item : DirWalker("test_dir")) {
+    result.push_back(item);
+  }
+  EXPECT_EQ(sorted_walk(result), sorted_walk(path_walk("test_dir")));
+  // 深度优先：子目录紧跟在父目录之后
+  for (std::size_t i = 1; i < result.size(); ++i) {
+    if (std::get<0>(result[i]) == "test_dir/sub1/sub2") {
+      EXPECT_EQ(std::get<0>(result[i - 1]), "test_dir/sub1");
+    }
+  }
+
+  // 剪枝
+  std::vector<std::string> dirs;
+  DirWalker walker("test_dir");
+  for (auto it = walker.begin(); it != walker.end(); ++it) {
+    dirs.push_back(std::get<0>(*it));
+    auto &subdirs = std::get<1>(*it);
+    subdirs.erase(std::remove(subdirs.begin(), subdirs.end(), "sub1"),
+                  subdirs.end());
+  }
+  std::sort(dirs.begin(), dirs.end());
+  EXPECT_EQ(dirs, (std::vector<std::string>{"test_dir", "test_dir/sub3"}));
+
+  DirWalker missing("non_existing_dir");
+  EXPECT_TRUE(missing.begin() == missing.end());
+
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, walk_tree) {
+  makedirs("test_dir/a/b");
+  makedirs("test_dir/skip");
+  std::ofstream("test_dir/a/b/file.txt");
+  std::ofstream("test_dir/skip/hidden.txt");
+  std::ofstream("test_dir/top.txt");
+
+  std::vector<std::string> visited;
+  std::vector<std::string> left;
+  EXPECT_TRUE(walk_tree(
+      "test_dir",
+      [&](const WalkEntry &entry) {
+        visited.push_back(entry.path() + ":" + std::to_string(entry.depth()));
+        return std::string(entry.name()) == "skip" ? WalkAction::Skip
+                                                   : WalkAction::Continue;
+      },
+      [&](const WalkEntry &entry) { left.push_back(entry.path()); }));
+  std::sort(visited.begin(), visited.end());
+  EXPECT_EQ(visited, (std::vector<std::string>{
+                         "test_dir/a/b/file.txt:2", "test_dir/a/b:1",
+                         "test_dir/a:0", "test_dir/skip:0", "test_dir/top.txt:0"}));
+  // 子目录总是先于父目录离开
+  EXPECT_EQ(left, (std::vector<std::string>{"test_dir/a/b", "test_dir/a"}));
+
+  int count = 0;
+  EXPECT_FALSE(walk_tree("test_dir", [&](const WalkEntry &) {
+    ++count;
+    return WalkAction::Stop;
+  }));
+  EXPECT_EQ(count, 1);
+  EXPECT_FALSE(walk_tree("non_existing_dir",
+                         [](const WalkEntry &) { return WalkAction::Continue; }));
+
+  remove_path("test_dir");
+}
+
+#ifndef _WIN32
+TEST(fs_utils, remove_path) {
+  makedirs("test_dir/tree/sub");
+  makedirs("test_target");
+  std::ofstream("test_dir/tree/sub/file.txt");
+  std::ofstream("test_target/keep.txt");
+  ASSERT_EQ(symlink("../../test_target", "test_dir/tree/link"), 0);
+
+  EXPECT_TRUE(remove_path("test_dir"));
+  EXPECT_FALSE(path_exists("test_dir"));
+  // 不会跟随符号链接删除链接目标
+  EXPECT_TRUE(is_file("test_target/keep.txt"));
+
+  EXPECT_TRUE(remove_path("test_target/keep.txt"));
+  EXPECT_FALSE(remove_path("test_target/keep.txt"));
+  EXPECT_TRUE(remove_path("test_target"));
+}
+#endif
+
+#ifndef _WIN32
+TEST(fs_utils, remove_tree) {
+  std::size_t expected_files = 0;
+  std::size_t expected_dirs = 1;
+  for (int i = 0; i < 10; ++i) {
+    for (int j = 0; j < 5; ++j) {
+      std::string dir = "test_dir/d" + std::to_string(i) + "/e" +
+                        std::to_string(j);
+      makedirs(dir);
+      for (int k = 0; k < 20; ++k) {
+        std::ofstream(path_join(dir, std::to_string(k)));
+        ++expected_files;
+      }
+    }
+    expected_dirs += 6;
+  }
+  makedirs("test_target");
+  std::ofstream("test_target/keep.txt");
+  ASSERT_EQ(symlink("../../test_target", "test_dir/d0/link"), 0);
+  ++expected_files;
+
+  RemoveOptions options;
+  options.num_threads = 4;
+  options.progress_interval = 100;
+  std::vector<RemoveStats> progress;
+  options.progress = [&](const RemoveStats &stats) {
+    progress.push_back(stats);
+  };
+  RemoveStats stats = remove_tree("test_dir", options);
+  EXPECT_EQ(stats.files, expected_files);
+  EXPECT_EQ(stats.dirs, expected_dirs);
+  EXPECT_EQ(stats.failed, 0u);
+  EXPECT_FALSE(path_exists("test_dir"));
+  EXPECT_TRUE(is_file("test_target/keep.txt"));
+  ASSERT_GE(progress.size(), 2u);
+  EXPECT_EQ(progress.back().files, expected_files);
+
+  stats = remove_tree("test_target/keep.txt");
+  EXPECT_EQ(stats.files, 1u);
+  stats = remove_tree("test_target");
+  EXPECT_EQ(stats.dirs, 1u);
+
+  stats = remove_tree("non_existing_dir");
+  EXPECT_EQ(stats.failed, 1u);
+  EXPECT_EQ(stats.first_error, ENOENT);
+}
+#endif
+
+TEST(fs_utils, WorkStealingPool) {
+  std::atomic<int> count{0};
+  WorkStealingPool pool(4);
+  std::function<void(int)> spawn = [&](int depth) {
+    ++count;
+    if (depth < 10) {
+      pool.submit([&spawn, depth] { spawn(depth + 1); });
+      pool.submit([&spawn, depth] { spawn(depth + 1); });
+    }
+  };
+  pool.submit([&spawn] { spawn(0); });
+  pool.wait();
+  EXPECT_EQ(count, (1 << 11) - 1);
+
+  pool.submit([] { throw std::runtime_error("task failed"); });
+  EXPECT_THROW(pool.wait(), std::runtime_error);
+}
+
 TEST(fs_utils, get_now_datetime_path) {
   std::cout << get_now_datetime_path() << std::endl;
+
+  // 与之前基于 std::put_time 的实现一致
+  std::time_t t = std::time(nullptr);
+  std::tm tm = *std::localtime(&t);
+  std::ostringstream oss;
+  std::string fmt = std::string("%Y-%m-%d") + path_separator + "%H-%M-%S";
+  oss << std::put_time(&tm, fmt.c_str());
+  EXPECT_EQ(format_datetime_path(t), oss.str());
+  EXPECT_EQ(format_datetime_path(t, false), oss.str().substr(0, 16));
+}
+
+TEST(fs_utils, OutputLayout) {
+  OutputLayoutOptions options;
+  options.shards = 16;
+  {
+    OutputLayout layout("test_dir", options);
+    std::set<std::string> shards;
+    std::string path;
+    for (int i = 0; i < 200; ++i) {
+      std::string name = "frame" + std::to_string(i) + ".jpg";
+      path = layout.path(name);
+      EXPECT_EQ(basename(path), name);
+      EXPECT_TRUE(is_dir(dirname(path)));
+      std::string shard = layout.shard_name(name);
+      EXPECT_EQ(basename(dirname(path)), shard);
+      EXPECT_EQ(shard.size(), 1u);
+      shards.insert(shard);
+    }
+    EXPECT_EQ(shards.size(), 16u);
+
+    // 下一个时间段的目录由后台线程提前创建，分片目录不提前创建；
+    // 时间取自最后一次 path() 所在的时间段
+    std::string bucket = dirname(dirname(path));
+    std::time_t t = std::time(nullptr);
+    for (int i = 0; i < 10 && layout.bucket_dir(t) != bucket; ++i) {
+      --t;
+    }
+    ASSERT_EQ(layout.bucket_dir(t), bucket);
+    std::string next = layout.bucket_dir(t + 1);
+    for (int i = 0; i < 100 && !is_dir(next); ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_TRUE(is_dir(next));
+    EXPECT_FALSE(is_dir(path_join(next, layout.shard_name("x"))));
+  }
+
+  options.bucket = TimeBucket::Minute;
+  options.shards = 0;
+  options.precreate = false;
+  OutputLayout layout("test_dir", options);
+  std::string path = layout.path("a.jpg");
+  EXPECT_TRUE(is_dir(dirname(path)));
+  EXPECT_EQ(dirname(path).size(), std::string("test_dir/2024-01-01/00-00").size());
+  EXPECT_EQ(layout.shard_name("a.jpg"), "");
+  remove_path("test_dir");
 }
 
 // TEST(fs_utils, fs_utils)
@@ -347,6 +1323,10 @@ TEST(fs_utils, is_image) {
   EXPECT_FALSE(is_image("/path/to/test.pdf"));
   EXPECT_FALSE(is_image("/path/to/test"));
   EXPECT_FALSE(is_image(""));
+  // 以点开头的隐藏文件名不带扩展名
+  EXPECT_FALSE(is_image("/path/to/.png"));
+  EXPECT_FALSE(is_image(".png"));
+  EXPECT_TRUE(is_image("/path/to/.hidden.png"));
 }
 
 TEST(fs_utils, is_video) {
@@ -363,8 +1343,120 @@ TEST(fs_utils, is_video) {
   EXPECT_FALSE(is_video("/path/to/test.pdf"));
   EXPECT_FALSE(is_video("/path/to/test"));
   EXPECT_FALSE(is_video(""));
+  EXPECT_FALSE(is_video("/path/to/.mp4"));
+  EXPECT_TRUE(is_video("/path/to/.hidden.mp4"));
+}
+
+TEST(fs_utils, classify_file) {
+  EXPECT_EQ(classify_file("a.JPG"), FileCategory::Image);
+  EXPECT_EQ(classify_file("/path/to/clip.Mp4"), FileCategory::Video);
+  EXPECT_EQ(classify_file("song.flac"), FileCategory::Audio);
+  EXPECT_EQ(classify_file(std::string("backup.tar.gz")), FileCategory::Archive);
+  EXPECT_EQ(classify_file("report.pdf"), FileCategory::Document);
+  // 只看最后一个路径分量，以点开头的文件没有扩展名
+  EXPECT_EQ(classify_file("dir.jpg/file"), FileCategory::Unknown);
+  EXPECT_EQ(classify_file("/path/.png"), FileCategory::Unknown);
+  EXPECT_EQ(classify_file(".png"), FileCategory::Unknown);
+  EXPECT_EQ(classify_file("file."), FileCategory::Unknown);
+  EXPECT_EQ(classify_file("file.abcdefghi"), FileCategory::Unknown);
+  EXPECT_TRUE(is_image("/path/to/TEST.Jpeg"));
+  EXPECT_FALSE(is_video("/path/to/test.jpg"));
+
+  FileCategory model = static_cast<FileCategory>(
+      static_cast<int>(FileCategory::User) + 1);
+  EXPECT_EQ(classify_file("net.onnx"), FileCategory::Unknown);
+  EXPECT_TRUE(register_file_ext("ONNX", model));
+  EXPECT_TRUE(register_file_ext("abcdefgh", FileCategory::Archive));
+  EXPECT_FALSE(register_file_ext("abcdefghi", model));
+  EXPECT_EQ(classify_file("net.onnx"), model);
+  EXPECT_EQ(classify_file("x.ABCDEFGH"), FileCategory::Archive);
+  // 注册表在整个进程内共享
+  EXPECT_EQ(classify_file_in_other_tu("net.onnx"), model);
 }
 
+TEST(fs_utils, sniff_file_type) {
+  const char png[] = "\x89PNG\r\n\x1A\n\0\0\0\rIHDR";
+  EXPECT_EQ(sniff_file_type(png, sizeof(png) - 1), FileCategory::Image);
+  EXPECT_STREQ(match_file_magic(png, sizeof(png) - 1)->format, "png");
+  // 签名比数据长时不匹配
+  EXPECT_EQ(sniff_file_type(png, 4), FileCategory::Unknown);
+  EXPECT_EQ(sniff_file_type("\xFF\xD8\xFF\xE0", 4), FileCategory::Image);
+  EXPECT_EQ(sniff_file_type("RIFF\x24\0\0\0WEBPVP8 ", 16), FileCategory::Image);
+  EXPECT_EQ(sniff_file_type("RIFF\x24\0\0\0AVI LIST", 16), FileCategory::Video);
+  EXPECT_EQ(sniff_file_type("\0\0\0\x20" "ftypisom", 12), FileCategory::Video);
+  EXPECT_EQ(sniff_file_type("\0\0\0\x20" "ftypavif", 12), FileCategory::Image);
+  EXPECT_EQ(sniff_file_type("\x1A\x45\xDF\xA3", 4), FileCategory::Video);
+  EXPECT_EQ(sniff_file_type("%PDF-1.7", 8), FileCategory::Document);
+  EXPECT_EQ(sniff_file_type("hello world", 11), FileCategory::Unknown);
+  EXPECT_EQ(sniff_file_type("", 0), FileCategory::Unknown);
+  // 未知的 ISO-BMFF 品牌不当作视频，HEIF 序列和有声书不是视频
+  EXPECT_EQ(sniff_file_type("\0\0\0\x20" "ftypcrx ", 12), FileCategory::Unknown);
+  EXPECT_EQ(sniff_file_type("\0\0\0\x20" "ftypmsf1", 12), FileCategory::Image);
+  EXPECT_EQ(sniff_file_type("\0\0\0\x20" "ftypM4B ", 12), FileCategory::Audio);
+  EXPECT_EQ(sniff_file_type("\0\0\0\x14" "ftypqt  ", 12), FileCategory::Video);
+  EXPECT_EQ(sniff_file_type("\0\0\x10\0" "moov", 8), FileCategory::Video);
+  EXPECT_EQ(sniff_file_type(".RMF\0\0\0\x12", 8), FileCategory::Video);
+  EXPECT_EQ(sniff_file_type("RIFF\x24\0\0\0CDXAfmt ", 16), FileCategory::Video);
+
+  std::string ts(400, '\xFF');
+  ts[0] = ts[188] = ts[376] = '\x47';
+  EXPECT_STREQ(match_file_magic(ts.data(), ts.size())->format, "mpegts");
+  std::string m2ts(400, '\xFF');
+  m2ts[4] = m2ts[196] = m2ts[388] = '\x47';
+  EXPECT_STREQ(match_file_magic(m2ts.data(), m2ts.size())->format, "m2ts");
+  ts[376] = 0;
+  EXPECT_EQ(sniff_file_type(ts.data(), ts.size()), FileCategory::Unknown);
+
+  const std::string svg =
+      "\xEF\xBB\xBF<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<!-- Created by hand -->\n<svg xmlns=\"http://www.w3.org/2000/svg\"/>";
+  EXPECT_STREQ(match_file_magic(svg.data(), svg.size())->format, "svg");
+  EXPECT_EQ(sniff_file_type("<svgfont/>", 10), FileCategory::Unknown);
+  EXPECT_EQ(sniff_file_type("text <svg>", 10), FileCategory::Unknown);
+}
+
+#ifndef _WIN32
+TEST(fs_utils, list_images_by_content) {
+  makedirs("test_dir");
+  std::ofstream("test_dir/a.jpg", std::ios::binary) << "\xFF\xD8\xFF\xE0 data";
+  std::ofstream("test_dir/b.jpg", std::ios::binary) << "<html>error</html>";
+  std::ofstream("test_dir/c", std::ios::binary) << "\x89PNG\r\n\x1A\n data";
+  std::ofstream("test_dir/d.mp4", std::ios::binary) << "\x1A\x45\xDF\xA3";
+  std::ofstream("test_dir/e.svg", std::ios::binary)
+      << "<?xml version=\"1.0\"?>\n<svg width=\"1\" height=\"1\"></svg>";
+  std::ofstream("test_dir/f.mov", std::ios::binary)
+      << std::string("\0\0\0\x08moov", 8) << std::string(64, '\0');
+  std::string ts(188 * 3, '\xFF');
+  ts[0] = ts[188] = ts[376] = '\x47';
+  std::ofstream("test_dir/g.ts", std::ios::binary) << ts;
+
+  EXPECT_EQ(list_images("test_dir", TypeCheck::Extension),
+            std::vector<std::string>({"a.jpg", "b.jpg", "e.svg"}));
+  EXPECT_EQ(list_images("test_dir", TypeCheck::Content),
+            std::vector<std::string>({"a.jpg", "c", "e.svg"}));
+  EXPECT_EQ(list_images("test_dir", TypeCheck::ExtensionAndContent),
+            std::vector<std::string>({"a.jpg", "e.svg"}));
+  EXPECT_EQ(list_videos("test_dir", TypeCheck::ExtensionAndContent),
+            std::vector<std::string>({"d.mp4", "f.mov", "g.ts"}));
+
+  std::vector<std::string> paths = {"test_dir/c", "test_dir/missing",
+                                    "test_dir"};
+  for (int i = 0; i < 200; ++i) {
+    paths.push_back("test_dir/a.jpg");
+  }
+  std::vector<FileCategory> categories = sniff_files(paths, 4);
+  ASSERT_EQ(categories.size(), paths.size());
+  EXPECT_EQ(categories[0], FileCategory::Image);
+  EXPECT_EQ(categories[1], FileCategory::Unknown);
+  EXPECT_EQ(categories[2], FileCategory::Unknown);
+  EXPECT_EQ(std::count(categories.begin(), categories.end(),
+                       FileCategory::Image),
+            201);
+
+  remove_path("test_dir");
+}
+#endif
+
 TEST(fs_utils, is_online_video) {
   EXPECT_TRUE(is_online_video("http://example.com/video.mp4"));
   EXPECT_TRUE(is_online_video("https://example.com/video.mp4"));
@@ -377,6 +1469,316 @@ TEST(fs_utils, is_online_video) {
   EXPECT_FALSE(is_online_video(""));
 }
 
+TEST(fs_utils, read_file) {
+  std::string content(300000, 'x');
+  content += "tail";
+  std::ofstream("test_read.txt", std::ios::binary) << content;
+
+  EXPECT_EQ(read_file("test_read.txt"), content);
+  EXPECT_EQ(read_file("non_existing_file.txt"), "");
+
+#ifndef _WIN32
+  std::string buffer = "stale";
+  EXPECT_EQ(read_file_into("test_read.txt", buffer), 0);
+  EXPECT_EQ(buffer, content);
+  std::vector<char> vec;
+  EXPECT_EQ(read_file_at(AT_FDCWD, "test_read.txt", vec), 0);
+  EXPECT_EQ(std::string(vec.begin(), vec.end()), content);
+
+  EXPECT_EQ(read_file_into("non_existing_file.txt", buffer), ENOENT);
+  EXPECT_TRUE(buffer.empty());
+  EXPECT_EQ(read_file_into(".", buffer), EISDIR);
+
+  // 大小为 0 的 procfs 文件需要一直读到 EOF
+  EXPECT_EQ(read_file_into("/proc/self/status", buffer), 0);
+  EXPECT_NE(buffer.find("Name:"), std::string::npos);
+#endif
+
+  remove_path("test_read.txt");
+}
+
+#ifndef _WIN32
+TEST(fs_utils, read_files_batch) {
+  makedirs("test_dir");
+  std::vector<std::string> paths;
+  std::vector<std::string> contents;
+  for (int i = 0; i < 300; ++i) {
+    paths.push_back(path_join("test_dir", std::to_string(i) + ".json"));
+    contents.push_back(std::string(i * 97, char('a' + i % 26)));
+    std::ofstream(paths.back(), std::ios::binary) << contents.back();
+  }
+  paths.push_back("test_dir/non_existing.json");
+  paths.push_back("test_dir");
+  paths.push_back("/proc/self/status");
+
+  for (bool use_io_uring : {true, false}) {
+    BatchReadOptions options;
+    options.queue_depth = 8;
+    options.num_threads = 4;
+    options.use_io_uring = use_io_uring;
+
+    std::mutex mtx;
+    std::vector<int> errors(paths.size(), -1);
+    std::vector<std::string> results(paths.size());
+    EXPECT_EQ(read_files_batch(
+                  paths,
+                  [&](std::size_t index, int error, std::string &data) {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    errors[index] = error;
+                    results[index].swap(data);
+                  },
+                  options),
+              0);
+    for (std::size_t i = 0; i < contents.size(); ++i) {
+      EXPECT_EQ(errors[i], 0);
+      EXPECT_EQ(results[i], contents[i]);
+    }
+    EXPECT_EQ(errors[300], ENOENT);
+    EXPECT_EQ(errors[301], EISDIR);
+    EXPECT_EQ(errors[302], 0);
+    EXPECT_NE(results[302].find("Name:"), std::string::npos);
+  }
+
+  remove_path("test_dir");
+}
+#endif
+
+#ifndef _WIN32
+TEST(fs_utils, walk_and_read) {
+  std::map<std::string, std::string> expected;
+  for (int i = 0; i < 50; ++i) {
+    std::string dir = path_join("test_dir", "sub" + std::to_string(i % 5));
+    makedirs(dir);
+    std::string path = path_join(dir, std::to_string(i) + ".txt");
+    expected[path] = std::string(i * 1000, char('a' + i % 26));
+    std::ofstream(path, std::ios::binary) << expected[path];
+  }
+
+  std::vector<std::string> walk_order;
+  walkdir("test_dir",
+          [&](const std::string &path) { walk_order.push_back(path); });
+
+  for (std::size_t budget : {std::size_t(0), std::size_t(10000),
+                             std::size_t(1) << 30}) {
+    PrefetchOptions options;
+    options.lookahead = 4;
+    options.memory_budget = budget;
+    options.queue_capacity = 3;
+    std::vector<std::string> order;
+    walk_and_read(
+        "test_dir",
+        [&](const std::string &path, int error, std::string &data) {
+          EXPECT_EQ(error, 0);
+          EXPECT_EQ(data, expected[path]);
+          order.push_back(path);
+        },
+        options);
+    EXPECT_EQ(order, walk_order);
+  }
+
+  // 回调抛出异常时停止遍历
+  int count = 0;
+  EXPECT_THROW(walk_and_read("test_dir",
+                             [&](const std::string &, int, std::string &) {
+                               if (++count == 3) {
+                                 throw std::runtime_error("stop");
+                               }
+                             }),
+               std::runtime_error);
+  EXPECT_EQ(count, 3);
+
+  remove_path("test_dir");
+}
+#endif
+
+#ifndef _WIN32
+TEST(fs_utils, MappedFile) {
+  std::string content;
+  for (int i = 0; i < 100000; ++i) {
+    content += std::to_string(i) + "\n";
+  }
+  std::ofstream("test_mapped.txt", std::ios::binary) << content;
+
+  for (unsigned flags :
+       {unsigned(MappedFile::None), unsigned(MappedFile::Populate),
+        unsigned(MappedFile::HugePages)}) {
+    MappedFile file("test_mapped.txt", flags);
+    ASSERT_TRUE(file.is_open());
+    EXPECT_EQ(std::string(file.begin(), file.end()), content);
+    EXPECT_TRUE(file.advise(MappedFile::Advice::Sequential));
+    EXPECT_TRUE(file.advise(MappedFile::Advice::WillNeed, 5000, 100));
+
+    MappedFile moved(std::move(file));
+    EXPECT_FALSE(file.is_open());
+    EXPECT_EQ(moved.size(), content.size());
+  }
+
+#ifdef __linux__
+  // 大小不是页整数倍的 HugePages 映射关闭后不应残留 PROT_NONE 预留区
+  auto prot_none_bytes = [] {
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    uint64_t total = 0;
+    while (std::getline(maps, line)) {
+      unsigned long long begin = 0, end = 0;
+      char perms[5] = {};
+      if (std::sscanf(line.c_str(), "%llx-%llx %4s", &begin, &end, perms) ==
+              3 &&
+          std::string(perms) == "---p") {
+        total += end - begin;
+      }
+    }
+    return total;
+  };
+  std::string big(3 * 1024 * 1024 + 123, 'x');
+  std::ofstream("test_mapped_big.bin", std::ios::binary) << big;
+  uint64_t before = prot_none_bytes();
+  for (int i = 0; i < 20; ++i) {
+    MappedFile file("test_mapped_big.bin", MappedFile::HugePages);
+    ASSERT_TRUE(file.is_open());
+    EXPECT_EQ(file.size(), big.size());
+    EXPECT_EQ(file.data()[big.size() - 1], 'x');
+  }
+  EXPECT_EQ(prot_none_bytes(), before);
+  remove_path("test_mapped_big.bin");
+#endif
+
+  std::ofstream("test_empty.txt");
+  MappedFile empty("test_empty.txt");
+  EXPECT_TRUE(empty.is_open());
+  EXPECT_TRUE(empty.empty());
+
+  MappedFile missing("non_existing_file.txt");
+  EXPECT_FALSE(missing.is_open());
+  EXPECT_EQ(missing.error(), ENOENT);
+  EXPECT_FALSE(MappedFile(".").is_open());
+
+  remove_path("test_mapped.txt");
+  remove_path("test_empty.txt");
+}
+#endif
+
+#ifdef __linux__
+TEST(fs_utils, DirectoryIndex) {
+  makedirs("test_dir/sub");
+  std::ofstream("test_dir/a.jpg");
+  std::ofstream("test_dir/sub/b.png");
+  std::ofstream("test_dir/sub/c.txt");
+
+  DirectoryIndex index("test_dir/", std::chrono::milliseconds(20));
+  ASSERT_EQ(index.error(), 0);
+  EXPECT_EQ(index.root(), "test_dir");
+  EXPECT_EQ(index.size(), 5u);
+  EXPECT_EQ(index.images("test_dir"),
+            std::vector<std::string>({"test_dir/a.jpg", "test_dir/sub/b.png"}));
+  EXPECT_EQ(index.files("test_dir/sub/").size(), 2u);
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::map<std::string, IndexEvent::Kind> changes;
+  std::size_t id = index.subscribe([&](const std::vector<IndexEvent> &batch) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (const auto &event : batch) {
+      changes[event.path] = event.kind;
+    }
+    cv.notify_all();
+  });
+  auto wait_for = [&](const std::string &path) {
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, std::chrono::seconds(5),
+                       [&] { return changes.count(path) > 0; });
+  };
+
+  // 新目录中的文件、删除和修改都应反映到索引中
+  makedirs("test_dir/new/deep");
+  std::ofstream("test_dir/new/deep/d.jpg");
+  remove_path("test_dir/sub/c.txt");
+  std::ofstream("test_dir/a.jpg") << "changed";
+  ASSERT_TRUE(wait_for("test_dir/new/deep/d.jpg"));
+  ASSERT_TRUE(wait_for("test_dir/sub/c.txt"));
+  ASSERT_TRUE(wait_for("test_dir/a.jpg"));
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    EXPECT_EQ(changes["test_dir/new"], IndexEvent::Added);
+    EXPECT_EQ(changes["test_dir/new/deep/d.jpg"], IndexEvent::Added);
+    EXPECT_EQ(changes["test_dir/sub/c.txt"], IndexEvent::Removed);
+    EXPECT_EQ(changes["test_dir/a.jpg"], IndexEvent::Modified);
+    changes.clear();
+  }
+  IndexEntry entry;
+  ASSERT_TRUE(index.lookup("test_dir/a.jpg", entry));
+  EXPECT_EQ(entry.size, 7u);
+  EXPECT_FALSE(index.lookup("test_dir/sub/c.txt", entry));
+  EXPECT_EQ(index.images("test_dir/new").size(), 1u);
+
+  // 目录改名后旧路径下的项全部移除
+  ASSERT_EQ(rename("test_dir/new", "test_dir/moved"), 0);
+  ASSERT_TRUE(wait_for("test_dir/moved/deep/d.jpg"));
+  EXPECT_TRUE(index.images("test_dir/new").empty());
+  EXPECT_EQ(index.images("test_dir/moved"),
+            std::vector<std::string>({"test_dir/moved/deep/d.jpg"}));
+
+  // 与磁盘一致时重新扫描不产生事件
+  index.unsubscribe(id);
+  index.rescan("test_dir");
+  EXPECT_EQ(index.size(), 7u);
+  remove_path("test_dir");
+}
+
+TEST(fs_utils, TreeSnapshot) {
+  makedirs("test_dir/a/b");
+  makedirs("test_dir/c");
+  std::ofstream("test_dir/x.jpg") << "123";
+  std::ofstream("test_dir/a/y.png");
+  std::ofstream("test_dir/a/b/z.txt");
+  std::ofstream("test_dir/c/w.mp4");
+  // 与快照时间处于同一时钟周期内修改的目录总会被重新扫描
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  SnapshotStats stats;
+  ASSERT_EQ(save_snapshot("test_dir/", "test_snapshot.bin", &stats), 0);
+  EXPECT_EQ(stats.entries, 8u);
+  EXPECT_EQ(stats.dirs, 4u);
+  EXPECT_EQ(stats.rescanned, 4u);
+
+  TreeSnapshot snapshot("test_snapshot.bin");
+  ASSERT_TRUE(snapshot.is_open());
+  EXPECT_EQ(snapshot.size(), 8u);
+  EXPECT_EQ(snapshot.root(), "test_dir");
+  uint32_t x = snapshot.find("test_dir/x.jpg");
+  ASSERT_TRUE(x != TreeSnapshot::npos);
+  EXPECT_EQ(snapshot.path(x), "test_dir/x.jpg");
+  EXPECT_EQ(snapshot.entry(x).size, 3u);
+  EXPECT_EQ(snapshot.parent(x), 0u);
+  EXPECT_TRUE(snapshot.entry(snapshot.find("test_dir/a/b/")).is_dir());
+  EXPECT_TRUE(snapshot.find("test_dir/missing") == TreeSnapshot::npos);
+  EXPECT_TRUE(snapshot.find("test_dirx") == TreeSnapshot::npos);
+  EXPECT_EQ(snapshot.images("test_dir"),
+            std::vector<std::string>({"test_dir/a/y.png", "test_dir/x.jpg"}));
+  EXPECT_EQ(snapshot.videos("test_dir/c"),
+            std::vector<std::string>({"test_dir/c/w.mp4"}));
+  EXPECT_EQ(snapshot.files("test_dir/a").size(), 2u);
+
+  // 只有内容变化的目录会被重新扫描
+  std::ofstream("test_dir/a/b/new.jpg");
+  ASSERT_EQ(update_snapshot("test_dir", "test_snapshot.bin", &stats), 0);
+  EXPECT_EQ(stats.dirs, 4u);
+  EXPECT_EQ(stats.rescanned, 1u);
+  EXPECT_EQ(stats.entries, 9u);
+  // 旧的映射不受替换影响
+  EXPECT_EQ(snapshot.size(), 8u);
+  ASSERT_TRUE(snapshot.open("test_snapshot.bin"));
+  EXPECT_EQ(snapshot.images("test_dir/a").size(), 2u);
+  EXPECT_EQ(snapshot.entry(snapshot.find("test_dir/x.jpg")).size, 3u);
+
+  std::ofstream("test_snapshot.bin") << "garbage";
+  EXPECT_FALSE(snapshot.open("test_snapshot.bin"));
+  EXPECT_EQ(snapshot.error(), EINVAL);
+  remove_path("test_snapshot.bin");
+  remove_path("test_dir");
+}
+#endif
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
 
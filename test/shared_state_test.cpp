@@ -0,0 +1,14 @@
+// 第二个翻译单元：main_test.cpp 通过这些函数检查进程级共享的缓存与注册表
+#include "fs_utils.hpp"
+
+bool dir_cached_in_other_tu(const std::string &path) {
+  return dir_cache().contains(path);
+}
+
+#ifndef _WIN32
+bool stat_cache_enabled_in_other_tu() { return stat_cache() != nullptr; }
+#endif
+
+FileCategory classify_file_in_other_tu(const std::string &name) {
+  return classify_file(name);
+}